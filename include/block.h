@@ -0,0 +1,49 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+A disk image. With an overlay the image itself is only read, everything written goes to the overlay
+file in BLOCK_CLUSTER_SIZE pieces and is read back from there. Many VMs can share one image this way.
+*/
+
+#define BLOCK_CLUSTER_SIZE 0x1000
+#define BLOCK_DIRECT_ALIGN 512 // buffer, offset and length of an O_DIRECT transfer
+
+typedef enum
+{
+    BLOCK_BACKEND_PREAD,
+    BLOCK_BACKEND_URING,
+} block_backend_t;
+
+typedef struct
+{
+    int fd;
+    uint64_t size;
+    bool read_only;
+    int overlay_fd;       // -1 without an overlay
+    uint8_t *overlay_map; // a bit per cluster that lives in the overlay
+    pthread_mutex_t overlay_mutex;
+    int direct_fd;              // the image opened with O_DIRECT, -1 unless asked for
+    struct block_uring *uring; // NULL with the pread backend
+} block_t;
+
+// Applies to every disk opened afterwards
+bool block_parse_backend(const char *name);
+
+block_t *block_open(const char *path, bool read_only);
+// path NULL keeps the overlay in memory, it's gone when the VM exits
+block_t *block_open_overlay(const char *path, const char *overlay_path);
+void block_close(block_t *block);
+// Transfers entirely inside data use the io_uring fixed buffer path
+void block_register_buffer(block_t *block, void *data, size_t size);
+
+uint64_t block_get_size(block_t *block);
+bool block_read(block_t *block, void *data, uint64_t offset, size_t size);
+bool block_write(block_t *block, const void *data, uint64_t offset, size_t size);
+
+#endif
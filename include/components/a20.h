@@ -4,7 +4,7 @@
 #include "common.h"
 #include "io_manager.h"
 
-// void a20_init();
-void a20_handle(exit_io_info_t* io, uint8_t* base);
+void a20_init(void *opaque);
+void a20_handle(void *opaque, exit_io_info_t *io, uint8_t *base);
 
 #endif
\ No newline at end of file
@@ -1,17 +1,27 @@
 #ifndef ATA_H
 #define ATA_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include "io_manager.h"
 
-void ata_init_disks(char* kernel_path, char* harddisk_path);
+void ata_init_disks(char* kernel_path, char* harddisk_path, bool overlay, char* overlay_path);
 void ata_deinit_disks();
+bool ata_read_cdrom(void *data, uint64_t lba, uint32_t count);
+uint64_t ata_get_cdrom_sectors();
 
-void ata_init_primary();
-void ata_init_secondary();
+// The two channels, passed as the opaque of their ports
+typedef struct ata_channel ata_channel_t;
+extern ata_channel_t ata_primary;
+extern ata_channel_t ata_secondary;
 
-void ata_handle_io_primary(exit_io_info_t* io, uint8_t* base);
-void ata_handle_control_primary(exit_io_info_t* io, uint8_t* base);
-void ata_handle_io_secondary(exit_io_info_t* io, uint8_t* base);
-void ata_handle_control_secondary(exit_io_info_t* io, uint8_t* base);
+void ata_pause_workers();
+void ata_resume_workers();
+
+void ata_init(void *opaque);
+void ata_handle_io(void *opaque, exit_io_info_t *io, uint8_t *base);
+void ata_handle_data(void *opaque, exit_io_info_t *io, uint8_t *base);
+void ata_handle_control(void *opaque, exit_io_info_t *io, uint8_t *base);
+void ata_handle_bus_master(void *opaque, exit_io_info_t *io, uint8_t *base);
 
 #endif
\ No newline at end of file
@@ -4,7 +4,7 @@
 #include "common.h"
 #include "io_manager.h"
 
-void cmos_init();
-void cmos_handle(exit_io_info_t* io, uint8_t* base);
+void cmos_init(void *opaque);
+void cmos_handle(void *opaque, exit_io_info_t *io, uint8_t *base);
 
 #endif
\ No newline at end of file
@@ -3,7 +3,7 @@
 
 #include "io_manager.h"
 
-void com_init();
-void com_handle(exit_io_info_t* io, uint8_t* base);
+void com_init(void *opaque);
+void com_handle(void *opaque, exit_io_info_t *io, uint8_t *base);
 
 #endif
\ No newline at end of file
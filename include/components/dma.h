@@ -3,7 +3,13 @@
 
 #include "io_manager.h"
 
-void dma_handle_master(exit_io_info_t* io, uint8_t* base);
-void dma_handle_slave(exit_io_info_t* io, uint8_t* base);
+// The two controllers, passed as the opaque of their ports
+typedef struct dma_slave dma_slave_t;
+typedef struct dma_master dma_master_t;
+extern dma_slave_t dma_slave;
+extern dma_master_t dma_master;
+
+void dma_init(void *opaque);
+void dma_handle(void *opaque, exit_io_info_t *io, uint8_t *base);
 
 #endif
\ No newline at end of file
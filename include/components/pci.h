@@ -4,10 +4,13 @@
 #include <stdint.h>
 #include "common.h"
 #include "io_manager.h"
+#include "mmio_manager.h"
 
-void pci_init();
+void pci_init(void *opaque);
 // void pci_add_device(uint8_t bus, uint8_t device, uint8_t function, uint16_t vendor_id, uint16_t device_id);
-void pci_handle(exit_io_info_t* io, uint8_t* base);
+void pci_add_mmio_bar(uint8_t bus, uint8_t device, uint8_t function, uint8_t bar, uint32_t size, mmio_handle_t handle, void *opaque);
+void pci_add_io_bar(uint8_t bus, uint8_t device, uint8_t function, uint8_t bar, uint32_t size, io_handle_t handle, void *opaque);
+void pci_handle(void *opaque, exit_io_info_t *io, uint8_t *base);
 
 
 // void pci_set_config_u8(uint8_t device_index, enum pci_config_space_registers reg, uint8_t value);
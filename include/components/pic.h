@@ -1,6 +1,7 @@
 #ifndef PIC_H
 #define PIC_H
 
+#include <stdbool.h>
 #include "io_manager.h"
 
 // Master
@@ -22,12 +23,16 @@
 #define PIC_IRQ14 0xe
 #define PIC_IRQ15 0xf
 
-void pic_init_master();
-void pic_init_slave();
+// The two chips, passed as the opaque of their ports
+typedef struct pic pic_t;
+extern pic_t pic_master;
+extern pic_t pic_slave;
 
-void pic_handle_master(exit_io_info_t* io, uint8_t* base);
-void pic_handle_slave(exit_io_info_t* io, uint8_t* base);
+void pic_init(void *opaque);
+void pic_handle(void *opaque, exit_io_info_t *io, uint8_t *base);
 
 void pic_raise_interrupt(uint8_t irq);
+bool pic_has_interrupt();
+int pic_acknowledge_interrupt();
 
 #endif
\ No newline at end of file
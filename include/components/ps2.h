@@ -3,7 +3,7 @@
 
 #include "io_manager.h"
 
-void ps2_init();
-void ps2_handle(exit_io_info_t* io, uint8_t* base);
+void ps2_init(void *opaque);
+void ps2_handle(void *opaque, exit_io_info_t *io, uint8_t *base);
 
 #endif
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "io_manager.h"
 
-void seabios_info_handle(exit_io_info_t* io, uint8_t* base);
+void seabios_info_init(void *opaque);
+void seabios_info_handle(void *opaque, exit_io_info_t *io, uint8_t *base);
 
 #endif
\ No newline at end of file
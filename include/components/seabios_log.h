@@ -4,8 +4,8 @@
 #include <stdio.h>
 #include "io_manager.h"
 
-void seabios_log_init();
-void seabios_log_handle(exit_io_info_t* io, uint8_t* base);
+void seabios_log_init(void *opaque);
+void seabios_log_handle(void *opaque, exit_io_info_t *io, uint8_t *base);
 
 FILE* seabios_log_get_file();
 
@@ -2,6 +2,7 @@
 #define IO_MANAGER_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #define EXIT_IO_IN 0
 #define EXIT_IO_OUT 1
@@ -14,10 +15,39 @@ typedef struct
     uint64_t data_offset;
 } exit_io_info_t;
 
-typedef void (*io_handle_t)(exit_io_info_t *io, uint8_t* base);
-typedef void (*io_init_t)();
+#define IO_PORT_COUNT 0x10000
+#define IO_WIDTHS 3 // 1, 2 and 4 byte accesses
+#define IO_WIDTH_INDEX(size) ((size) >> 1)
 
-void io_manager_register(io_init_t init, io_handle_t handle, uint32_t start_port, uint32_t end_port);
+// opaque is whatever the port was registered with, e.g. which of two identical chips it is.
+// A rep ins/outs exit carries io->count elements of io->size bytes back to back at base + io->data_offset.
+// Unless the port is batched its handler only ever sees count 1, io_manager hands it the elements one by one.
+typedef void (*io_handle_t)(void *opaque, exit_io_info_t *io, uint8_t *base);
+typedef void (*io_init_t)(void *opaque);
+
+// An entry of a device table, see io_manager_register_devices
+typedef struct
+{
+    io_init_t init; // NULL for the second range of a device that is already set up
+    io_handle_t handle;
+    void *opaque;
+    uint16_t start_port;
+    uint16_t end_port;
+    bool batched; // the handler consumes all io->count elements itself
+} io_device_t;
+
+void io_manager_register(io_init_t init, io_handle_t handle, void *opaque, uint32_t start_port, uint32_t end_port);
+void io_manager_register_width(io_handle_t handle, void *opaque, uint32_t start_port, uint32_t end_port, uint8_t size);
+void io_manager_register_batched(uint32_t start_port, uint32_t end_port);
+bool io_manager_map(io_handle_t handle, void *opaque, uint32_t start_port, uint32_t size);
+void io_manager_unmap(uint32_t start_port, uint32_t size);
+void io_manager_register_devices(const io_device_t *devices, int count);
 void io_manager_handle(exit_io_info_t *io, uint8_t* base);
+void io_manager_lock();
+void io_manager_unlock();
+
+void io_manager_register_coalesced(uint32_t start_port, uint32_t end_port);
+void io_manager_drain_coalesced();
+void io_manager_deinit();
 
 #endif
\ No newline at end of file
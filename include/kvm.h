@@ -4,23 +4,100 @@
 #include <linux/kvm.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define KVM_MAX_VCPUS 64
+#define KVM_BOOT_VCPU 0
+
+typedef enum
+{
+    KVM_IRQCHIP_USERSPACE, // PIC emulated in pic.c, no apic
+    KVM_IRQCHIP_SPLIT,     // lapics in the kernel, PIC in pic.c
+    KVM_IRQCHIP_KERNEL,    // PIC, IOAPIC and lapics in the kernel
+} kvm_irqchip_mode_t;
+
+typedef struct
+{
+    int id;
+    int fd;
+    struct kvm_run *run;
+    size_t run_size;
+    pthread_t thread;
+    bool started;
+    bool exited; // left its run loop, see kvm_run
+
+    // register cache, only touched by the vcpu's own thread and dropped on every exit
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    bool regs_valid;
+    bool regs_dirty;
+    bool sregs_valid;
+    bool sregs_dirty;
+} kvm_vcpu_t;
+
+#define KVM_MAX_SAVED_MSRS 512
+
+// Everything needed to put a vcpu back where it was, see kvm_save_vcpu
+typedef struct
+{
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    struct kvm_fpu fpu;
+    struct kvm_xsave xsave;
+    struct kvm_xcrs xcrs;
+    struct kvm_lapic_state lapic;
+    struct kvm_mp_state mp_state;
+    struct kvm_vcpu_events events;
+    struct kvm_debugregs debugregs;
+    bool has_xsave;
+    bool has_xcrs;
+    bool has_lapic;
+    uint32_t msr_count;
+    struct kvm_msr_entry msrs[KVM_MAX_SAVED_MSRS];
+} kvm_vcpu_state_t;
+
+typedef struct
+{
+    uint32_t irqchip_mode;
+    struct kvm_irqchip chips[3]; // pic master, pic slave, ioapic. Only with the in-kernel irqchip.
+    struct kvm_clock_data clock;
+} kvm_vm_state_t;
 
 // int kvm_open();
 // void kvm_verify_version(int kvm);
 // int kvm_create_vm(int kvm);
+int kvm_check_extension(int capability);
 void kvm_set_userspace_memory_region(struct kvm_userspace_memory_region *memory_region);
+int kvm_create_irqfd(uint32_t gsi);
+bool kvm_register_coalesced_pio(uint64_t port, uint32_t size);
+struct kvm_coalesced_mmio_ring *kvm_get_coalesced_ring();
 // int kvm_create_vcpu();
-struct kvm_run* kvm_map_run();
+struct kvm_run* kvm_map_run(kvm_vcpu_t *vcpu);
+kvm_vcpu_t *kvm_get_vcpu(int id);
+kvm_vcpu_t *kvm_current_vcpu();
+bool kvm_is_vcpu_thread();
+int kvm_get_vm_fd();
+int kvm_get_vcpu_count();
+void kvm_kick_vcpu(kvm_vcpu_t *vcpu);
+void kvm_pause();
+void kvm_resume();
+void kvm_save_vcpu(kvm_vcpu_t *vcpu, kvm_vcpu_state_t *state);
+void kvm_load_vcpu(kvm_vcpu_t *vcpu, kvm_vcpu_state_t *state);
+void kvm_save_vm(kvm_vm_state_t *state);
+void kvm_load_vm(kvm_vm_state_t *state);
 void kvm_print_regs();
 void kvm_get_regs(struct kvm_regs *regs);
 void kvm_set_regs(struct kvm_regs *regs);
 void kvm_get_sregs(struct kvm_sregs *sregs);
 void kvm_set_sregs(struct kvm_sregs* sregs);
-void kvm_init(char *file_name);
+void kvm_init(char *file_name, int vcpu_count, bool kernel_irqchip);
 void kvm_run();
 void kvm_deinit();
 void kvm_pause_vcpu();
-void kvm_interrupt(uint32_t vector);
+bool kvm_interrupt(uint32_t vector);
+kvm_irqchip_mode_t kvm_get_irqchip_mode();
+void kvm_irq_line(uint32_t irq, int level);
 bool kvm_is_interrupts_enabled();
 
-#endif
\ No newline at end of file
+#endif
@@ -1,9 +1,8 @@
 #ifndef ELF_LOADER_H
 #define ELF_LOADER_H
 
-#include <stdint.h>
-#include <stdlib.h>
+#include <stdbool.h>
 
-uint32_t elf_load(int vm, uint8_t* code, size_t size);
+bool elf_load(const char *path, const char *module_path, const char *cmdline);
 
-#endif
\ No newline at end of file
+#endif
@@ -2,8 +2,10 @@
 #define ISO_LOADER_H
 
 #include <stdint.h>
-#include <stdlib.h>
+#include "io_manager.h"
 
-uint32_t iso_load(uint8_t* guest_memory, uint8_t* code, size_t size);
+void iso_init();
+void iso_load();
+void iso_handle_services(void *opaque, exit_io_info_t *io, uint8_t *base);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,6 @@
+#ifndef LINUX_LOADER_H
+#define LINUX_LOADER_H
+
+void linux_load(const char *kernel_path, const char *initrd_path, const char *cmdline);
+
+#endif
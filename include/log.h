@@ -1,15 +1,101 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <stdint.h>
+
 #define LOG_DEFINE(module_name) \
     static const char *current_module_name = module_name; \
 
+// Only the format pointer and the raw arguments are recorded, tools/trace_decode formats them later.
+// So fmt and any %s argument must be string literals.
 #define LOG_MSG(fmt, ...) \
-    log_print("- %s] " fmt, current_module_name, ##__VA_ARGS__)
+    log_print(current_module_name, fmt, ##__VA_ARGS__)
 
 void log_init();
-void log_print(const char *fmt, ...);
+void log_print(const char *module, const char *fmt, ...);
+void log_flush();
 void log_deinit();
 
+// trace.bin layout: log_trace_header_t followed by entries, each starting with a uint32_t log_trace_entry_t
+#define LOG_TRACE_MAGIC "KVMTRACE"
+#define LOG_TRACE_VERSION 1
+#define LOG_MAX_ARGS 6
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} log_trace_header_t;
+
+typedef enum
+{
+    LOG_TRACE_STRING = 1,  // uint64_t id, uint32_t length, length bytes
+    LOG_TRACE_EVENT = 2,   // log_record_t
+    LOG_TRACE_DROPPED = 3, // uint32_t tid, uint32_t count
+} log_trace_entry_t;
+
+typedef struct
+{
+    uint64_t timestamp; // CLOCK_MONOTONIC ns
+    uint64_t rip;       // 0 outside of vcpu threads
+    uint64_t fmt;       // string ids, defined by an earlier LOG_TRACE_STRING entry
+    uint64_t module;
+    uint32_t tid;
+    uint16_t nargs;
+    uint16_t string_args; // bit n set when args[n] is a string id
+    uint64_t args[LOG_MAX_ARGS];
+} log_record_t;
+
+typedef enum
+{
+    LOG_ARG_NONE, // %% or the end of the string
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_POINTER,
+    LOG_ARG_STRING,
+} log_arg_t;
+
+// Shared with the decoder so both sides agree on how many arguments a format takes.
+// fmt points right after a '%', end is set to the conversion character.
+static inline log_arg_t log_parse_conversion(const char *fmt, const char **end)
+{
+    const char *c = fmt;
+    while (*c == '-' || *c == '+' || *c == ' ' || *c == '#' || *c == '0' || *c == '.' || (*c >= '1' && *c <= '9'))
+    {
+        c++;
+    }
+    int longs = 0;
+    while (*c == 'l' || *c == 'h' || *c == 'z' || *c == 'j' || *c == 't')
+    {
+        longs += *c != 'h';
+        c++;
+    }
+    *end = c;
+
+    switch (*c)
+    {
+    case 's':
+        return LOG_ARG_STRING;
+    case 'p':
+        return LOG_ARG_POINTER;
+    case 'f':
+    case 'e':
+    case 'g':
+        return LOG_ARG_DOUBLE;
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'o':
+    case 'b':
+    case 'c':
+        return longs ? LOG_ARG_LONG : LOG_ARG_INT;
+    default:
+        return LOG_ARG_NONE;
+    }
+}
 
-#endif
\ No newline at end of file
+#endif
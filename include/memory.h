@@ -0,0 +1,112 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MEMORY_DEFAULT_SIZE (128ULL << 20)
+#define MEMORY_PCI_HOLE_START 0xC0000000ULL // 3-4 GiB is left for PCI BARs, the lapic, the ioapic and the BIOS
+#define MEMORY_4G 0x100000000ULL
+#define MEMORY_VGA_START 0xA0000
+#define MEMORY_VGA_END 0xC0000
+#define MEMORY_SHADOW_START 0xC0000 // 768K - 1M is routed to ROM or shadow ram by the PAM registers
+#define MEMORY_SHADOW_END 0x100000
+
+#define MEMORY_EBDA_START 0x9FC00 // the top 1K of low memory is the BIOS's, like on a real board
+#define MEMORY_BIOS_START 0xF0000
+
+#define MEMORY_MAX_REGIONS 64
+#define MEMORY_PAM_REGISTERS 7
+
+typedef enum
+{
+    MEMORY_BACKEND_ANONYMOUS,
+    MEMORY_BACKEND_MEMFD,
+    MEMORY_BACKEND_HUGETLBFS,
+    MEMORY_BACKEND_TEMPLATE, // MAP_PRIVATE of a template snapshot, shared until written
+} memory_backend_t;
+
+typedef struct
+{
+    uint64_t size;
+    memory_backend_t backend;
+    const char *hugetlbfs_path; // directory on a hugetlbfs mount, for MEMORY_BACKEND_HUGETLBFS
+    uint64_t hugepage_size;     // memfd only: 0 for regular pages, 2M or 1G for MFD_HUGETLB
+    bool transparent_hugepages; // MADV_HUGEPAGE
+    bool mergeable;             // MADV_MERGEABLE (KSM), only effective on anonymous memory
+    int numa_node;              // -1 to leave placement to the kernel
+    const char *template_path;  // MEMORY_BACKEND_TEMPLATE only: the file and where the ram starts in it
+    uint64_t template_offset;
+} memory_config_t;
+
+// The guest's view of its address space for the direct boot loaders, types numbered like e820
+#define MEMORY_MAP_RAM 1
+#define MEMORY_MAP_RESERVED 2
+#define MEMORY_MAP_ENTRIES 5
+
+typedef struct
+{
+    uint64_t gpa;
+    uint64_t size;
+    uint32_t type;
+} memory_map_entry_t;
+
+void memory_config_default(memory_config_t *config);
+bool memory_parse_size(const char *text, uint64_t *size);
+bool memory_parse_backend(const char *text, memory_config_t *config);
+
+typedef struct
+{
+    bool used;
+    uint64_t gpa;
+    uint64_t size;
+    void *hva;
+    uint32_t flags; // KVM_MEM_*
+} memory_region_t;
+
+void memory_init(memory_config_t *config);
+void memory_map();
+void memory_map_bios(const char *path);
+void memory_deinit();
+
+int memory_add_region(uint64_t gpa, uint64_t size, void *hva, uint32_t flags);
+void memory_remove_region(int slot);
+memory_region_t *memory_get_region(int slot);
+void *memory_map_rom(const char *path, uint64_t *size);
+
+void memory_start_dirty_log();
+void memory_stop_dirty_log();
+void memory_sync_dirty_log(uint64_t *bitmap);
+uint64_t memory_dirty_bitmap_words();
+void memory_mark_dirty(uint64_t gpa, uint64_t size);
+
+void memory_set_pam(uint8_t pam[MEMORY_PAM_REGISTERS]);
+bool memory_handle_mmio(uint64_t gpa, uint8_t *data, uint32_t length, bool is_write);
+
+uint8_t *memory_get_ram();
+void memory_discard();
+bool memory_is_template();
+int memory_get_fd();
+uint64_t memory_get_page_size();
+uint64_t memory_get_size();
+uint64_t memory_get_below_4g();
+uint64_t memory_get_above_4g();
+void *memory_gpa_to_hva(uint64_t gpa, uint64_t size);
+int memory_get_map(memory_map_entry_t entries[MEMORY_MAP_ENTRIES]);
+
+// One buffer of a device's scatter gather list, in guest physical memory
+typedef struct
+{
+    uint64_t gpa;
+    uint64_t size;
+} memory_sg_t;
+
+void *memory_dma_map(uint64_t gpa, uint64_t size);
+void memory_dma_unmap(void *hva, uint64_t size, bool written);
+bool memory_dma_read(uint64_t gpa, void *data, uint64_t size);
+bool memory_dma_write(uint64_t gpa, const void *data, uint64_t size);
+uint64_t memory_dma_sg_read(const memory_sg_t *sg, int count, uint64_t offset, void *data, uint64_t size);
+uint64_t memory_dma_sg_write(const memory_sg_t *sg, int count, uint64_t offset, const void *data, uint64_t size);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef MIGRATION_H
+#define MIGRATION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+Pre-copy live migration over a unix socket. The stream: migration_header_t, then messages, each a
+migration_message_t followed by length bytes for MIGRATION_PAGES and MIGRATION_STATE.
+The ram is sent while the guest keeps running, then again whatever it dirtied meanwhile, until that
+converges. The final round, the vcpu and device state (a snapshot without ram) go out with the guest paused.
+*/
+
+#define MIGRATION_MAGIC "KVMMIGR"
+#define MIGRATION_VERSION 1
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t ram_size;
+} migration_header_t;
+
+typedef enum
+{
+    MIGRATION_PAGES, // ram from offset, length bytes follow
+    MIGRATION_ZERO,  // length bytes of ram from offset are zero
+    MIGRATION_STATE, // snapshot_save_state output
+    MIGRATION_END,   // the receiver answers with one byte once the state is loaded
+} migration_message_type_t;
+
+typedef struct
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t offset; // into the ram (see memory_get_ram), not a guest physical address
+    uint64_t length;
+} migration_message_t;
+
+bool migration_send(const char *socket_path);
+void migration_receive(const char *socket_path);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef MMIO_MANAGER_H
+#define MMIO_MANAGER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MMIO_MAX_REGIONS 32
+#define MMIO_UNMAPPED UINT64_MAX
+
+// offset is relative to wherever the region is mapped right now, so a moved PCI BAR needs no changes in the device
+typedef void (*mmio_handle_t)(void *opaque, uint64_t offset, uint8_t *data, uint32_t length, bool is_write);
+
+int mmio_manager_register(mmio_handle_t handle, void *opaque, uint64_t gpa, uint64_t size);
+void mmio_manager_move(int id, uint64_t gpa);
+bool mmio_manager_handle(uint64_t gpa, uint8_t *data, uint32_t length, bool is_write);
+
+#endif
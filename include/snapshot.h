@@ -0,0 +1,79 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "memory.h"
+
+/*
+snapshot file: snapshot_header_t, then sections, each a snapshot_section_t followed by size bytes.
+Sections: "machine", "vm", "vcpu.<n>", "device.<name>" and "ram", or "ram.raw" in a template. A section's version belongs to its own layout,
+so a device can change its state without touching the others.
+*/
+
+#define SNAPSHOT_MAGIC "KVMSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NAME_SIZE 32
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+} snapshot_header_t;
+
+typedef struct
+{
+    char name[SNAPSHOT_NAME_SIZE];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t size;
+} snapshot_section_t;
+
+// ram section: this header, a bitmap with a set bit per zero page, the chunk index, then the chunks.
+// A chunk holds only its non zero pages, zlib compressed. Zero length chunks are all zeros.
+#define SNAPSHOT_RAM_VERSION 1
+#define SNAPSHOT_CHUNK_SIZE (1 << 20)
+
+typedef struct
+{
+    uint64_t ram_size;
+    uint32_t chunk_size;
+    uint32_t chunk_count;
+} snapshot_ram_header_t;
+
+typedef struct
+{
+    uint64_t offset; // from the start of the section data
+    uint32_t length;
+    uint32_t reserved;
+} snapshot_chunk_index_t;
+
+// template ram: this header, then the ram as is from data_offset, which is page aligned so it can be mapped
+typedef struct
+{
+    uint64_t ram_size;
+    uint64_t data_offset; // from the start of the file
+} snapshot_raw_header_t;
+
+typedef void (*snapshot_post_load_t)();
+
+// what SIGUSR2 does with the path given to snapshot_init
+typedef enum
+{
+    SNAPSHOT_ON_SIGNAL_SAVE,
+    SNAPSHOT_ON_SIGNAL_TEMPLATE,
+    SNAPSHOT_ON_SIGNAL_MIGRATE, // the path is the socket of the receiving vmm
+} snapshot_signal_action_t;
+
+void snapshot_init(char *path, snapshot_signal_action_t action);
+void snapshot_register(const char *name, uint32_t version, void *state, size_t size, snapshot_post_load_t post_load);
+void snapshot_save(const char *path);
+void snapshot_save_template(const char *path);
+void snapshot_save_state(int fd);
+void snapshot_restore(const char *path, bool lazy);
+void snapshot_restore_state(int fd);
+void snapshot_open_template(const char *path, memory_config_t *config);
+
+#endif
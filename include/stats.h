@@ -0,0 +1,26 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "io_manager.h"
+
+void stats_init(char *dump_path);
+void stats_deinit();
+void stats_dump(FILE *file);
+
+void stats_count_exit(uint32_t exit_reason);
+void stats_count_port(uint16_t port);
+void stats_count_mmio(uint64_t address);
+// Keyed by the handler function, io_handle_t or mmio_handle_t
+void stats_record_handler(void *handle, uint64_t start_ns);
+
+static inline uint64_t stats_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#endif
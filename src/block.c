@@ -0,0 +1,547 @@
+#define _GNU_SOURCE
+#include "block.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define BLOCK_URING_ENTRIES 64
+#define BLOCK_URING_CHUNK 0x20000 // big transfers are split so the pieces run in parallel
+#define BLOCK_URING_MAX_BUFFERS 8
+
+// the fixed files of every ring, missing ones are stood in for by the image
+enum
+{
+    BLOCK_FILE_IMAGE,
+    BLOCK_FILE_OVERLAY,
+    BLOCK_FILE_DIRECT,
+    BLOCK_FILES
+};
+
+/*
+The io_uring backend, set up with raw syscalls. Every disk has its own ring with its files registered, a transfer
+is cut into BLOCK_URING_CHUNK pieces that are all submitted at once and waited for together. Pieces inside a
+registered buffer (the ata data buffers) use the fixed buffer opcodes, everything else (e.g. guest ram) is read in
+place. A disk only ever has one transfer in flight from the ata worker, the mutex is for the rare other caller.
+*/
+struct block_uring
+{
+    int fd;
+    pthread_mutex_t mutex;
+    uint8_t *sq_ring;
+    size_t sq_ring_size;
+    uint8_t *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    struct io_uring_cqe *cqes;
+    uint32_t entries;
+    struct iovec buffers[BLOCK_URING_MAX_BUFFERS];
+    int buffer_count;
+};
+
+static block_backend_t block_backend = BLOCK_BACKEND_PREAD;
+static bool block_direct = false;
+
+// pread (default), uring or uring:direct
+bool block_parse_backend(const char *name)
+{
+    if (strcmp(name, "pread") == 0)
+    {
+        block_backend = BLOCK_BACKEND_PREAD;
+        block_direct = false;
+    }
+    else if (strcmp(name, "uring") == 0 || strcmp(name, "uring:direct") == 0)
+    {
+        block_backend = BLOCK_BACKEND_URING;
+        block_direct = strcmp(name, "uring:direct") == 0;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+static bool block_pread(int fd, void *data, size_t size, uint64_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t bytes = pread(fd, data, size, offset);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes < 0)
+        {
+            return false;
+        }
+        if (bytes == 0)
+        {
+            memset(data, 0, size); // past the end of a sparse overlay
+            return true;
+        }
+        data = (uint8_t *)data + bytes;
+        size -= bytes;
+        offset += bytes;
+    }
+    return true;
+}
+
+static bool block_pwrite(int fd, const void *data, size_t size, uint64_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t bytes = pwrite(fd, data, size, offset);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return false;
+        }
+        data = (const uint8_t *)data + bytes;
+        size -= bytes;
+        offset += bytes;
+    }
+    return true;
+}
+
+#pragma region URING
+
+static struct block_uring *block_uring_create(block_t *block)
+{
+    struct io_uring_params params = {0};
+    int fd = syscall(__NR_io_uring_setup, BLOCK_URING_ENTRIES, &params);
+    if (fd < 0)
+    {
+        warn("io_uring is unavailable, using pread");
+        return NULL;
+    }
+    struct block_uring *uring = calloc(1, sizeof(struct block_uring));
+    if (uring == NULL)
+    {
+        err(1, "Failed to allocate an io_uring");
+    }
+    uring->fd = fd;
+    uring->mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    uring->entries = params.sq_entries;
+
+    uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && uring->cq_ring_size > uring->sq_ring_size)
+    {
+        uring->sq_ring_size = uring->cq_ring_size;
+    }
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    uring->cq_ring = single_mmap ? uring->sq_ring : mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (uring->sq_ring == MAP_FAILED || uring->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED)
+    {
+        err(1, "Failed to map the io_uring");
+    }
+    uring->sq_tail = (uint32_t *)(uring->sq_ring + params.sq_off.tail);
+    uring->sq_mask = (uint32_t *)(uring->sq_ring + params.sq_off.ring_mask);
+    uring->sq_array = (uint32_t *)(uring->sq_ring + params.sq_off.array);
+    uring->cq_head = (uint32_t *)(uring->cq_ring + params.cq_off.head);
+    uring->cq_tail = (uint32_t *)(uring->cq_ring + params.cq_off.tail);
+    uring->cq_mask = (uint32_t *)(uring->cq_ring + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(uring->cq_ring + params.cq_off.cqes);
+
+    int files[BLOCK_FILES] = {
+        [BLOCK_FILE_IMAGE] = block->fd,
+        [BLOCK_FILE_OVERLAY] = block->overlay_fd >= 0 ? block->overlay_fd : block->fd,
+        [BLOCK_FILE_DIRECT] = block->direct_fd >= 0 ? block->direct_fd : block->fd,
+    };
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, files, BLOCK_FILES) < 0)
+    {
+        err(1, "Failed to register the disk files with io_uring");
+    }
+    return uring;
+}
+
+static void block_uring_destroy(struct block_uring *uring)
+{
+    munmap(uring->sqes, uring->sqes_size);
+    if (uring->cq_ring != uring->sq_ring)
+    {
+        munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+    munmap(uring->sq_ring, uring->sq_ring_size);
+    close(uring->fd);
+    free(uring);
+}
+
+void block_register_buffer(block_t *block, void *data, size_t size)
+{
+    struct block_uring *uring = block->uring;
+    if (uring == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&uring->mutex);
+    if (uring->buffer_count == BLOCK_URING_MAX_BUFFERS)
+    {
+        errx(1, "Too many io_uring buffers");
+    }
+    if (uring->buffer_count > 0)
+    {
+        syscall(__NR_io_uring_register, uring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    }
+    uring->buffers[uring->buffer_count++] = (struct iovec){.iov_base = data, .iov_len = size};
+    if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_BUFFERS, uring->buffers, uring->buffer_count) < 0)
+    {
+        // e.g. RLIMIT_MEMLOCK, the transfers still work without
+        warn("Failed to register io_uring buffers");
+        uring->buffer_count = 0;
+    }
+    pthread_mutex_unlock(&uring->mutex);
+}
+
+static int block_uring_find_buffer(struct block_uring *uring, const uint8_t *data, size_t size)
+{
+    for (int i = 0; i < uring->buffer_count; i++)
+    {
+        const uint8_t *base = uring->buffers[i].iov_base;
+        if (data >= base && data + size <= base + uring->buffers[i].iov_len)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// A transfer that starts in a registered buffer has to end inside it, the kernel would write past it otherwise
+static bool block_uring_fits_buffer(struct block_uring *uring, const uint8_t *data, size_t size)
+{
+    for (int i = 0; i < uring->buffer_count; i++)
+    {
+        const uint8_t *base = uring->buffers[i].iov_base;
+        if (data >= base && data < base + uring->buffers[i].iov_len)
+        {
+            return size <= (size_t)(base + uring->buffers[i].iov_len - data);
+        }
+    }
+    return true;
+}
+
+static bool block_is_direct(block_t *block, int file, const uint8_t *data, size_t size, uint64_t offset)
+{
+    return file == BLOCK_FILE_IMAGE && block->direct_fd >= 0 &&
+           ((uintptr_t)data | size | offset) % BLOCK_DIRECT_ALIGN == 0;
+}
+
+// Short or failed pieces are finished with pread and pwrite, which also zero fill past the end of an overlay
+static bool block_uring_io(block_t *block, int file, uint8_t *data, size_t size, uint64_t offset, bool write)
+{
+    struct block_uring *uring = block->uring;
+    int fallback_fd = file == BLOCK_FILE_OVERLAY ? block->overlay_fd : block->fd;
+    bool ok = true;
+    pthread_mutex_lock(&uring->mutex);
+    if (!block_uring_fits_buffer(uring, data, size))
+    {
+        pthread_mutex_unlock(&uring->mutex);
+        warnx("A %zu byte transfer runs past its registered buffer", size);
+        return false;
+    }
+    while (size > 0)
+    {
+        uint32_t tail = *uring->sq_tail;
+        uint32_t count = 0;
+        size_t batch = 0;
+        for (; count < uring->entries && batch < size; count++)
+        {
+            size_t length = size - batch < BLOCK_URING_CHUNK ? size - batch : BLOCK_URING_CHUNK;
+            uint32_t index = (tail + count) & *uring->sq_mask;
+            struct io_uring_sqe *sqe = &uring->sqes[index];
+            int buffer = block_uring_find_buffer(uring, data + batch, length);
+            memset(sqe, 0, sizeof(*sqe));
+            if (buffer >= 0)
+            {
+                sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+                sqe->buf_index = buffer;
+            }
+            else
+            {
+                sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+            }
+            sqe->flags = IOSQE_FIXED_FILE;
+            sqe->fd = block_is_direct(block, file, data + batch, length, offset + batch) ? BLOCK_FILE_DIRECT : file;
+            sqe->addr = (uintptr_t)(data + batch);
+            sqe->len = length;
+            sqe->off = offset + batch;
+            sqe->user_data = batch;
+            uring->sq_array[index] = index;
+            batch += length;
+        }
+        __atomic_store_n(uring->sq_tail, tail + count, __ATOMIC_RELEASE);
+
+        uint32_t to_submit = count;
+        uint32_t completed = 0;
+        while (completed < count)
+        {
+            int submitted = syscall(__NR_io_uring_enter, uring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                err(1, "io_uring_enter");
+            }
+            if (submitted > 0)
+            {
+                to_submit -= (uint32_t)submitted < to_submit ? (uint32_t)submitted : to_submit;
+            }
+
+            uint32_t head = *uring->cq_head;
+            uint32_t cq_tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != cq_tail; head++, completed++)
+            {
+                struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+                size_t at = cqe->user_data;
+                size_t length = batch - at < BLOCK_URING_CHUNK ? batch - at : BLOCK_URING_CHUNK;
+                if (cqe->res != (int)length)
+                {
+                    size_t done = cqe->res > 0 ? cqe->res : 0;
+                    ok &= write ? block_pwrite(fallback_fd, data + at + done, length - done, offset + at + done)
+                                : block_pread(fallback_fd, data + at + done, length - done, offset + at + done);
+                }
+            }
+            __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+        }
+        data += batch;
+        offset += batch;
+        size -= batch;
+    }
+    pthread_mutex_unlock(&uring->mutex);
+    return ok;
+}
+
+#pragma endregion
+
+static bool block_file_io(block_t *block, int file, void *data, size_t size, uint64_t offset, bool write)
+{
+    if (block->uring != NULL)
+    {
+        return block_uring_io(block, file, data, size, offset, write);
+    }
+    int fd = file == BLOCK_FILE_OVERLAY ? block->overlay_fd : block->fd;
+    return write ? block_pwrite(fd, data, size, offset) : block_pread(fd, data, size, offset);
+}
+
+static void block_start_backend(block_t *block, const char *path)
+{
+    if (block_backend != BLOCK_BACKEND_URING)
+    {
+        return;
+    }
+    if (block_direct)
+    {
+        block->direct_fd = open(path, (block->overlay_fd >= 0 || block->read_only ? O_RDONLY : O_RDWR) | O_DIRECT | O_CLOEXEC);
+        if (block->direct_fd < 0)
+        {
+            warn("%s can't be opened with O_DIRECT", path); // e.g. on tmpfs
+        }
+    }
+    block->uring = block_uring_create(block);
+}
+
+static block_t *block_open_image(const char *path, bool read_only)
+{
+    block_t *block = calloc(1, sizeof(block_t));
+    if (block == NULL)
+    {
+        err(1, "Failed to allocate a block device");
+    }
+    block->fd = open(path, (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (block->fd < 0)
+    {
+        err(1, "Failed to open %s", path);
+    }
+    struct stat st;
+    if (fstat(block->fd, &st) < 0)
+    {
+        err(1, "Failed to stat %s", path);
+    }
+    block->size = st.st_size;
+    block->read_only = read_only;
+    block->overlay_fd = -1;
+    block->direct_fd = -1;
+    block->overlay_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    return block;
+}
+
+block_t *block_open(const char *path, bool read_only)
+{
+    block_t *block = block_open_image(path, read_only);
+    block_start_backend(block, path);
+    return block;
+}
+
+static bool block_in_overlay(block_t *block, uint64_t cluster)
+{
+    return block->overlay_map[cluster / 8] & (1 << (cluster % 8));
+}
+
+block_t *block_open_overlay(const char *path, const char *overlay_path)
+{
+    block_t *block = block_open_image(path, true);
+    block->read_only = false;
+    block->overlay_fd = overlay_path != NULL ? open(overlay_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644) : memfd_create("overlay", MFD_CLOEXEC);
+    if (block->overlay_fd < 0)
+    {
+        err(1, "Failed to create the overlay of %s", path);
+    }
+
+    uint64_t clusters = (block->size + BLOCK_CLUSTER_SIZE - 1) / BLOCK_CLUSTER_SIZE;
+    block->overlay_map = calloc((clusters + 7) / 8, 1);
+    if (block->overlay_map == NULL)
+    {
+        err(1, "Failed to allocate the overlay map");
+    }
+
+    // an existing overlay file is sparse, whatever has data was written by an earlier run
+    off_t data = 0;
+    while ((data = lseek(block->overlay_fd, data, SEEK_DATA)) >= 0)
+    {
+        off_t hole = lseek(block->overlay_fd, data, SEEK_HOLE);
+        for (uint64_t cluster = data / BLOCK_CLUSTER_SIZE; cluster * BLOCK_CLUSTER_SIZE < hole && cluster < clusters; cluster++)
+        {
+            block->overlay_map[cluster / 8] |= 1 << (cluster % 8);
+        }
+        data = hole;
+    }
+    block_start_backend(block, path);
+    return block;
+}
+
+void block_close(block_t *block)
+{
+    if (block == NULL)
+    {
+        return;
+    }
+    if (block->uring != NULL)
+    {
+        block_uring_destroy(block->uring);
+    }
+    if (block->overlay_fd >= 0)
+    {
+        close(block->overlay_fd);
+        free(block->overlay_map);
+    }
+    if (block->direct_fd >= 0)
+    {
+        close(block->direct_fd);
+    }
+    close(block->fd);
+    free(block);
+}
+
+uint64_t block_get_size(block_t *block)
+{
+    return block->size;
+}
+
+bool block_read(block_t *block, void *data, uint64_t offset, size_t size)
+{
+    if (size == 0)
+    {
+        return true;
+    }
+    if (offset + size > block->size)
+    {
+        return false;
+    }
+    if (block->overlay_fd < 0)
+    {
+        return block_file_io(block, BLOCK_FILE_IMAGE, data, size, offset, false);
+    }
+
+    // runs of clusters from the same file go in one read
+    pthread_mutex_lock(&block->overlay_mutex);
+    bool ok = true;
+    while (size > 0 && ok)
+    {
+        uint64_t cluster = offset / BLOCK_CLUSTER_SIZE;
+        bool overlay = block_in_overlay(block, cluster);
+        uint64_t end = (cluster + 1) * BLOCK_CLUSTER_SIZE;
+        while (end < offset + size && block_in_overlay(block, end / BLOCK_CLUSTER_SIZE) == overlay)
+        {
+            end += BLOCK_CLUSTER_SIZE;
+        }
+        size_t length = end - offset < size ? end - offset : size;
+        ok = block_file_io(block, overlay ? BLOCK_FILE_OVERLAY : BLOCK_FILE_IMAGE, data, length, offset, false);
+        data = (uint8_t *)data + length;
+        offset += length;
+        size -= length;
+    }
+    pthread_mutex_unlock(&block->overlay_mutex);
+    return ok;
+}
+
+// A cluster that is only partly written is copied up from the image first
+static bool block_copy_up(block_t *block, uint64_t cluster)
+{
+    uint8_t buffer[BLOCK_CLUSTER_SIZE];
+    uint64_t offset = cluster * BLOCK_CLUSTER_SIZE;
+    size_t length = offset + BLOCK_CLUSTER_SIZE < block->size ? BLOCK_CLUSTER_SIZE : block->size - offset;
+    if (!block_file_io(block, BLOCK_FILE_IMAGE, buffer, length, offset, false) || !block_file_io(block, BLOCK_FILE_OVERLAY, buffer, length, offset, true))
+    {
+        return false;
+    }
+    block->overlay_map[cluster / 8] |= 1 << (cluster % 8);
+    return true;
+}
+
+bool block_write(block_t *block, const void *data, uint64_t offset, size_t size)
+{
+    if (size == 0)
+    {
+        return !block->read_only;
+    }
+    if (block->read_only || offset + size > block->size)
+    {
+        return false;
+    }
+    if (block->overlay_fd < 0)
+    {
+        return block_file_io(block, BLOCK_FILE_IMAGE, (void *)data, size, offset, true);
+    }
+
+    pthread_mutex_lock(&block->overlay_mutex);
+    uint64_t first = offset / BLOCK_CLUSTER_SIZE;
+    uint64_t last = (offset + size - 1) / BLOCK_CLUSTER_SIZE;
+    bool ok = true;
+    if (offset % BLOCK_CLUSTER_SIZE != 0 && !block_in_overlay(block, first))
+    {
+        ok = block_copy_up(block, first);
+    }
+    if (ok && (offset + size) % BLOCK_CLUSTER_SIZE != 0 && offset + size != block->size && !block_in_overlay(block, last))
+    {
+        ok = block_copy_up(block, last);
+    }
+    if (ok && (ok = block_file_io(block, BLOCK_FILE_OVERLAY, (void *)data, size, offset, true)))
+    {
+        for (uint64_t cluster = first; cluster <= last; cluster++)
+        {
+            block->overlay_map[cluster / 8] |= 1 << (cluster % 8);
+        }
+    }
+    pthread_mutex_unlock(&block->overlay_mutex);
+    return ok;
+}
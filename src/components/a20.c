@@ -1,11 +1,17 @@
 #include "components/a20.h"
 #include "log.h"
+#include "snapshot.h"
 
 LOG_DEFINE("a20");
 
 uint8_t bus = 0;
 
-void a20_handle(exit_io_info_t *io, uint8_t *base)
+void a20_init(void *opaque)
+{
+    snapshot_register("a20.bus", 1, &bus, sizeof(bus), NULL);
+}
+
+void a20_handle(void *opaque, exit_io_info_t *io, uint8_t *base)
 {
     if (io->direction == KVM_EXIT_IO_IN)
     {
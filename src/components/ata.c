@@ -2,9 +2,15 @@
 #include <string.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <err.h>
 #include "components/ata.h"
+#include "components/pic.h"
 #include "common.h"
 #include "log.h"
+#include "snapshot.h"
+#include "block.h"
+#include "memory.h"
+#include "components/pci.h"
 
 /*
 At first I made a mistake thinking each channel was its own drive. Now I know that each channel can have 2 drives.
@@ -17,6 +23,10 @@ LOG_DEFINE("ata");
 
 #define ATA_HARDDRIVE_SECTOR_SIZE 512
 #define ATA_CDROM_SECTOR_SIZE 2048
+// the geometry IDENTIFY reports for the hard disk
+#define ATA_CHS_HEADS 16
+#define ATA_CHS_SECTORS_PER_TRACK 63
+#define ATA_CHS_MAX_CYLINDERS 16383
 
 #define ATA_MASTER_BASE 0x1f0
 #define ATA_MASTER_CONTROL 0x3f6
@@ -46,6 +56,8 @@ LOG_DEFINE("ata");
 #define ATA_ERROR_MEDIA_CHANGED (1 << 5)
 #define ATA_ERROR_UNCORRECTABLE_DATA (1 << 6)
 #define ATA_ERROR_BAD_BLOCK_DETECTED (1 << 7)
+// ATAPI puts the sense key of a failed packet in the high nibble of the error register
+#define ATAPI_SENSE_ILLEGAL_REQUEST 0x5
 
 #define ATA_STATUS_ERROR (1 << 0)
 #define ATA_STATUS_INDEX (1 << 1)
@@ -75,16 +87,62 @@ LOG_DEFINE("ata");
 #define ATA_DRIVE_ADDRESS_RESERVED (1 << 7)
 
 #define ATA_COMMAND_NOP 0x00
+#define ATA_COMMAND_READ_SECTORS 0x20
+#define ATA_COMMAND_READ_SECTORS_RETRY 0x21
+#define ATA_COMMAND_READ_SECTORS_EXT 0x24
+#define ATA_COMMAND_READ_DMA_EXT 0x25
+#define ATA_COMMAND_READ_MULTIPLE_EXT 0x29
+#define ATA_COMMAND_WRITE_SECTORS 0x30
+#define ATA_COMMAND_WRITE_SECTORS_RETRY 0x31
+#define ATA_COMMAND_WRITE_SECTORS_EXT 0x34
+#define ATA_COMMAND_WRITE_DMA_EXT 0x35
+#define ATA_COMMAND_WRITE_MULTIPLE_EXT 0x39
 #define ATA_COMMAND_PACKET 0xA0
 #define ATA_COMMAND_IDENTIFY_PACKET_DEVICE 0xA1
+#define ATA_COMMAND_READ_MULTIPLE 0xC4
+#define ATA_COMMAND_WRITE_MULTIPLE 0xC5
+#define ATA_COMMAND_SET_MULTIPLE_MODE 0xC6
+#define ATA_COMMAND_READ_DMA 0xC8
+#define ATA_COMMAND_WRITE_DMA 0xCA
 #define ATA_COMMAND_IDENTIFY_DEVICE 0xEC
+#define ATA_COMMAND_SET_FEATURES 0xEF
 
-typedef struct
+#define ATA_FEATURE_SET_TRANSFER_MODE 0x03
+#define ATA_TRANSFER_MODE_PIO 0x08 // | mode, in the sector count register
+#define ATA_TRANSFER_MODE_MULTIWORD_DMA 0x20
+#define ATA_TRANSFER_MODE_ULTRA_DMA 0x40
+
+#define ATA_MAX_MULTIPLE_SECTORS 16
+
+// bus master IDE, BAR4 of the IDE function
+#define ATA_BUS_MASTER_BAR 4
+#define ATA_BUS_MASTER_SIZE 16
+#define ATA_BUS_MASTER_OFFSET_COMMAND 0
+#define ATA_BUS_MASTER_OFFSET_STATUS 2
+#define ATA_BUS_MASTER_OFFSET_PRD_TABLE 4
+
+#define ATA_BUS_MASTER_COMMAND_START (1 << 0)
+#define ATA_BUS_MASTER_COMMAND_TO_MEMORY (1 << 3) // set for READ DMA
+
+#define ATA_BUS_MASTER_STATUS_ACTIVE (1 << 0)
+#define ATA_BUS_MASTER_STATUS_ERROR (1 << 1)
+#define ATA_BUS_MASTER_STATUS_INTERRUPT (1 << 2)
+#define ATA_BUS_MASTER_STATUS_DRIVE_0_DMA (1 << 5) // only kept for the guest
+#define ATA_BUS_MASTER_STATUS_DRIVE_1_DMA (1 << 6)
+
+#define ATA_PRD_SIZE 8
+#define ATA_PRD_END_OF_TABLE (1u << 31)
+#define ATA_PRD_MAX_ENTRIES (0x10000 / ATA_PRD_SIZE) // a table can't cross a 64K boundary
+
+typedef struct ata_channel
 {
     uint16_t data;
     uint8_t error;
     uint8_t features;
     uint8_t sector_count;
+    // the previous values of sector count and lba low/mid/high, the upper halves for the EXT commands
+    uint8_t hob_sector_count;
+    uint8_t hob_lba[3];
     union
     {
         // when inputting it doesn't matter
@@ -116,7 +174,7 @@ typedef struct
     uint8_t control;
     bool disable_interrupts;
 #define ATA_DATA_BUFFER_SIZE 0x8000
-    uint8_t data_buffer[ATA_DATA_BUFFER_SIZE];
+    uint8_t data_buffer[ATA_DATA_BUFFER_SIZE] __attribute__((aligned(BLOCK_DIRECT_ALIGN))); // O_DIRECT reads land here
     uint32_t data_buffer_size;
     uint32_t data_buffer_read;
     pthread_mutex_t data_buffer_mutex;
@@ -129,50 +187,110 @@ typedef struct
         ATA_NOTHING,
         ATA_SCSI_CDB,
         ATA_IDENTIFY,
+        ATA_SECTORS_IN,
+        ATA_SECTORS_OUT,
+        ATA_DMA_IN,  // a READ DMA waiting for the bus master to start
+        ATA_DMA_OUT, // a WRITE DMA waiting for the bus master to start
+        ATA_DMA,     // on the worker
     } expecting;
+    // a hard disk READ/WRITE SECTORS or MULTIPLE, the data buffer holds whole DRQ blocks of it
+    uint8_t multiple_sectors; // sectors per DRQ block of the MULTIPLE commands, 0 until SET MULTIPLE MODE
+    uint64_t transfer_lba;       // next sector to go to or come from the disk
+    uint32_t transfer_remaining; // sectors that haven't
+    uint32_t transfer_block;     // sectors per DRQ block
+    uint8_t transfer_mode;       // the last SET FEATURES transfer mode, reported back in IDENTIFY
+    // the channel's half of the bus master IDE block, bm_status is under status_mutex
+    uint8_t bm_command;
+    uint8_t bm_status;
+    uint32_t bm_prd_table;
 } ata_channel_t;
 
-static ata_channel_t ata_channels[2] = {0};
-static uint32_t cdrom_file_size = 0;
-static FILE *cdrom_file = NULL;
-static uint32_t harddisk_file_size = 0;
-static FILE *harddisk_file = NULL;
+ata_channel_t ata_primary = {0};
+ata_channel_t ata_secondary = {0};
+
+/*
+Commands that touch the disk images run on a fixed set of workers per channel instead of a new thread each.
+The vcpu queues the command and returns to the guest with BSY set, the worker runs it and completes it by
+updating the status and raising the channel's irq. A channel only has one command in flight, so one worker
+per channel is enough and keeps the host thread count bounded no matter how busy the guest is.
+*/
+#define ATA_WORKERS_PER_CHANNEL 1
+#define ATA_QUEUE_DEPTH 4
+
+typedef void (*ata_command_t)(ata_channel_t *channel);
 
-void ata_init_disks(char *cdrom_path, char *harddisk_path)
+typedef struct
 {
-    cdrom_file = fopen(cdrom_path, "rb");
-    if (cdrom_file == NULL)
-    {
-        errx(1, "Failed to open kernel file");
-    }
-    cdrom_file_size = get_file_size(cdrom_file);
+    ata_channel_t *channel;
+    uint8_t irq;
+    ata_command_t queue[ATA_QUEUE_DEPTH];
+    uint32_t head; // next to run
+    uint32_t tail; // next free
+    pthread_mutex_t mutex;
+    pthread_cond_t submitted;
+    pthread_cond_t taken;
+    pthread_cond_t idle;
+    uint32_t running; // commands a worker is in the middle of
+    bool paused;      // ata_pause_workers, nothing is taken off the queue
+    pthread_t workers[ATA_WORKERS_PER_CHANNEL];
+} ata_pool_t;
+
+static ata_pool_t ata_primary_pool = {.channel = &ata_primary, .irq = PIC_IRQ14, .mutex = PTHREAD_MUTEX_INITIALIZER, .submitted = PTHREAD_COND_INITIALIZER, .taken = PTHREAD_COND_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER};
+static ata_pool_t ata_secondary_pool = {.channel = &ata_secondary, .irq = PIC_IRQ15, .mutex = PTHREAD_MUTEX_INITIALIZER, .submitted = PTHREAD_COND_INITIALIZER, .taken = PTHREAD_COND_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER};
+
+static ata_pool_t *ata_get_pool(ata_channel_t *channel)
+{
+    return channel == &ata_primary ? &ata_primary_pool : &ata_secondary_pool;
+}
 
-    harddisk_file = fopen(harddisk_path, "rb+");
-    if (harddisk_file == NULL)
+// nIEN decides if the guest hears about it
+static void ata_interrupt(ata_channel_t *channel)
+{
+    if (!channel->disable_interrupts)
     {
-        errx(1, "Failed to open hard disk file");
+        pic_raise_interrupt(ata_get_pool(channel)->irq);
     }
-    harddisk_file_size = get_file_size(harddisk_file);
 }
+static uint64_t cdrom_file_size = 0;
+static block_t *cdrom = NULL;
+static uint64_t harddisk_file_size = 0;
+static block_t *harddisk = NULL;
 
-void ata_deinit_disks()
+// With overlay the hard disk image is left untouched and writes go to overlay_path (or memory if that's NULL)
+void ata_init_disks(char *cdrom_path, char *harddisk_path, bool overlay, char *overlay_path)
 {
-    if (cdrom_file != NULL)
-    {
-        fclose(cdrom_file);
-        cdrom_file = NULL;
-    }
+    cdrom = block_open(cdrom_path, true);
+    cdrom_file_size = block_get_size(cdrom);
+
+    harddisk = overlay ? block_open_overlay(harddisk_path, overlay_path) : block_open(harddisk_path, false);
+    harddisk_file_size = block_get_size(harddisk);
+}
 
-    if (harddisk_file != NULL)
+// Whole sectors straight from the cdrom image, for the BIOS services of a direct El Torito boot
+bool ata_read_cdrom(void *data, uint64_t lba, uint32_t count)
+{
+    if (lba + count > cdrom_file_size / ATA_CDROM_SECTOR_SIZE)
     {
-        fclose(harddisk_file);
-        harddisk_file = NULL;
+        return false;
     }
+    return block_read(cdrom, data, lba * ATA_CDROM_SECTOR_SIZE, (size_t)count * ATA_CDROM_SECTOR_SIZE);
+}
+
+uint64_t ata_get_cdrom_sectors()
+{
+    return cdrom_file_size / ATA_CDROM_SECTOR_SIZE;
 }
 
-void ata_identify_packet_device(void *args) // for cdrom
+void ata_deinit_disks()
+{
+    block_close(cdrom);
+    cdrom = NULL;
+    block_close(harddisk);
+    harddisk = NULL;
+}
+
+static void ata_identify_packet_device(ata_channel_t *channel) // for cdrom
 {
-    ata_channel_t *channel = (ata_channel_t *)args;
     uint16_t identify_data[256] = {0};
 
     identify_data[0] = 0x00008580;
@@ -214,17 +332,20 @@ void ata_identify_packet_device(void *args) // for cdrom
     pthread_mutex_unlock(&channel->status_mutex);
 }
 
-void ata_identify_device(void *args) // for hard disk
+static void ata_identify_device(ata_channel_t *channel) // for hard disk
 {
-    ata_channel_t *channel = (ata_channel_t *)args;
     uint16_t identify_data[256] = {0};
 
     // copied from AI
     identify_data[0] = 0x0040; // General configuration: hard disk
-    // obselete
-    // identify_data[1] = 16383;      // Number of cylinders
-    // identify_data[3] = 16;         // Number of heads
-    // identify_data[6] = 63;         // Number of sectors per track
+
+    // obsolete, but the BIOS still builds its INT13 CHS geometry from it. 16 heads of 63 sectors, capped like real disks.
+    uint64_t sectors = harddisk_file_size / ATA_HARDDRIVE_SECTOR_SIZE;
+    uint64_t cylinders = sectors / (ATA_CHS_HEADS * ATA_CHS_SECTORS_PER_TRACK);
+    cylinders = cylinders < ATA_CHS_MAX_CYLINDERS ? cylinders : ATA_CHS_MAX_CYLINDERS;
+    identify_data[1] = cylinders;
+    identify_data[3] = ATA_CHS_HEADS;
+    identify_data[6] = ATA_CHS_SECTORS_PER_TRACK;
 
     char *serial = "987654321          ";
     for (int i = 0; i < 10; i++)
@@ -244,13 +365,35 @@ void ata_identify_device(void *args) // for hard disk
         identify_data[27 + i] = (model[i * 2 + 1]) | (model[i * 2] << 8);
     }
 
-    identify_data[47] = 0x8000; // Fixed + Reserved
-
-    identify_data[60] = (harddisk_file_size / ATA_HARDDRIVE_SECTOR_SIZE) & 0xFFFF;
-    identify_data[61] = ((harddisk_file_size / ATA_HARDDRIVE_SECTOR_SIZE) >> 16) & 0xFFFF;
+    identify_data[47] = 0x8000 | ATA_MAX_MULTIPLE_SECTORS; // Fixed + Reserved, most sectors per READ/WRITE MULTIPLE block
+    identify_data[49] = (1 << 9) | (1 << 8); // LBA, DMA
+    identify_data[53] = (1 << 2) | (1 << 1) | (1 << 0); // words 64-70, 88 and the current geometry in 54-58 are valid
+    identify_data[54] = cylinders;
+    identify_data[55] = ATA_CHS_HEADS;
+    identify_data[56] = ATA_CHS_SECTORS_PER_TRACK;
+    uint32_t chs_sectors = cylinders * ATA_CHS_HEADS * ATA_CHS_SECTORS_PER_TRACK;
+    identify_data[57] = chs_sectors & 0xFFFF;
+    identify_data[58] = chs_sectors >> 16;
+    identify_data[59] = channel->multiple_sectors != 0 ? (1 << 8) | channel->multiple_sectors : 0;
+
+    uint64_t lba28_sectors = sectors < (1 << 28) ? sectors : (1 << 28) - 1;
+    identify_data[60] = lba28_sectors & 0xFFFF;
+    identify_data[61] = (lba28_sectors >> 16) & 0xFFFF;
+
+    // multiword DMA 0-2 and ultra DMA 0-5, the mode SET FEATURES picked is marked in the high byte
+    uint8_t mode = channel->transfer_mode & 0x07;
+    identify_data[63] = 0x07 | ((channel->transfer_mode & 0xf8) == ATA_TRANSFER_MODE_MULTIWORD_DMA ? 1 << (8 + mode) : 0);
+    identify_data[64] = 0x03; // PIO 3 and 4
+    identify_data[88] = 0x3f | ((channel->transfer_mode & 0xf8) == ATA_TRANSFER_MODE_ULTRA_DMA ? 1 << (8 + mode) : 0);
 
     identify_data[82] = (1 << 14) | (1 << 13) | (1 << 12);
+    identify_data[83] = (1 << 14) | (1 << 10); // 48 bit lba
     identify_data[85] = (1 << 14) | (1 << 13) | (1 << 12);
+    identify_data[86] = 1 << 10;
+    for (int i = 0; i < 4; i++)
+    {
+        identify_data[100 + i] = (sectors >> (16 * i)) & 0xFFFF;
+    }
 
     pthread_mutex_lock(&channel->data_buffer_mutex);
     memcpy(channel->data_buffer, identify_data, sizeof(identify_data));
@@ -263,9 +406,8 @@ void ata_identify_device(void *args) // for hard disk
     pthread_mutex_unlock(&channel->status_mutex);
 }
 
-void ata_handle_scsi_cdb(void *args)
+static void ata_handle_scsi_cdb(ata_channel_t *channel)
 {
-    ata_channel_t *channel = (ata_channel_t *)args;
     uint8_t *cdb = channel->scsi_cdb_buffer;
     uint32_t sector_size = (channel->drive_head & ATA_DRIVE_HEAD_DRIVE) ? ATA_HARDDRIVE_SECTOR_SIZE : ATA_CDROM_SECTOR_SIZE;
 
@@ -274,27 +416,24 @@ void ata_handle_scsi_cdb(void *args)
         uint32_t lba = (cdb[2] << 24) | (cdb[3] << 16) | (cdb[4] << 8) | cdb[5];
         uint32_t count = (cdb[7] << 8) | cdb[8];
 
-        if (lba + count > cdrom_file_size / sector_size)
+        // the whole transfer has to fit the data buffer, there is no DRQ block splitting for packets
+        if ((uint64_t)lba + count > cdrom_file_size / sector_size || (uint64_t)count * sector_size > ATA_DATA_BUFFER_SIZE)
         {
             LOG_MSG("Error");
-            printf("error\n");
             pthread_mutex_lock(&channel->status_mutex);
-            channel->error = ATA_ERROR_ABORTED_COMMAND;
+            channel->error = (ATAPI_SENSE_ILLEGAL_REQUEST << 4) | ATA_ERROR_ABORTED_COMMAND;
             channel->status |= ATA_STATUS_ERROR;
+            channel->status &= ~ATA_STATUS_BUSY; // the command is over, otherwise the guest polls forever
             pthread_mutex_unlock(&channel->status_mutex);
         }
         else
         {
-            printf("lba: %d %d\n", lba, lba * sector_size);
-            printf("size: %d\n", cdrom_file_size);
-            printf("cdrom_file: %d\n", cdrom_file);
-            fseek(cdrom_file, lba * sector_size, SEEK_SET);
-
             pthread_mutex_lock(&channel->data_buffer_mutex);
             channel->data_buffer_size = sector_size * count;
-            printf("count: %d %d\n", count, channel->data_buffer_size);
-            int read = fread(channel->data_buffer, 1, channel->data_buffer_size, cdrom_file);
-            LOG_MSG("bytes read: %d\n", read);
+            if (!block_read(cdrom, channel->data_buffer, (uint64_t)lba * sector_size, channel->data_buffer_size))
+            {
+                LOG_MSG("Failed to read the cdrom");
+            }
             pthread_mutex_unlock(&channel->data_buffer_mutex);
 
             pthread_mutex_lock(&channel->scsi_cdb_buffer_mutex);
@@ -315,7 +454,6 @@ void ata_handle_scsi_cdb(void *args)
         // channel->data_buffer[0] = 0;
         // channel->data_buffer_size = 1;
         // pthread_mutex_unlock(&channel->data_buffer_mutex);
-        printf("test\n");
 
         // pthread_mutex_lock(&channel->scsi_cdb_buffer_mutex);
         // channel->scsi_cdb_buffer_size = 0;
@@ -330,14 +468,209 @@ void ata_handle_scsi_cdb(void *args)
     }
 }
 
-void ata_init_primary()
+static void *ata_worker(void *arg)
 {
-    ata_channel_t *master = &ata_channels[0];
+    ata_pool_t *pool = arg;
+    while (1)
+    {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->head == pool->tail || pool->paused)
+        {
+            pthread_cond_wait(&pool->submitted, &pool->mutex);
+        }
+        ata_command_t command = pool->queue[pool->head % ATA_QUEUE_DEPTH];
+        pool->head++;
+        pool->running++;
+        pthread_cond_signal(&pool->taken);
+        pthread_mutex_unlock(&pool->mutex);
+
+        command(pool->channel);
+        ata_interrupt(pool->channel); // the command left its result in the status register
+
+        pthread_mutex_lock(&pool->mutex);
+        pool->running--;
+        pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    return NULL;
+}
+
+static void ata_start_workers(ata_pool_t *pool)
+{
+    for (int i = 0; i < ATA_WORKERS_PER_CHANNEL; i++)
+    {
+        if (pthread_create(&pool->workers[i], NULL, ata_worker, pool) != 0)
+        {
+            errx(1, "Failed to create an ata worker");
+        }
+    }
+}
+
+/*
+Snapshots and migration save the channels as plain structs, a command that is queued or half done on a worker
+would be lost (the restored guest waits on BSY forever) and a DMA could still be writing the ram being saved.
+With the vcpus paused nothing new is submitted, so every command that is in already runs to its end here and the
+workers are then held until ata_resume_workers.
+*/
+void ata_pause_workers()
+{
+    ata_pool_t *pools[] = {&ata_primary_pool, &ata_secondary_pool};
+    for (int i = 0; i < 2; i++)
+    {
+        ata_pool_t *pool = pools[i];
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->head != pool->tail || pool->running != 0)
+        {
+            pthread_cond_wait(&pool->idle, &pool->mutex);
+        }
+        pool->paused = true;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+void ata_resume_workers()
+{
+    ata_pool_t *pools[] = {&ata_primary_pool, &ata_secondary_pool};
+    for (int i = 0; i < 2; i++)
+    {
+        pthread_mutex_lock(&pools[i]->mutex);
+        pools[i]->paused = false;
+        pthread_cond_broadcast(&pools[i]->submitted);
+        pthread_mutex_unlock(&pools[i]->mutex);
+    }
+}
+
+// Called with BSY already set, the guest polls or waits for the irq
+static void ata_submit(ata_channel_t *channel, ata_command_t command)
+{
+    ata_pool_t *pool = ata_get_pool(channel);
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->tail - pool->head == ATA_QUEUE_DEPTH)
+    {
+        pthread_cond_wait(&pool->taken, &pool->mutex);
+    }
+    pool->queue[pool->tail % ATA_QUEUE_DEPTH] = command;
+    pool->tail++;
+    pthread_cond_signal(&pool->submitted);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+#pragma region SECTORS
+
+static void ata_fail(ata_channel_t *channel, uint8_t error)
+{
+    pthread_mutex_lock(&channel->data_buffer_mutex);
+    channel->data_buffer_read = 0;
+    channel->data_buffer_size = 0;
+    pthread_mutex_unlock(&channel->data_buffer_mutex);
+    pthread_mutex_lock(&channel->status_mutex);
+    channel->error = error;
+    channel->status |= ATA_STATUS_ERROR;
+    channel->status &= ~(ATA_STATUS_BUSY | ATA_STATUS_DATA_REQUEST);
+    pthread_mutex_unlock(&channel->status_mutex);
+    channel->expecting = ATA_NOTHING;
+}
+
+// Fills the data buffer with as many whole DRQ blocks as fit, the guest then takes them without waiting on the disk
+static void ata_read_sectors(ata_channel_t *channel)
+{
+    uint32_t buffer_sectors = ATA_DATA_BUFFER_SIZE / ATA_HARDDRIVE_SECTOR_SIZE / channel->transfer_block * channel->transfer_block;
+    uint32_t sectors = channel->transfer_remaining < buffer_sectors ? channel->transfer_remaining : buffer_sectors;
+
+    pthread_mutex_lock(&channel->data_buffer_mutex);
+    bool ok = block_read(harddisk, channel->data_buffer, channel->transfer_lba * ATA_HARDDRIVE_SECTOR_SIZE, (size_t)sectors * ATA_HARDDRIVE_SECTOR_SIZE);
+    channel->data_buffer_size = sectors * ATA_HARDDRIVE_SECTOR_SIZE;
+    channel->data_buffer_read = 0;
+    pthread_mutex_unlock(&channel->data_buffer_mutex);
+    if (!ok)
+    {
+        LOG_MSG("Failed to read the hard disk");
+        ata_fail(channel, ATA_ERROR_UNCORRECTABLE_DATA);
+        return;
+    }
+    channel->transfer_lba += sectors;
+    channel->transfer_remaining -= sectors;
+
+    pthread_mutex_lock(&channel->status_mutex);
+    channel->status |= ATA_STATUS_DATA_REQUEST;
+    channel->status &= ~ATA_STATUS_BUSY;
+    pthread_mutex_unlock(&channel->status_mutex);
+}
+
+// The DRQ block the guest just filled goes to the disk, then the next one is requested
+static void ata_write_sectors(ata_channel_t *channel)
+{
+    pthread_mutex_lock(&channel->data_buffer_mutex);
+    uint32_t sectors = channel->data_buffer_size / ATA_HARDDRIVE_SECTOR_SIZE;
+    bool ok = block_write(harddisk, channel->data_buffer, channel->transfer_lba * ATA_HARDDRIVE_SECTOR_SIZE, channel->data_buffer_size);
+    pthread_mutex_unlock(&channel->data_buffer_mutex);
+    if (!ok)
+    {
+        LOG_MSG("Failed to write the hard disk");
+        ata_fail(channel, ATA_ERROR_ABORTED_COMMAND);
+        return;
+    }
+    channel->transfer_lba += sectors;
+    channel->transfer_remaining -= sectors;
+
+    pthread_mutex_lock(&channel->data_buffer_mutex);
+    uint32_t next = channel->transfer_remaining < channel->transfer_block ? channel->transfer_remaining : channel->transfer_block;
+    channel->data_buffer_size = next * ATA_HARDDRIVE_SECTOR_SIZE;
+    channel->data_buffer_read = 0;
+    pthread_mutex_unlock(&channel->data_buffer_mutex);
+
+    pthread_mutex_lock(&channel->status_mutex);
+    if (next != 0)
+    {
+        channel->status |= ATA_STATUS_DATA_REQUEST;
+    }
+    else
+    {
+        channel->expecting = ATA_NOTHING;
+    }
+    channel->status &= ~ATA_STATUS_BUSY;
+    pthread_mutex_unlock(&channel->status_mutex);
+}
+
+#pragma endregion
+
+// the saved mutexes are whatever they were mid-save, start over with fresh ones
+static void ata_post_load()
+{
+    ata_channel_t *channels[] = {&ata_primary, &ata_secondary};
+    for (int i = 0; i < 2; i++)
+    {
+        channels[i]->status_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+        channels[i]->data_buffer_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+        channels[i]->scsi_cdb_buffer_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    }
+}
+
+void ata_init(void *opaque)
+{
+    if (opaque != &ata_primary)
+    {
+        // ata_channel_t *slave = opaque;
+        // slave->status = ATA_STATUS_READY;
+        // slave->drive_head = ATA_DRIVE_HEAD_SET_1 | ATA_DRIVE_HEAD_SET_2 | ATA_DRIVE_HEAD_DRIVE;
+        // slave->status_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+        // slave->buffer_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+        return;
+    }
+    snapshot_register("ata.primary", 1, &ata_primary, sizeof(ata_primary), ata_post_load);
+    snapshot_register("ata.secondary", 1, &ata_secondary, sizeof(ata_secondary), NULL);
+
+    ata_channel_t *master = &ata_primary;
     master->status = ATA_STATUS_READY;
     master->drive_head = ATA_DRIVE_HEAD_SET_1 | ATA_DRIVE_HEAD_SET_2;
     master->status_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
     master->data_buffer_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
     master->scsi_cdb_buffer_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    block_register_buffer(cdrom, master->data_buffer, sizeof(master->data_buffer));
+    block_register_buffer(harddisk, master->data_buffer, sizeof(master->data_buffer));
+    master->bm_status = ATA_BUS_MASTER_STATUS_DRIVE_1_DMA; // the hard disk
+    ata_start_workers(&ata_primary_pool);
+    pci_add_io_bar(0, 1, 0, ATA_BUS_MASTER_BAR, ATA_BUS_MASTER_SIZE, ata_handle_bus_master, NULL);
 
     // uint32_t *identify_data = master->identify_data;
     // identify_data[0] = 0x00008580;
@@ -361,15 +694,347 @@ void ata_init_primary()
     // }
 }
 
-void ata_init_secondary()
+// The sectors a READ/WRITE of the hard disk is about from the task file, false if the command failed on them
+static bool ata_load_transfer(ata_channel_t *channel, bool ext)
+{
+    // the cdrom only takes packets, and there is no CHS geometry
+    if (!(channel->drive_head & ATA_DRIVE_HEAD_DRIVE) || !(channel->drive_head & ATA_DRIVE_HEAD_ADDRESSING))
+    {
+        ata_fail(channel, ATA_ERROR_ABORTED_COMMAND);
+        ata_interrupt(channel);
+        return false;
+    }
+    uint64_t lba = channel->mode.lba.lba_low | (channel->mode.lba.lba_mid << 8) | (channel->mode.lba.lba_high << 16);
+    uint32_t count;
+    if (ext)
+    {
+        lba |= ((uint64_t)channel->hob_lba[0] << 24) | ((uint64_t)channel->hob_lba[1] << 32) | ((uint64_t)channel->hob_lba[2] << 40);
+        count = (channel->hob_sector_count << 8) | channel->sector_count;
+        count = count != 0 ? count : 65536;
+    }
+    else
+    {
+        lba |= (uint64_t)(channel->drive_head & 0x0f) << 24;
+        count = channel->sector_count != 0 ? channel->sector_count : 256;
+    }
+    if (lba + count > harddisk_file_size / ATA_HARDDRIVE_SECTOR_SIZE)
+    {
+        ata_fail(channel, ATA_ERROR_ID_NOT_FOUND);
+        ata_interrupt(channel);
+        return false;
+    }
+
+    channel->transfer_lba = lba;
+    channel->transfer_remaining = count;
+    return true;
+}
+
+// READ/WRITE SECTORS (EXT) and READ/WRITE MULTIPLE (EXT) of the hard disk, from the task file
+static void ata_start_transfer(ata_channel_t *channel, bool ext, bool multiple, bool write)
 {
-    // ata_channel_t *slave = &ata_channels[0];
-    // slave->status = ATA_STATUS_READY;
-    // slave->drive_head = ATA_DRIVE_HEAD_SET_1 | ATA_DRIVE_HEAD_SET_2 | ATA_DRIVE_HEAD_DRIVE;
-    // slave->status_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
-    // slave->buffer_mutex = (pthread_mutex_t)PTHREAD_MUTEX_INITIALIZER;
+    if (multiple && channel->multiple_sectors == 0)
+    {
+        ata_fail(channel, ATA_ERROR_ABORTED_COMMAND);
+        ata_interrupt(channel);
+        return;
+    }
+    if (!ata_load_transfer(channel, ext))
+    {
+        return;
+    }
+    uint32_t count = channel->transfer_remaining;
+    channel->transfer_block = multiple ? channel->multiple_sectors : 1;
+    pthread_mutex_lock(&channel->status_mutex);
+    channel->status &= ~ATA_STATUS_ERROR;
+    if (write)
+    {
+        // the first block is requested right away, without an interrupt
+        channel->expecting = ATA_SECTORS_OUT;
+        pthread_mutex_lock(&channel->data_buffer_mutex);
+        channel->data_buffer_size = (count < channel->transfer_block ? count : channel->transfer_block) * ATA_HARDDRIVE_SECTOR_SIZE;
+        channel->data_buffer_read = 0;
+        pthread_mutex_unlock(&channel->data_buffer_mutex);
+        channel->status |= ATA_STATUS_DATA_REQUEST;
+        pthread_mutex_unlock(&channel->status_mutex);
+    }
+    else
+    {
+        channel->expecting = ATA_SECTORS_IN;
+        channel->status |= ATA_STATUS_BUSY;
+        pthread_mutex_unlock(&channel->status_mutex);
+        ata_submit(channel, ata_read_sectors);
+    }
+}
+
+// The guest takes data of a read, every DRQ block but the first (that one comes from the worker) gets its interrupt here
+static void ata_sectors_in(ata_channel_t *channel, exit_io_info_t *io, uint8_t *base)
+{
+    uint32_t block_size = channel->transfer_block * ATA_HARDDRIVE_SECTOR_SIZE;
+    pthread_mutex_lock(&channel->data_buffer_mutex);
+    uint32_t to_read = io->count * io->size;
+    if (to_read > channel->data_buffer_size - channel->data_buffer_read)
+    {
+        to_read = channel->data_buffer_size - channel->data_buffer_read;
+    }
+    memcpy(base + io->data_offset, channel->data_buffer + channel->data_buffer_read, to_read);
+    uint32_t block = channel->data_buffer_read / block_size;
+    channel->data_buffer_read += to_read;
+    bool drained = channel->data_buffer_read == channel->data_buffer_size;
+    bool next_block = !drained && channel->data_buffer_read / block_size != block;
+    if (drained)
+    {
+        channel->data_buffer_read = 0;
+        channel->data_buffer_size = 0;
+    }
+    pthread_mutex_unlock(&channel->data_buffer_mutex);
+
+    if (drained)
+    {
+        pthread_mutex_lock(&channel->status_mutex);
+        channel->status &= ~ATA_STATUS_DATA_REQUEST;
+        if (channel->transfer_remaining > 0)
+        {
+            channel->status |= ATA_STATUS_BUSY;
+            pthread_mutex_unlock(&channel->status_mutex);
+            ata_submit(channel, ata_read_sectors);
+            return;
+        }
+        channel->expecting = ATA_NOTHING;
+        pthread_mutex_unlock(&channel->status_mutex);
+    }
+    else if (next_block)
+    {
+        ata_interrupt(channel);
+    }
 }
 
+// The guest hands over data of a write, a full DRQ block goes to the worker
+static void ata_sectors_out(ata_channel_t *channel, exit_io_info_t *io, uint8_t *base)
+{
+    pthread_mutex_lock(&channel->data_buffer_mutex);
+    uint32_t to_write = io->count * io->size;
+    if (to_write > channel->data_buffer_size - channel->data_buffer_read)
+    {
+        to_write = channel->data_buffer_size - channel->data_buffer_read;
+    }
+    memcpy(channel->data_buffer + channel->data_buffer_read, base + io->data_offset, to_write);
+    channel->data_buffer_read += to_write;
+    bool full = channel->data_buffer_read == channel->data_buffer_size;
+    pthread_mutex_unlock(&channel->data_buffer_mutex);
+
+    if (full)
+    {
+        pthread_mutex_lock(&channel->status_mutex);
+        channel->status &= ~ATA_STATUS_DATA_REQUEST;
+        channel->status |= ATA_STATUS_BUSY;
+        pthread_mutex_unlock(&channel->status_mutex);
+        ata_submit(channel, ata_write_sectors);
+    }
+}
+
+#pragma region BUS MASTER
+
+/*
+Bus master IDE, the register block of BAR4 of the IDE function (8 ports per channel). READ/WRITE DMA don't move
+any data through the ports: once the guest has issued the command and started the bus master, the worker walks the
+guest's PRD table and moves the data between the disk and the PRD buffers, then the command completes with one
+interrupt. The whole transfer is a handful of exits instead of one per DRQ block or worse. The data goes through
+the channel's data buffer a buffer full at a time, so however the guest fragments its PRD table the backend sees
+large transfers into its registered (and O_DIRECT aligned) buffer.
+*/
+
+// Moves the whole transfer between the hard disk and the buffers of the PRD table
+static void ata_dma_transfer(ata_channel_t *channel, bool write)
+{
+    uint64_t offset = channel->transfer_lba * ATA_HARDDRIVE_SECTOR_SIZE;
+    uint64_t remaining = (uint64_t)channel->transfer_remaining * ATA_HARDDRIVE_SECTOR_SIZE;
+    memory_sg_t sg[ATA_PRD_MAX_ENTRIES]; // 128K, on the worker's stack
+    int sg_count = 0;
+    uint64_t total = 0;
+    uint32_t prd = channel->bm_prd_table;
+    bool end_of_table = false;
+    bool ok = true;
+    while (total < remaining && !end_of_table && sg_count < ATA_PRD_MAX_ENTRIES)
+    {
+        uint32_t entry[2];
+        if (!memory_dma_read(prd, entry, ATA_PRD_SIZE))
+        {
+            ok = false;
+            break;
+        }
+        uint32_t length = entry[1] & 0xffff;
+        length = length != 0 ? length : 0x10000; // 0 is 64K
+        length = length < remaining - total ? length : remaining - total;
+        end_of_table = entry[1] & ATA_PRD_END_OF_TABLE;
+        sg[sg_count++] = (memory_sg_t){.gpa = entry[0] & ~1u, .size = length};
+        total += length;
+        prd += ATA_PRD_SIZE;
+    }
+
+    pthread_mutex_lock(&channel->data_buffer_mutex);
+    for (uint64_t done = 0; ok && done < total;)
+    {
+        uint64_t chunk = total - done < ATA_DATA_BUFFER_SIZE ? total - done : ATA_DATA_BUFFER_SIZE;
+        if (write)
+        {
+            ok = memory_dma_sg_read(sg, sg_count, done, channel->data_buffer, chunk) == chunk &&
+                 block_write(harddisk, channel->data_buffer, offset, chunk);
+        }
+        else
+        {
+            ok = block_read(harddisk, channel->data_buffer, offset, chunk) &&
+                 memory_dma_sg_write(sg, sg_count, done, channel->data_buffer, chunk) == chunk;
+        }
+        if (ok)
+        {
+            done += chunk;
+            offset += chunk;
+            remaining -= chunk;
+        }
+    }
+    pthread_mutex_unlock(&channel->data_buffer_mutex);
+
+    pthread_mutex_lock(&channel->status_mutex);
+    if (!ok || remaining > 0)
+    {
+        // a PRD or buffer outside of ram, a PRD table that is too short or the backend failing
+        LOG_MSG("DMA failed at 0x%lx with 0x%lx bytes left", offset, remaining);
+        channel->bm_status |= ATA_BUS_MASTER_STATUS_ERROR;
+        channel->bm_status &= ~ATA_BUS_MASTER_STATUS_ACTIVE;
+        channel->error = write ? ATA_ERROR_ABORTED_COMMAND : ATA_ERROR_UNCORRECTABLE_DATA;
+        channel->status |= ATA_STATUS_ERROR;
+    }
+    else if (end_of_table)
+    {
+        channel->bm_status &= ~ATA_BUS_MASTER_STATUS_ACTIVE; // a table longer than the transfer stays active
+    }
+    channel->bm_status |= ATA_BUS_MASTER_STATUS_INTERRUPT;
+    channel->status &= ~(ATA_STATUS_BUSY | ATA_STATUS_DATA_REQUEST);
+    channel->expecting = ATA_NOTHING;
+    pthread_mutex_unlock(&channel->status_mutex);
+}
+
+static void ata_dma_read(ata_channel_t *channel)
+{
+    ata_dma_transfer(channel, false);
+}
+
+static void ata_dma_write(ata_channel_t *channel)
+{
+    ata_dma_transfer(channel, true);
+}
+
+// The command and the start of the bus master can come in either order, whichever is last kicks off the transfer
+static void ata_try_dma(ata_channel_t *channel)
+{
+    if ((channel->expecting != ATA_DMA_IN && channel->expecting != ATA_DMA_OUT) || !(channel->bm_command & ATA_BUS_MASTER_COMMAND_START))
+    {
+        return;
+    }
+    bool write = channel->expecting == ATA_DMA_OUT;
+    channel->expecting = ATA_DMA;
+    ata_submit(channel, write ? ata_dma_write : ata_dma_read);
+}
+
+// READ/WRITE DMA (EXT) of the hard disk
+static void ata_start_dma(ata_channel_t *channel, bool ext, bool write)
+{
+    if (!ata_load_transfer(channel, ext))
+    {
+        return;
+    }
+    pthread_mutex_lock(&channel->status_mutex);
+    channel->status &= ~ATA_STATUS_ERROR;
+    channel->status |= ATA_STATUS_BUSY;
+    pthread_mutex_unlock(&channel->status_mutex);
+    channel->expecting = write ? ATA_DMA_OUT : ATA_DMA_IN;
+    ata_try_dma(channel);
+}
+
+static uint8_t ata_bus_master_read(ata_channel_t *channel, uint8_t offset)
+{
+    switch (offset)
+    {
+    case ATA_BUS_MASTER_OFFSET_COMMAND:
+        return channel->bm_command;
+    case ATA_BUS_MASTER_OFFSET_STATUS:
+    {
+        pthread_mutex_lock(&channel->status_mutex);
+        uint8_t status = channel->bm_status;
+        pthread_mutex_unlock(&channel->status_mutex);
+        return status;
+    }
+    case ATA_BUS_MASTER_OFFSET_PRD_TABLE ... ATA_BUS_MASTER_OFFSET_PRD_TABLE + 3:
+        return channel->bm_prd_table >> (8 * (offset - ATA_BUS_MASTER_OFFSET_PRD_TABLE));
+    default:
+        return 0;
+    }
+}
+
+static void ata_bus_master_write(ata_channel_t *channel, uint8_t offset, uint8_t value)
+{
+    switch (offset)
+    {
+    case ATA_BUS_MASTER_OFFSET_COMMAND:
+    {
+        bool started = !(channel->bm_command & ATA_BUS_MASTER_COMMAND_START) && (value & ATA_BUS_MASTER_COMMAND_START);
+        bool stopped = (channel->bm_command & ATA_BUS_MASTER_COMMAND_START) && !(value & ATA_BUS_MASTER_COMMAND_START);
+        channel->bm_command = value & (ATA_BUS_MASTER_COMMAND_START | ATA_BUS_MASTER_COMMAND_TO_MEMORY);
+        pthread_mutex_lock(&channel->status_mutex);
+        if (started)
+        {
+            channel->bm_status |= ATA_BUS_MASTER_STATUS_ACTIVE;
+        }
+        else if (stopped)
+        {
+            // a transfer already on the worker still runs to its end
+            channel->bm_status &= ~ATA_BUS_MASTER_STATUS_ACTIVE;
+        }
+        pthread_mutex_unlock(&channel->status_mutex);
+        if (started)
+        {
+            ata_try_dma(channel);
+        }
+        break;
+    }
+    case ATA_BUS_MASTER_OFFSET_STATUS:
+        // error and interrupt are write one to clear
+        pthread_mutex_lock(&channel->status_mutex);
+        channel->bm_status &= ~(value & (ATA_BUS_MASTER_STATUS_ERROR | ATA_BUS_MASTER_STATUS_INTERRUPT));
+        channel->bm_status = (channel->bm_status & ~(ATA_BUS_MASTER_STATUS_DRIVE_0_DMA | ATA_BUS_MASTER_STATUS_DRIVE_1_DMA)) | (value & (ATA_BUS_MASTER_STATUS_DRIVE_0_DMA | ATA_BUS_MASTER_STATUS_DRIVE_1_DMA));
+        pthread_mutex_unlock(&channel->status_mutex);
+        break;
+    case ATA_BUS_MASTER_OFFSET_PRD_TABLE ... ATA_BUS_MASTER_OFFSET_PRD_TABLE + 3:
+    {
+        uint8_t shift = 8 * (offset - ATA_BUS_MASTER_OFFSET_PRD_TABLE);
+        channel->bm_prd_table = (channel->bm_prd_table & ~(0xffu << shift)) | ((uint32_t)value << shift);
+        channel->bm_prd_table &= ~3u; // the table is dword aligned
+        break;
+    }
+    }
+}
+
+// The BAR is aligned to its 16 ports, so the low bits of the port alone say which register of which channel it is
+void ata_handle_bus_master(void *opaque, exit_io_info_t *io, uint8_t *base)
+{
+    LOG_MSG("Handling ata bus master port: 0x%x, direction: 0x%x, size: 0x%x, data: 0x%x", io->port, io->direction, io->size, READ_UINT32(base + io->data_offset));
+    for (uint8_t i = 0; i < io->size; i++)
+    {
+        uint16_t port = io->port + i;
+        ata_channel_t *channel = port & 8 ? &ata_secondary : &ata_primary;
+        if (io->direction == EXIT_IO_OUT)
+        {
+            ata_bus_master_write(channel, port & 7, base[io->data_offset + i]);
+        }
+        else
+        {
+            base[io->data_offset + i] = ata_bus_master_read(channel, port & 7);
+        }
+    }
+}
+
+#pragma endregion
+
 static void ata_handle_command(exit_io_info_t *io, uint8_t *base, ata_channel_t *channel)
 {
     uint8_t data = base[io->data_offset];
@@ -392,9 +1057,7 @@ static void ata_handle_command(exit_io_info_t *io, uint8_t *base, ata_channel_t
             channel->status |= ATA_STATUS_BUSY;
             pthread_mutex_unlock(&channel->status_mutex);
             channel->expecting = ATA_IDENTIFY;
-            pthread_t thread;
-            pthread_create(&thread, NULL, ata_identify_packet_device, channel);
-            pthread_detach(thread);
+            ata_submit(channel, ata_identify_packet_device);
         }
         break;
     case ATA_COMMAND_PACKET:
@@ -413,6 +1076,68 @@ static void ata_handle_command(exit_io_info_t *io, uint8_t *base, ata_channel_t
             channel->expecting = ATA_SCSI_CDB;
         }
         break;
+    case ATA_COMMAND_READ_SECTORS:
+    case ATA_COMMAND_READ_SECTORS_RETRY:
+        ata_start_transfer(channel, false, false, false);
+        break;
+    case ATA_COMMAND_READ_SECTORS_EXT:
+        ata_start_transfer(channel, true, false, false);
+        break;
+    case ATA_COMMAND_READ_MULTIPLE:
+        ata_start_transfer(channel, false, true, false);
+        break;
+    case ATA_COMMAND_READ_MULTIPLE_EXT:
+        ata_start_transfer(channel, true, true, false);
+        break;
+    case ATA_COMMAND_WRITE_SECTORS:
+    case ATA_COMMAND_WRITE_SECTORS_RETRY:
+        ata_start_transfer(channel, false, false, true);
+        break;
+    case ATA_COMMAND_WRITE_SECTORS_EXT:
+        ata_start_transfer(channel, true, false, true);
+        break;
+    case ATA_COMMAND_WRITE_MULTIPLE:
+        ata_start_transfer(channel, false, true, true);
+        break;
+    case ATA_COMMAND_WRITE_MULTIPLE_EXT:
+        ata_start_transfer(channel, true, true, true);
+        break;
+    case ATA_COMMAND_READ_DMA:
+        ata_start_dma(channel, false, false);
+        break;
+    case ATA_COMMAND_READ_DMA_EXT:
+        ata_start_dma(channel, true, false);
+        break;
+    case ATA_COMMAND_WRITE_DMA:
+        ata_start_dma(channel, false, true);
+        break;
+    case ATA_COMMAND_WRITE_DMA_EXT:
+        ata_start_dma(channel, true, true);
+        break;
+    case ATA_COMMAND_SET_FEATURES:
+        // only picking a transfer mode, everything moves at the same speed anyway
+        if (channel->features == ATA_FEATURE_SET_TRANSFER_MODE && (channel->drive_head & ATA_DRIVE_HEAD_DRIVE))
+        {
+            channel->transfer_mode = channel->sector_count;
+        }
+        else
+        {
+            ata_fail(channel, ATA_ERROR_ABORTED_COMMAND);
+        }
+        ata_interrupt(channel);
+        break;
+    case ATA_COMMAND_SET_MULTIPLE_MODE:
+        // a power of two up to ATA_MAX_MULTIPLE_SECTORS, 0 turns the MULTIPLE commands off again
+        if (!(channel->drive_head & ATA_DRIVE_HEAD_DRIVE) || channel->sector_count > ATA_MAX_MULTIPLE_SECTORS || (channel->sector_count & (channel->sector_count - 1)) != 0)
+        {
+            ata_fail(channel, ATA_ERROR_ABORTED_COMMAND);
+        }
+        else
+        {
+            channel->multiple_sectors = channel->sector_count;
+        }
+        ata_interrupt(channel);
+        break;
     case ATA_COMMAND_IDENTIFY_DEVICE:
         if (channel->drive_head & ATA_DRIVE_HEAD_DRIVE) // hard disk
         {
@@ -420,9 +1145,7 @@ static void ata_handle_command(exit_io_info_t *io, uint8_t *base, ata_channel_t
             channel->status |= ATA_STATUS_BUSY;
             pthread_mutex_unlock(&channel->status_mutex);
             channel->expecting = ATA_IDENTIFY;
-            pthread_t thread;
-            pthread_create(&thread, NULL, ata_identify_device, channel);
-            pthread_detach(thread);
+            ata_submit(channel, ata_identify_device);
         }
         else // cdrom
         {
@@ -437,18 +1160,26 @@ static void ata_handle_command(exit_io_info_t *io, uint8_t *base, ata_channel_t
     }
 }
 
-void ata_handle_io(exit_io_info_t *io, uint8_t *base, bool is_secondary)
+void ata_handle_io(void *opaque, exit_io_info_t *io, uint8_t *base)
 {
     LOG_MSG("Handling ata io port: 0x%x, direction: 0x%x, size: 0x%x, count: 0x%x, data: 0x%x", io->port, io->direction, io->size, io->count, base[io->data_offset]);
-    uint8_t offset = is_secondary ? io->port - ATA_SLAVE_BASE : io->port - ATA_MASTER_BASE;
-    ata_channel_t *channel = &ata_channels[is_secondary ? 1 : 0];
+    ata_channel_t *channel = opaque;
+    if (channel != &ata_primary)
+    {
+        return; // nothing is attached to the secondary channel yet
+    }
+    uint8_t offset = io->port - ATA_MASTER_BASE;
 
     if (io->direction == EXIT_IO_OUT)
     {
         switch (offset)
         {
         case ATA_IO_OFFSET_DATA:
-            if (channel->status & ATA_STATUS_DATA_REQUEST)
+            if (channel->expecting == ATA_SECTORS_OUT && channel->status & ATA_STATUS_DATA_REQUEST)
+            {
+                ata_sectors_out(channel, io, base);
+            }
+            else if (channel->status & ATA_STATUS_DATA_REQUEST)
             {
                 if (channel->expecting != ATA_SCSI_CDB)
                 {
@@ -456,10 +1187,16 @@ void ata_handle_io(exit_io_info_t *io, uint8_t *base, bool is_secondary)
                     exit(1);
                 }
                 // pthread_mutex_lock(&channel->buffer_mutex);
-                memcpy(channel->scsi_cdb_buffer + channel->scsi_cdb_buffer_size / 2, base + io->data_offset, io->count * io->size);
-                LOG_MSG("Read %d bytes from data_buffer at offset %d", io->count * io->size, channel->scsi_cdb_buffer_size);
+                // a rep outsw can carry more than the 12 CDB bytes, whatever is past them is dropped
+                uint32_t to_copy = io->count * io->size;
+                if (to_copy > sizeof(channel->scsi_cdb_buffer) - channel->scsi_cdb_buffer_size)
+                {
+                    to_copy = sizeof(channel->scsi_cdb_buffer) - channel->scsi_cdb_buffer_size;
+                }
+                memcpy((uint8_t *)channel->scsi_cdb_buffer + channel->scsi_cdb_buffer_size, base + io->data_offset, to_copy);
+                LOG_MSG("Read %d bytes from data_buffer at offset %d", to_copy, channel->scsi_cdb_buffer_size);
                 pthread_mutex_lock(&channel->scsi_cdb_buffer_mutex);
-                channel->scsi_cdb_buffer_size += io->count * io->size;
+                channel->scsi_cdb_buffer_size += to_copy;
                 pthread_mutex_unlock(&channel->scsi_cdb_buffer_mutex);
                 LOG_MSG("scsi_cdb_buffer_size: %d\n", channel->scsi_cdb_buffer_size);
                 uint8_t *cdb = (uint8_t *)channel->scsi_cdb_buffer;
@@ -475,10 +1212,7 @@ void ata_handle_io(exit_io_info_t *io, uint8_t *base, bool is_secondary)
                     channel->scsi_cdb_buffer_size = 0;
                     pthread_mutex_unlock(&channel->scsi_cdb_buffer_mutex);
 
-                    pthread_t thread;
-                    pthread_create(&thread, NULL, ata_handle_scsi_cdb, channel);
-                    pthread_detach(thread);
-                    LOG_MSG("created thread\n");
+                    ata_submit(channel, ata_handle_scsi_cdb);
                 }
             }
             else
@@ -488,23 +1222,22 @@ void ata_handle_io(exit_io_info_t *io, uint8_t *base, bool is_secondary)
             }
             break;
         case ATA_IO_OFFSET_FEATURES:
-            channel->features = base[io->data_offset];
-            if (channel->features != 0)
-            {
-                printf("Invalid features: %b\n", channel->features);
-                exit(1);
-            }
+            channel->features = base[io->data_offset]; // only SET FEATURES looks at it
             break;
         case ATA_IO_OFFSET_SECTOR_COUNT:
+            channel->hob_sector_count = channel->sector_count;
             channel->sector_count = base[io->data_offset];
             break;
         case ATA_IO_OFFSET_SECTOR_NUMBER_LBA_LOW:
+            channel->hob_lba[0] = channel->mode.any.first;
             channel->mode.any.first = base[io->data_offset];
             break;
         case ATA_IO_OFFSET_CYLINDER_LOW_LBA_MID:
+            channel->hob_lba[1] = channel->mode.any.second;
             channel->mode.any.second = base[io->data_offset];
             break;
         case ATA_IO_OFFSET_CYLINDER_HIGH_LBA_HIGH:
+            channel->hob_lba[2] = channel->mode.any.third;
             channel->mode.any.third = base[io->data_offset];
             break;
         case ATA_IO_OFFSET_DRIVE_HEAD:
@@ -524,10 +1257,15 @@ void ata_handle_io(exit_io_info_t *io, uint8_t *base, bool is_secondary)
     }
     else // EXIT_IO_IN
     {
+        bool hob = channel->control & ATA_DEVICE_CONTROL_READBACK;
         switch (offset)
         {
         case ATA_IO_OFFSET_DATA:
-            if (channel->status & ATA_STATUS_DATA_REQUEST && channel->data_buffer_read < channel->data_buffer_size)
+            if (channel->expecting == ATA_SECTORS_IN && channel->status & ATA_STATUS_DATA_REQUEST)
+            {
+                ata_sectors_in(channel, io, base);
+            }
+            else if (channel->status & ATA_STATUS_DATA_REQUEST && channel->data_buffer_read < channel->data_buffer_size)
             {
                 uint32_t to_read = io->count * io->size;
                 if (channel->data_buffer_read + to_read > channel->data_buffer_size)
@@ -541,11 +1279,6 @@ void ata_handle_io(exit_io_info_t *io, uint8_t *base, bool is_secondary)
                 LOG_MSG("Wrote %d bytes to data_buffer at offset %d", to_read, channel->data_buffer_read);
                 channel->data_buffer_read += to_read;
 
-                for (int i = 0; i < to_read; i++)
-                {
-                    LOG_MSG("%d: %02x ", i, base[io->data_offset + i]);
-                }
-
                 if (channel->data_buffer_read == channel->data_buffer_size)
                 {
                     channel->data_buffer_read = 0;
@@ -568,6 +1301,7 @@ void ata_handle_io(exit_io_info_t *io, uint8_t *base, bool is_secondary)
                 LOG_MSG("Data requested without data available\n");
                 exit(1);
             }
+            break;
         case ATA_IO_OFFSET_ERROR:
             base[io->data_offset] = channel->error;
             channel->error = 0;
@@ -576,10 +1310,16 @@ void ata_handle_io(exit_io_info_t *io, uint8_t *base, bool is_secondary)
             pthread_mutex_unlock(&channel->status_mutex);
             break;
         case ATA_IO_OFFSET_SECTOR_COUNT:
-            base[io->data_offset] = channel->sector_count;
+            base[io->data_offset] = hob ? channel->hob_sector_count : channel->sector_count;
             break;
         case ATA_IO_OFFSET_SECTOR_NUMBER_LBA_LOW:
-            base[io->data_offset] = channel->mode.any.first;
+            base[io->data_offset] = hob ? channel->hob_lba[0] : channel->mode.any.first;
+            break;
+        case ATA_IO_OFFSET_CYLINDER_LOW_LBA_MID:
+            base[io->data_offset] = hob ? channel->hob_lba[1] : channel->mode.any.second;
+            break;
+        case ATA_IO_OFFSET_CYLINDER_HIGH_LBA_HIGH:
+            base[io->data_offset] = hob ? channel->hob_lba[2] : channel->mode.any.third;
             break;
         case ATA_IO_OFFSET_DRIVE_HEAD:
             base[io->data_offset] = channel->drive_head;
@@ -597,11 +1337,36 @@ void ata_handle_io(exit_io_info_t *io, uint8_t *base, bool is_secondary)
     }
 }
 
-void ata_handle_control(exit_io_info_t *io, uint8_t *base, bool slave)
+// The 16 bit accesses of the primary data port, nearly all of its traffic. A PIO sector transfer goes straight to
+// the sector buffer instead of through the register decoding of ata_handle_io.
+void ata_handle_data(void *opaque, exit_io_info_t *io, uint8_t *base)
+{
+    ata_channel_t *channel = opaque;
+    if (channel->status & ATA_STATUS_DATA_REQUEST)
+    {
+        if (io->direction == EXIT_IO_IN && channel->expecting == ATA_SECTORS_IN)
+        {
+            ata_sectors_in(channel, io, base);
+            return;
+        }
+        if (io->direction == EXIT_IO_OUT && channel->expecting == ATA_SECTORS_OUT)
+        {
+            ata_sectors_out(channel, io, base);
+            return;
+        }
+    }
+    ata_handle_io(opaque, io, base);
+}
+
+void ata_handle_control(void *opaque, exit_io_info_t *io, uint8_t *base)
 {
     LOG_MSG("Handling ata control port: 0x%x, direction: 0x%x, size: 0x%x, count: 0x%x, data: 0x%x", io->port, io->direction, io->size, io->count, base[io->data_offset]);
-    uint8_t offset = slave ? io->port - ATA_SLAVE_CONTROL : io->port - ATA_MASTER_CONTROL;
-    ata_channel_t *channel = &ata_channels[slave ? 1 : 0];
+    ata_channel_t *channel = opaque;
+    if (channel != &ata_primary)
+    {
+        return;
+    }
+    uint8_t offset = io->port - ATA_MASTER_CONTROL;
     switch (offset)
     {
     case ATA_CONTROL_OFFSET_DEVICE_CONTROL:
@@ -621,6 +1386,7 @@ void ata_handle_control(exit_io_info_t *io, uint8_t *base, bool slave)
                 pthread_mutex_unlock(&channel->data_buffer_mutex);
             }
             channel->control = data;
+            channel->disable_interrupts = data & ATA_DEVICE_CONTROL_STOP_INTERRUPTS;
         }
         else // EXIT_IO_IN
         {
@@ -630,24 +1396,4 @@ void ata_handle_control(exit_io_info_t *io, uint8_t *base, bool slave)
     default:
         unhandled(io, base);
     }
-}
-
-void ata_handle_io_primary(exit_io_info_t *io, uint8_t *base)
-{
-    ata_handle_io(io, base, false);
-}
-
-void ata_handle_io_secondary(exit_io_info_t *io, uint8_t *base)
-{
-    // ata_handle_io(io, base, true);
-}
-
-void ata_handle_control_primary(exit_io_info_t *io, uint8_t *base)
-{
-    ata_handle_control(io, base, false);
-}
-
-void ata_handle_control_secondary(exit_io_info_t *io, uint8_t *base)
-{
-    // ata_handle_control(io, base, true);
 }
\ No newline at end of file
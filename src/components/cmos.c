@@ -3,6 +3,9 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include "log.h"
+#include "kvm.h"
+#include "memory.h"
+#include "snapshot.h"
 
 LOG_DEFINE("cmos");
 
@@ -14,14 +17,40 @@ static uint8_t registers[NUM_REGISTERS] = {0};
 
 static uint8_t cur_register = 0;
 
-void cmos_init()
+void cmos_init(void *opaque)
 {
+    snapshot_register("cmos.registers", 1, registers, sizeof(registers), NULL);
+    snapshot_register("cmos.cur_register", 1, &cur_register, sizeof(cur_register), NULL);
+    snapshot_register("cmos.nmi_disabled", 1, &nmi_disabled, sizeof(nmi_disabled), NULL);
+
     uint16_t conventional_memory_kb = 640;
     registers[0x15] = conventional_memory_kb & 0xFF;
     registers[0x16] = (conventional_memory_kb >> 8) & 0xFF;
+
+    // memory between 1M and 64M in KiB
+    uint64_t extended_kb = (memory_get_below_4g() - 0x100000) >> 10;
+    if (extended_kb > 0xFFFF)
+    {
+        extended_kb = 0xFFFF;
+    }
+    registers[0x17] = registers[0x30] = extended_kb & 0xFF;
+    registers[0x18] = registers[0x31] = (extended_kb >> 8) & 0xFF;
+
+    // memory between 16M and the PCI hole in 64KiB chunks, seabios takes its ram size from this
+    uint64_t extended2_chunks = memory_get_below_4g() > 0x1000000 ? (memory_get_below_4g() - 0x1000000) >> 16 : 0;
+    registers[0x34] = extended2_chunks & 0xFF;
+    registers[0x35] = (extended2_chunks >> 8) & 0xFF;
+
+    // memory above 4G in 64KiB chunks
+    uint64_t high_chunks = memory_get_above_4g() >> 16;
+    registers[0x5b] = high_chunks & 0xFF;
+    registers[0x5c] = (high_chunks >> 8) & 0xFF;
+    registers[0x5d] = (high_chunks >> 16) & 0xFF;
+
+    registers[0x5f] = kvm_get_vcpu_count() - 1; // seabios reads the number of cpus to wait for from here
 }
 
-void cmos_handle(exit_io_info_t* io, uint8_t* base)
+void cmos_handle(void *opaque, exit_io_info_t *io, uint8_t *base)
 {
     // printf("data: %x\n", base[data_offset]);
     // LOG_MSG("Handling cmos port: 0x%x, direction: 0x%x, size: 0x%x, count: 0x%x, data: 0x%lx", io->port, io->direction, io->size, io->count, base[io->data_offset]);
@@ -1,13 +1,16 @@
 #include <stdio.h>
 #include "components/com.h"
 #include "common.h"
+#include "snapshot.h"
 
 static FILE* com_file = NULL;
 
 static uint8_t com_interrupt_enable = 0;
 
-void com_init()
+void com_init(void *opaque)
 {
+    snapshot_register("com.interrupt_enable", 1, &com_interrupt_enable, sizeof(com_interrupt_enable), NULL);
+
     com_file = fopen("com.txt", "w");
     if (com_file == NULL)
     {
@@ -15,15 +18,14 @@ void com_init()
     }
 }
 
-void com_handle(exit_io_info_t* io, uint8_t* base)
+void com_handle(void *opaque, exit_io_info_t *io, uint8_t *base)
 {
     if (io->direction == EXIT_IO_OUT)
     {
         switch(io->port)
         {
             case 0x3f8:
-                fprintf(com_file, "%c", base[io->data_offset]);
-                fflush(com_file);
+                fwrite(base + io->data_offset, 1, io->count, com_file); // flushed periodically by the coalesced io thread
                 break;
             case 0x3f9:
                 com_interrupt_enable = base[io->data_offset];
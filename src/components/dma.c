@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include "log.h"
+#include "snapshot.h"
 
 LOG_DEFINE("dma");
 
@@ -71,26 +72,34 @@ typedef struct
     bool status;
 } dma_config_t;
 
-typedef struct
+typedef struct dma_slave
 {
     dma_config_t config;
 } dma_slave_t;
 
-typedef struct
+typedef struct dma_master
 {
     dma_config_t config;
 } dma_master_t;
 
-static dma_slave_t dma_slave;
-static dma_master_t dma_master;
+dma_slave_t dma_slave;
+dma_master_t dma_master;
 
 // uses the "slave" variable from the dma_handle function to get the config struct
 #define DMA_CONFIG_CONTROLLER ((dma_config_t *)((slave) ? &(dma_slave.config) : &(dma_master.config)))
 
 static uint8_t flip_flop = 0;
 
-void dma_handle(exit_io_info_t *io, uint8_t *base, bool slave)
+void dma_init(void *opaque)
+{
+    snapshot_register("dma.slave", 1, &dma_slave, sizeof(dma_slave), NULL);
+    snapshot_register("dma.master", 1, &dma_master, sizeof(dma_master), NULL);
+    snapshot_register("dma.flip_flop", 1, &flip_flop, sizeof(flip_flop), NULL);
+}
+
+void dma_handle(void *opaque, exit_io_info_t *io, uint8_t *base)
 {
+    bool slave = opaque == &dma_slave;
     LOG_MSG("Handling dma port: 0x%x, direction: 0x%x, size: 0x%x, count: 0x%x, data: 0x%lx", io->port, io->direction, io->size, io->count, base[io->data_offset]);
 
     if (io->port == DMA_MASTER_INTERMEDIATE_MASTER_RESET || io->port == DMA_SLAVE_INTERMEDIATE_MASTER_RESET)
@@ -136,14 +145,4 @@ void dma_handle(exit_io_info_t *io, uint8_t *base, bool slave)
     }
     printf("DMA Port 0x%02x is unhandled for direction: %d\n", io->port, io->direction);
     exit(1);
-}
-
-void dma_handle_master(exit_io_info_t *io, uint8_t *base)
-{
-    dma_handle(io, base, false);
-}
-
-void dma_handle_slave(exit_io_info_t *io, uint8_t *base)
-{
-    dma_handle(io, base, true);
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 #include "components/pci.h"
 #include "log.h"
 #include "common.h"
+#include "memory.h"
+#include "snapshot.h"
+#include "mmio_manager.h"
 #include <err.h>
 #include <string.h>
 
@@ -27,10 +30,12 @@ enum pci_config_space_fields
     LATENCY_TIMER,
     HEADER_TYPE,
     BIST,
+    BAR0 = 0x10,
     PCI_SUBSYSTEM_VENDOR_ID_LOW = 0x2c,
     PCI_SUBSYSTEM_VENDOR_ID_HIGH,
     SUBSYSTEM_ID_LOW,
     SUBSYSTEM_ID_HIGH,
+    EXPANSION_ROM_BASE,
     // BAR_START,
     // BAR_END = 0x27,
     // CIS_PTR_START,
@@ -87,6 +92,13 @@ enum pci_config_space_fields
 #define MAX_DEVICES 32
 #define MAX_FUNCTIONS 8
 
+#define PCI_BARS 6
+#define PCI_COMMAND_IO 0x1
+#define PCI_COMMAND_MEMORY 0x2
+#define PCI_BAR_IO 0x1
+#define PCI_IO_LIMIT 0x10000
+#define MAX_MAPPED_BARS 16
+
 static uint32_t last_config_address = 0;
 static uint8_t config_index = 0;
 static uint8_t config_register = 0;
@@ -98,6 +110,22 @@ typedef struct
 
 static pci_device_t devices[MAX_BUSES] = {(pci_device_t){{0}}}; // set all values in the config_space to 0
 
+// BARs that decode to a device, any other BAR (and every expansion rom BAR) reads as not implemented
+typedef struct
+{
+    uint8_t device_index;
+    uint8_t bar;
+    uint32_t size;
+    bool io;
+    int mmio_id;           // memory BARs
+    io_handle_t io_handle; // IO BARs
+    void *opaque;
+    uint32_t io_port; // where an IO BAR is mapped right now, 0 while it isn't
+} pci_bar_t;
+
+static pci_bar_t bars[MAX_MAPPED_BARS];
+static int bar_count = 0;
+
 static inline void pci_set_config_u8(uint8_t device_index, enum pci_config_space_fields field, uint8_t value)
 {
     devices[device_index].config_space[field / 4] = (devices[device_index].config_space[field / 4] & ~(0xFF << (8 * (field % 4)))) | (value << (8 * (field % 4)));
@@ -115,7 +143,7 @@ static inline void pci_set_config_u16(uint8_t device_index, enum pci_config_spac
 
 static inline uint16_t pci_get_config_u16(uint8_t device_index, enum pci_config_space_fields field)
 {
-    return (devices[device_index].config_space[field / 4] >> (16 * (field % 4))) & 0xFFFF;
+    return (devices[device_index].config_space[field / 4] >> (8 * (field % 4))) & 0xFFFF;
 }
 
 static inline void pci_set_config_u32(uint8_t device_index, enum pci_config_space_fields field, uint32_t value)
@@ -128,8 +156,15 @@ static inline uint32_t pci_get_config_u32(uint8_t device_index, enum pci_config_
     return devices[device_index].config_space[field / 4];
 }
 
-void pci_init()
+static void pci_post_load();
+
+void pci_init(void *opaque)
 {
+    snapshot_register("pci.devices", 1, devices, sizeof(devices), pci_post_load);
+    snapshot_register("pci.last_config_address", 1, &last_config_address, sizeof(last_config_address), NULL);
+    snapshot_register("pci.config_index", 1, &config_index, sizeof(config_index), NULL);
+    snapshot_register("pci.config_register", 1, &config_register, sizeof(config_register), NULL);
+
     // i440fx
     pci_add_device(0, 0, 0, VI_INTEL, DI_I440FX);
     pci_set_config_u16(PCI_BRIDGE, COMMAND_LOW, 0x0006);
@@ -148,6 +183,7 @@ void pci_init()
     // ata
     pci_add_device(0, 1, 0, 0x1002, 0x4391); // vendor ati, device sb700
     pci_set_config_u16(0 * 32 + 1 * 8 + 0, SUBCLASS, 0x0101);
+    pci_set_config_u8(0 * 32 + 1 * 8 + 0, PROG_IF, 0x80); // both channels at the legacy ports, bus master capable
 }
 
 void pci_add_device(uint8_t bus, uint8_t device, uint8_t function, uint16_t vendor_id, uint16_t device_id)
@@ -157,7 +193,142 @@ void pci_add_device(uint8_t bus, uint8_t device, uint8_t function, uint16_t vend
     pci_set_config_u16(device_index, DEVICE_ID_LOW, device_id);
 }
 
-void pci_handle(exit_io_info_t *io, uint8_t *base)
+// A 32 bit memory BAR of size bytes (a power of two), handed to the mmio manager wherever the guest places it
+void pci_add_mmio_bar(uint8_t bus, uint8_t device, uint8_t function, uint8_t bar, uint32_t size, mmio_handle_t handle, void *opaque)
+{
+    if (bar_count == MAX_MAPPED_BARS || bar >= PCI_BARS || size < 16 || (size & (size - 1)) != 0)
+    {
+        errx(1, "Invalid BAR%d of size 0x%x", bar, size);
+    }
+    bars[bar_count++] = (pci_bar_t){
+        .device_index = bus * 32 + device * 8 + function,
+        .bar = bar,
+        .size = size,
+        .mmio_id = mmio_manager_register(handle, opaque, MMIO_UNMAPPED, size),
+    };
+}
+
+// An IO BAR of size ports (a power of two), its handler sees the absolute port numbers wherever the guest places it
+void pci_add_io_bar(uint8_t bus, uint8_t device, uint8_t function, uint8_t bar, uint32_t size, io_handle_t handle, void *opaque)
+{
+    if (bar_count == MAX_MAPPED_BARS || bar >= PCI_BARS || size < 4 || size > 256 || (size & (size - 1)) != 0)
+    {
+        errx(1, "Invalid IO BAR%d of size 0x%x", bar, size);
+    }
+    uint8_t device_index = bus * 32 + device * 8 + function;
+    bars[bar_count++] = (pci_bar_t){
+        .device_index = device_index,
+        .bar = bar,
+        .size = size,
+        .io = true,
+        .mmio_id = -1,
+        .io_handle = handle,
+        .opaque = opaque,
+    };
+    pci_set_config_u32(device_index, BAR0 + bar * 4, PCI_BAR_IO);
+}
+
+static pci_bar_t *pci_find_bar(uint8_t device_index, uint8_t bar)
+{
+    for (int i = 0; i < bar_count; i++)
+    {
+        if (bars[i].device_index == device_index && bars[i].bar == bar)
+        {
+            return &bars[i];
+        }
+    }
+    return NULL;
+}
+
+// Like real hardware only the address bits above the size stick, which is how the guest sizes a BAR
+static void pci_mask_bar(uint8_t device_index, uint8_t offset)
+{
+    pci_bar_t *bar = offset == EXPANSION_ROM_BASE ? NULL : pci_find_bar(device_index, (offset - BAR0) / 4);
+    uint32_t value = bar == NULL ? 0 : pci_get_config_u32(device_index, offset) & ~(bar->size - 1);
+    if (bar != NULL && bar->io)
+    {
+        value |= PCI_BAR_IO;
+    }
+    pci_set_config_u32(device_index, offset, value);
+}
+
+static void pci_map_io_bar(pci_bar_t *bar, bool enabled)
+{
+    uint32_t port = pci_get_config_u32(bar->device_index, BAR0 + bar->bar * 4) & ~0x3u;
+    // like the memory BARs, the all ones pattern of sizing (anything past 64K really) doesn't decode
+    port = enabled && port + bar->size <= PCI_IO_LIMIT ? port : 0;
+    if (port == bar->io_port)
+    {
+        return;
+    }
+    if (bar->io_port != 0)
+    {
+        io_manager_unmap(bar->io_port, bar->size);
+    }
+    // neither does port 0 or a BAR on top of a fixed device
+    bar->io_port = port != 0 && io_manager_map(bar->io_handle, bar->opaque, port, bar->size) ? port : 0;
+}
+
+static void pci_map_bars(uint8_t device_index)
+{
+    uint16_t command = pci_get_config_u16(device_index, COMMAND_LOW);
+    bool enabled = command & PCI_COMMAND_MEMORY;
+    for (int i = 0; i < bar_count; i++)
+    {
+        pci_bar_t *bar = &bars[i];
+        if (bar->device_index != device_index)
+        {
+            continue;
+        }
+        if (bar->io)
+        {
+            pci_map_io_bar(bar, command & PCI_COMMAND_IO);
+            continue;
+        }
+        uint64_t address = pci_get_config_u32(device_index, BAR0 + bar->bar * 4) & ~0xfu;
+        // 0 and the all ones pattern of sizing don't decode
+        bool mapped = enabled && address != 0 && address + bar->size < 0x100000000ull;
+        mmio_manager_move(bar->mmio_id, mapped ? address : MMIO_UNMAPPED);
+    }
+}
+
+// Side effects of config space writes
+static void pci_config_written(uint8_t device_index, uint8_t offset, uint8_t size)
+{
+    for (int reg = offset & ~3; reg < offset + size; reg += 4)
+    {
+        if ((reg >= BAR0 && reg < BAR0 + PCI_BARS * 4) || reg == EXPANSION_ROM_BASE)
+        {
+            pci_mask_bar(device_index, reg);
+        }
+    }
+    if (offset < BAR0 + PCI_BARS * 4 && offset + size > COMMAND_LOW)
+    {
+        pci_map_bars(device_index);
+    }
+
+    if (device_index == PCI_BRIDGE && offset + size > PAM0 && offset <= PAM6)
+    {
+        uint8_t pam[MEMORY_PAM_REGISTERS];
+        for (int i = 0; i < MEMORY_PAM_REGISTERS; i++)
+        {
+            pam[i] = pci_get_config_u8(PCI_BRIDGE, PAM0 + i);
+        }
+        memory_set_pam(pam);
+    }
+}
+
+// the memory slots aren't part of the snapshot, the PAM registers are
+static void pci_post_load()
+{
+    pci_config_written(PCI_BRIDGE, PAM0, MEMORY_PAM_REGISTERS);
+    for (int i = 0; i < bar_count; i++)
+    {
+        pci_map_bars(bars[i].device_index);
+    }
+}
+
+void pci_handle(void *opaque, exit_io_info_t *io, uint8_t *base)
 {
     LOG_MSG("Handling pci port: 0x%x, direction: 0x%x, size: 0x%x, count: 0x%x, data: 0x%x", io->port, io->direction, io->size, io->count, READ_UINT32(base + io->data_offset));
 
@@ -229,6 +400,7 @@ void pci_handle(exit_io_info_t *io, uint8_t *base)
                 pci_set_config_u32(config_index, config_register * 4 + io->port - CONFIG_DATA, READ_UINT32(base + io->data_offset));
                 break;
             }
+            pci_config_written(config_index, config_register * 4 + io->port - CONFIG_DATA, io->size);
         }
     }
     else
@@ -2,11 +2,11 @@
 #include <err.h>
 #include <pthread.h>
 #include <unistd.h>
-#include <time.h>
 #include "components/pic.h"
 #include "common.h"
 #include "kvm.h"
 #include "log.h"
+#include "snapshot.h"
 
 LOG_DEFINE("pic");
 
@@ -23,7 +23,7 @@ typedef enum
     PIC_ICW4
 } pic_init_state_t;
 
-typedef struct
+typedef struct pic
 {
     pic_init_state_t init_state;
     struct
@@ -82,114 +82,133 @@ typedef struct
     bool auto_rotate;
 } pic_t;
 
-static pic_t pic_master;
-static pic_t pic_slave;
+pic_t pic_master;
+pic_t pic_slave;
 
-#define PIC_CLOCK_FREQUENCY_HZ 1000
 static pthread_mutex_t pic_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static pthread_t pic_thread = NULL;
+// in-kernel irqchip only: writing to these pulses the irq line without an ioctl
+static int pic_irqfds[16] = {[0 ... 15] = -1};
 
 // #define PIC_CONTROLLER ((slave) ? (pic_slave) : (pic_master))
 
-uint8_t pic_get_next_interrupt(pic_t *pic)
+// The highest priority irq that is requested, unmasked and not blocked by an irq of higher priority that is
+// still in service. -1 if there is none.
+static int pic_get_next_interrupt(pic_t *pic, uint8_t irr)
 {
-    uint8_t pending = pic->irr & ~pic->imr; // only the interrupts that are pending and not masked will remain
+    uint8_t pending = irr & ~pic->imr; // only the interrupts that are pending and not masked will remain
 
     if (pending == 0)
     {
-        return 0xff; // not interrupt pending
+        return -1; // not interrupt pending
     }
 
-    for (int i = 0; i < 8; i++)
+    for (int i = 1; i <= 8; i++)
     {
-        uint8_t check_level = (pic->lowest_priority + i) % 8; // check from the lowest priority in a clock-like cycle
+        uint8_t check_level = (pic->lowest_priority + i) % 8; // the highest priority is the one right after the lowest
+        if (pic->isr & (1 << check_level) && !pic->ocw3.smm)
+        {
+            return -1;
+        }
         if (pending & (1 << check_level))
         {
-            pic->irr &= ~(1 << check_level); // clear interrupt
             return check_level;
         }
     }
 
-    return 0xff; // shouldn't happen if pending is non-zero
+    return -1; // shouldn't happen if pending is non-zero
 }
 
-void pic_process_interrupts()
+// the slave's output is wired to irq 2 of the master
+static uint8_t pic_master_irr()
 {
-    pic_t *pics[] = {&pic_master, &pic_slave};
-    for (int i = 0; i < 2; i++) // 2 for the 2 pic's: master and slave
+    uint8_t irr = pic_master.irr;
+    if (pic_get_next_interrupt(&pic_slave, pic_slave.irr) >= 0)
     {
-        pic_t *pic = pics[i];
-        uint8_t next_interrupt = pic_get_next_interrupt(pic);
-        if (next_interrupt != 0xff) // no interrupt
-        {
-            uint8_t vector = pic->icw2.offset + next_interrupt;
-            LOG_MSG("Interrupt %d, vector %d", next_interrupt, vector);
-            kvm_interrupt(vector);
+        irr |= 1 << PIC_IRQ2;
+    }
+    return irr;
+}
 
-            if (!pic->icw4.aeoi)
-            {
-                pic->isr |= (1 << next_interrupt);
-            }
-            else if (pic->auto_rotate)
-            {
-                pic->lowest_priority = next_interrupt;
-            }
-        }
+static void pic_accept_interrupt(pic_t *pic, int irq)
+{
+    pic->irr &= ~(1 << irq); // clear interrupt
+    if (!pic->icw4.aeoi)
+    {
+        pic->isr |= (1 << irq);
+    }
+    else if (pic->auto_rotate)
+    {
+        pic->lowest_priority = irq;
     }
 }
 
-void pic_clock_thread(void *arg)
+bool pic_has_interrupt()
 {
-    struct timespec sleep_time;
-    sleep_time.tv_sec = 0;
-    sleep_time.tv_nsec = 1000000000 / PIC_CLOCK_FREQUENCY_HZ; // nanoseconds per clock tick
+    pthread_mutex_lock(&pic_mutex);
+    bool pending = pic_get_next_interrupt(&pic_master, pic_master_irr()) >= 0;
+    pthread_mutex_unlock(&pic_mutex);
+    return pending;
+}
 
-    while (1)
+// The interrupt acknowledge cycle: picks the next interrupt, moves it to in service and returns its vector
+int pic_acknowledge_interrupt()
+{
+    pthread_mutex_lock(&pic_mutex);
+    int vector = -1;
+    int irq = pic_get_next_interrupt(&pic_master, pic_master_irr());
+    if (irq >= 0)
     {
-        nanosleep(&sleep_time, NULL);
-
-        if (kvm_is_interrupts_enabled())
+        int slave_irq = pic_get_next_interrupt(&pic_slave, pic_slave.irr);
+        if (irq == PIC_IRQ2 && slave_irq >= 0)
+        {
+            pic_accept_interrupt(&pic_slave, slave_irq);
+            vector = pic_slave.icw2.offset + slave_irq;
+        }
+        else
         {
-            pthread_mutex_lock(&pic_mutex);
-            pic_process_interrupts();
-            pthread_mutex_unlock(&pic_mutex);
+            vector = pic_master.icw2.offset + irq;
         }
+        pic_accept_interrupt(&pic_master, irq);
     }
+    pthread_mutex_unlock(&pic_mutex);
 
-    return NULL;
+    if (vector >= 0)
+    {
+        LOG_MSG("Interrupt %d, vector %d", irq, vector);
+    }
+    return vector;
 }
 
-void pic_init(bool slave)
+void pic_init(void *opaque)
 {
-    if (pic_thread == NULL)
+    bool slave = opaque == &pic_slave;
+    snapshot_register(slave ? "pic.slave" : "pic.master", 1, slave ? &pic_slave : &pic_master, sizeof(pic_t), NULL);
+
+    if (kvm_get_irqchip_mode() == KVM_IRQCHIP_KERNEL)
     {
-        if (pthread_create(&pic_thread, NULL, pic_clock_thread, NULL) != 0)
+        // the kernel owns the PIC state and handles its ports
+        int first_irq = slave ? PIC_IRQ8 : PIC_IRQ0;
+        for (int irq = first_irq; irq < first_irq + 8; irq++)
         {
-            errx(1, "Failed to create pic clock thread");
+            if (irq != PIC_IRQ2) // cascade
+            {
+                pic_irqfds[irq] = kvm_create_irqfd(irq);
+            }
         }
+        return;
     }
 
-    pic_t *pic = slave ? &pic_slave : &pic_master;
+    pic_t *pic = opaque;
     pic->imr = 0xff;
     pic->lowest_priority = 7;
 }
 
-void pic_init_master()
-{
-    pic_init(false);
-}
-
-void pic_init_slave()
-{
-    pic_init(true);
-}
-
-void pic_handle(exit_io_info_t *io, uint8_t *base, bool slave)
+static void pic_handle_port(pic_t *pic, exit_io_info_t *io, uint8_t *base)
 {
+    bool slave = pic == &pic_slave;
     LOG_MSG("Handling pic port: 0x%x, direction: 0x%x, size: 0x%x, count: 0x%x, data: 0x%lx", io->port, io->direction, io->size, io->count, base[io->data_offset]);
 
-    pic_t *pic = slave ? &pic_slave : &pic_master;
     if (io->port == PIC_MASTER_COMMAND || io->port == PIC_SLAVE_COMMAND)
     {
         if (io->direction == EXIT_IO_OUT)
@@ -348,14 +367,16 @@ void pic_handle(exit_io_info_t *io, uint8_t *base, bool slave)
     exit(1);
 }
 
-void pic_handle_master(exit_io_info_t *io, uint8_t *base)
+void pic_handle(void *opaque, exit_io_info_t *io, uint8_t *base)
 {
-    pic_handle(io, base, false);
-}
-
-void pic_handle_slave(exit_io_info_t *io, uint8_t *base)
-{
-    pic_handle(io, base, true);
+    pthread_mutex_lock(&pic_mutex);
+    pic_handle_port(opaque, io, base);
+    pthread_mutex_unlock(&pic_mutex);
+    // an EOI, unmask or reinit can release a pending interrupt, reading IRR/ISR/IMR changes nothing
+    if (io->direction == EXIT_IO_OUT)
+    {
+        kvm_kick_vcpu(kvm_get_vcpu(KVM_BOOT_VCPU));
+    }
 }
 
 void pic_raise_interrupt(uint8_t irq)
@@ -365,7 +386,19 @@ void pic_raise_interrupt(uint8_t irq)
         return;
     }
 
-    pic_t *pic = irq < 8 ? &pic_master : &pic_master;
+    if (kvm_get_irqchip_mode() == KVM_IRQCHIP_KERNEL)
+    {
+        // all our devices are edge triggered, which is exactly what an irqfd signal injects
+        uint64_t one = 1;
+        if (pic_irqfds[irq] < 0 || write(pic_irqfds[irq], &one, sizeof(one)) != sizeof(one))
+        {
+            kvm_irq_line(irq, 1);
+            kvm_irq_line(irq, 0);
+        }
+        return;
+    }
+
+    pic_t *pic = irq < 8 ? &pic_master : &pic_slave;
     irq = irq % 8;
     LOG_MSG("Raising interrupt %d", irq);
     pthread_mutex_lock(&pic_mutex);
@@ -374,4 +407,7 @@ void pic_raise_interrupt(uint8_t irq)
         pic->irr |= 1 << irq; // raise interrupt
     }
     pthread_mutex_unlock(&pic_mutex);
+
+    // the PIC output goes to the BSP, which injects it from its own thread
+    kvm_kick_vcpu(kvm_get_vcpu(KVM_BOOT_VCPU));
 }
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include "common.h"
 #include "components/pic.h"
 #include "log.h"
+#include "snapshot.h"
 
 LOG_DEFINE("pit");
 
@@ -79,8 +80,11 @@ void pit_clock_thread(void *arg)
     return NULL;
 }
 
-void pit_init()
+void pit_init(void *opaque)
 {
+    snapshot_register("pit.channels", 1, pit_channels, sizeof(pit_channels), NULL);
+    snapshot_register("pit.read_back", 1, &read_back, sizeof(read_back), NULL);
+
     if (pit_thread == NULL)
     {
         if (pthread_create(&pit_thread, NULL, pit_clock_thread, NULL) != 0)
@@ -95,7 +99,7 @@ void pit_init()
     }
 }
 
-void pit_handle(exit_io_info_t *io, uint8_t *base)
+void pit_handle(void *opaque, exit_io_info_t *io, uint8_t *base)
 {
     // LOG_MSG("Handling pit port: 0x%x, direction: 0x%x, size: 0x%x, count: 0x%x, data: 0x%lx", io->port, io->direction, io->size, io->count, base[io->data_offset]);
     if (io->port >= PIT_CHANNEL_BASE && io->port < (PIT_CHANNEL_BASE + PIT_CHANNEL_NUM - 1))
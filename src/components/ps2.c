@@ -3,6 +3,7 @@
 #include "log.h"
 #include "components/pic.h"
 #include <stdbool.h>
+#include "snapshot.h"
 
 LOG_DEFINE("ps2")
 
@@ -58,8 +59,17 @@ static uint8_t ps2_response_queue[PS2_RESPONSE_QUEUE_SIZE];
 static int ps2_response_queue_head = 0;
 static int ps2_response_queue_tail = 0;
 
-void ps2_init()
+void ps2_init(void *opaque)
 {
+    snapshot_register("ps2.status", 1, &ps2_status, sizeof(ps2_status), NULL);
+    snapshot_register("ps2.config_byte", 1, &ps2_config_byte, sizeof(ps2_config_byte), NULL);
+    snapshot_register("ps2.output_port", 1, &ps2_output_port, sizeof(ps2_output_port), NULL);
+    snapshot_register("ps2.data_expect", 1, &ps2_data_expect, sizeof(ps2_data_expect), NULL);
+    snapshot_register("ps2.response", 1, &ps2_response, sizeof(ps2_response), NULL);
+    snapshot_register("ps2.response_pending", 1, &ps2_response_pending, sizeof(ps2_response_pending), NULL);
+    snapshot_register("ps2.response_queue", 1, ps2_response_queue, sizeof(ps2_response_queue), NULL);
+    snapshot_register("ps2.response_queue_head", 1, &ps2_response_queue_head, sizeof(ps2_response_queue_head), NULL);
+    snapshot_register("ps2.response_queue_tail", 1, &ps2_response_queue_tail, sizeof(ps2_response_queue_tail), NULL);
 }
 
 static void ps2_update_status()
@@ -227,7 +237,7 @@ static void ps2_handle_data(exit_io_info_t *io, uint8_t *base)
     ps2_update_status();
 }
 
-void ps2_handle(exit_io_info_t *io, uint8_t *base)
+void ps2_handle(void *opaque, exit_io_info_t *io, uint8_t *base)
 {
     LOG_MSG("Handling ps2 port: 0x%x, direction: 0x%x, size: 0x%x, count: 0x%x, data: 0x%lx", io->port, io->direction, io->size, io->count, base[io->data_offset]);
     if (io->port == PS2_STATUS_COMMAND_PORT)
@@ -1,11 +1,17 @@
 #include "components/seabios_info.h"
 #include <stdio.h>
 #include <common.h>
+#include "snapshot.h"
 
 static char *sig = "QEMO";
 static int i = 0;
 
-void seabios_info_handle(exit_io_info_t *io, uint8_t *base)
+void seabios_info_init(void *opaque)
+{
+    snapshot_register("seabios_info.index", 1, &i, sizeof(i), NULL);
+}
+
+void seabios_info_handle(void *opaque, exit_io_info_t *io, uint8_t *base)
 {
     if (io->port == 0x510)
     {
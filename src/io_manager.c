@@ -1,34 +1,293 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <err.h>
+#include <time.h>
 #include "io_manager.h"
+#include "common.h"
+#include "kvm.h"
+#include "stats.h"
 
-#define MAX_PORT 0xFFF
+/*
+A handler for every port and access width, so dispatching an exit is one indexed load and an indirect call.
+Ports nobody registered go to io_manager_unregistered instead of being checked for.
+*/
+typedef struct
+{
+    io_handle_t handle[IO_WIDTHS];
+    void *opaque;
+    bool batched;
+} io_port_t;
+
+static io_port_t ports[IO_PORT_COUNT];
+static bool ports_ready = false;
+
+// device models aren't thread safe, so exits from different vcpus are serialized here
+static pthread_mutex_t io_manager_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void io_manager_unregistered(void *opaque, exit_io_info_t *io, uint8_t *base)
+{
+    printf("Port 0x%x is not registered\n", io->port);
+    exit(1);
+}
+
+static void io_manager_prepare_ports()
+{
+    if (ports_ready)
+    {
+        return;
+    }
+    for (int i = 0; i < IO_PORT_COUNT; i++)
+    {
+        for (int width = 0; width < IO_WIDTHS; width++)
+        {
+            ports[i].handle[width] = io_manager_unregistered;
+        }
+    }
+    ports_ready = true;
+}
 
-static io_handle_t ios[MAX_PORT] = {0};
+static bool io_manager_is_registered(uint32_t port)
+{
+    return ports_ready && ports[port].handle[0] != io_manager_unregistered;
+}
 
-void io_manager_register(io_init_t init, io_handle_t handle, uint32_t start_port, uint32_t end_port)
+void io_manager_register(io_init_t init, io_handle_t handle, void *opaque, uint32_t start_port, uint32_t end_port)
 {
+    io_manager_prepare_ports();
+    if (end_port >= IO_PORT_COUNT || start_port > end_port)
+    {
+        errx(1, "Invalid port range 0x%x-0x%x", start_port, end_port);
+    }
     if (init != NULL)
     {
-        init();
+        init(opaque);
+    }
+    for (uint32_t i = start_port; i <= end_port; i++)
+    {
+        if (io_manager_is_registered(i))
+        {
+            printf("Port 0x%x is already registered\n", i);
+            exit(1);
+        }
+        for (int width = 0; width < IO_WIDTHS; width++)
+        {
+            ports[i].handle[width] = handle;
+        }
+        ports[i].opaque = opaque;
+    }
+}
+
+// A faster path for one access width (1, 2 or 4) of ports that are registered already, e.g. 16 bit data ports
+void io_manager_register_width(io_handle_t handle, void *opaque, uint32_t start_port, uint32_t end_port, uint8_t size)
+{
+    if (size != 1 && size != 2 && size != 4)
+    {
+        errx(1, "Invalid access width %d", size);
+    }
+    for (uint32_t i = start_port; i <= end_port; i++)
+    {
+        if (i >= IO_PORT_COUNT || !io_manager_is_registered(i) || ports[i].opaque != opaque)
+        {
+            errx(1, "Port 0x%x needs its device registered before a width handler", i);
+        }
+        ports[i].handle[IO_WIDTH_INDEX(size)] = handle;
+    }
+}
+
+// The handlers of these ports take a whole rep ins/outs in one call, e.g. a sector through a data port
+void io_manager_register_batched(uint32_t start_port, uint32_t end_port)
+{
+    for (uint32_t i = start_port; i <= end_port; i++)
+    {
+        if (i >= IO_PORT_COUNT || !io_manager_is_registered(i))
+        {
+            errx(1, "Port 0x%x must be registered before it's batched", i);
+        }
+        ports[i].batched = true;
+    }
+}
+
+// The ports of a PCI IO BAR, which the guest places (and moves) wherever it likes at runtime. Unlike
+// io_manager_register a clash isn't fatal, the BAR is just left unmapped. Called with the io_manager lock held.
+bool io_manager_map(io_handle_t handle, void *opaque, uint32_t start_port, uint32_t size)
+{
+    io_manager_prepare_ports();
+    if (size == 0 || start_port + size > IO_PORT_COUNT)
+    {
+        return false;
+    }
+    for (uint32_t i = start_port; i < start_port + size; i++)
+    {
+        if (io_manager_is_registered(i))
+        {
+            printf("Port 0x%x is already registered, not mapping 0x%x-0x%x\n", i, start_port, start_port + size - 1);
+            return false;
+        }
+    }
+    for (uint32_t i = start_port; i < start_port + size; i++)
+    {
+        for (int width = 0; width < IO_WIDTHS; width++)
+        {
+            ports[i].handle[width] = handle;
+        }
+        ports[i].opaque = opaque;
+    }
+    return true;
+}
+
+void io_manager_unmap(uint32_t start_port, uint32_t size)
+{
+    for (uint32_t i = start_port; i < start_port + size && i < IO_PORT_COUNT; i++)
+    {
+        for (int width = 0; width < IO_WIDTHS; width++)
+        {
+            ports[i].handle[width] = io_manager_unregistered;
+        }
+        ports[i].opaque = NULL;
+        ports[i].batched = false;
+    }
+}
+
+void io_manager_register_devices(const io_device_t *devices, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        io_manager_register(devices[i].init, devices[i].handle, devices[i].opaque, devices[i].start_port, devices[i].end_port);
+        if (devices[i].batched)
+        {
+            io_manager_register_batched(devices[i].start_port, devices[i].end_port);
+        }
+    }
+}
+
+void io_manager_handle(exit_io_info_t *io, uint8_t *base)
+{
+    // PCI IO BARs move around under the lock, so the handler is only looked up once it's held
+    pthread_mutex_lock(&io_manager_mutex);
+    io_port_t *port = &ports[io->port];
+    io_handle_t handle = port->handle[IO_WIDTH_INDEX(io->size)];
+    uint64_t start = stats_now();
+    if (io->count == 1 || port->batched)
+    {
+        handle(port->opaque, io, base);
     }
-    for (int i = start_port; i <= end_port; i++)
+    else
     {
-        if (ios[i] != 0)
+        // still one exit for the whole string, the device just sees it as separate accesses
+        exit_io_info_t element = *io;
+        element.count = 1;
+        for (uint32_t i = 0; i < io->count; i++)
         {
-            printf("Port 0x%d is already registered\n", i);
+            handle(port->opaque, &element, base);
+            element.data_offset += io->size;
+        }
+    }
+    stats_record_handler((void *)handle, start);
+    pthread_mutex_unlock(&io_manager_mutex);
+}
+
+// Keeps every device handler out, e.g. while their state is saved
+void io_manager_lock()
+{
+    pthread_mutex_lock(&io_manager_mutex);
+}
+
+void io_manager_unlock()
+{
+    pthread_mutex_unlock(&io_manager_mutex);
+}
+
+static struct kvm_coalesced_mmio_ring *coalesced_ring = NULL;
+static pthread_t io_coalesced_thread;
+static bool io_coalesced_thread_started = false;
+static bool io_coalesced_stop = false;
+
+// Hands every write queued in the coalesced ring to its handler, oldest first
+void io_manager_drain_coalesced()
+{
+    struct kvm_coalesced_mmio_ring *ring = __atomic_load_n(&coalesced_ring, __ATOMIC_ACQUIRE);
+    if (ring == NULL || __atomic_load_n(&ring->first, __ATOMIC_RELAXED) == __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&io_manager_mutex);
+    uint32_t first = ring->first;
+    while (first != __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE))
+    {
+        struct kvm_coalesced_mmio *entry = &ring->coalesced_mmio[first];
+        exit_io_info_t io = {
+            .direction = EXIT_IO_OUT,
+            .size = entry->len,
+            .port = entry->phys_addr,
+            .count = 1,
+            .data_offset = 0};
+        io_port_t *port = &ports[io.port];
+        port->handle[IO_WIDTH_INDEX(io.size)](port->opaque, &io, entry->data);
+
+        first = (first + 1) % KVM_COALESCED_MMIO_MAX;
+        __atomic_store_n(&ring->first, first, __ATOMIC_RELEASE); // hands the slot back to the kernel
+    }
+    pthread_mutex_unlock(&io_manager_mutex);
+}
+
+// Catches up with guests that write a lot without ever exiting, and pushes the output of the
+// coalesced devices to their files since they no longer flush on every byte.
+// Runs even when the kernel can't coalesce, the devices rely on it for flushing either way.
+static void *io_manager_coalesced_thread(void *arg)
+{
+#define IO_COALESCED_DRAIN_INTERVAL_NS (10 * 1000 * 1000)
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = IO_COALESCED_DRAIN_INTERVAL_NS};
+    while (!__atomic_load_n(&io_coalesced_stop, __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&interval, NULL);
+        io_manager_drain_coalesced();
+        fflush(NULL);
+    }
+    return NULL;
+}
+
+// Writes to the ports are batched in the kernel and handed to the already registered handler later.
+// Only for write-only output ports whose writes have no side effect the guest could observe right away.
+void io_manager_register_coalesced(uint32_t start_port, uint32_t end_port)
+{
+    for (uint32_t i = start_port; i <= end_port; i++)
+    {
+        if (!io_manager_is_registered(i))
+        {
+            printf("Port 0x%x must be registered before it's coalesced\n", i);
             exit(1);
         }
-        ios[i] = handle;
+    }
+
+    if (!io_coalesced_thread_started)
+    {
+        if (pthread_create(&io_coalesced_thread, NULL, io_manager_coalesced_thread, NULL) != 0)
+        {
+            errx(1, "Failed to create the coalesced io thread");
+        }
+        io_coalesced_thread_started = true;
+    }
+
+    if (kvm_register_coalesced_pio(start_port, end_port - start_port + 1) && coalesced_ring == NULL)
+    {
+        __atomic_store_n(&coalesced_ring, kvm_get_coalesced_ring(), __ATOMIC_RELEASE);
     }
 }
 
-void io_manager_handle(exit_io_info_t *io, uint8_t* base)
+// The vcpus must have stopped, the ring lives in the kvm_run area kvm_deinit unmaps
+void io_manager_deinit()
 {
-    if (ios[io->port] == 0)
+    if (io_coalesced_thread_started)
     {
-        printf("Port 0x%x is not registered\n", io->port);
-        exit(1);
+        __atomic_store_n(&io_coalesced_stop, true, __ATOMIC_RELEASE);
+        pthread_join(io_coalesced_thread, NULL);
+        io_coalesced_thread_started = false;
     }
-    ios[io->port](io, base);
+    io_manager_drain_coalesced();
+    coalesced_ring = NULL;
+    fflush(NULL);
 }
\ No newline at end of file
@@ -7,11 +7,42 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 #include "gui.h"
+#include "common.h"
 #include "io_manager.h"
+#include "mmio_manager.h"
+#include "stats.h"
+#include "memory.h"
+#include "components/pic.h"
 
-int kvm, vm, vcpu;
-struct kvm_run *run;
+int kvm, vm;
+static kvm_vcpu_t vcpus[KVM_MAX_VCPUS];
+static int vcpu_count = 0;
+static __thread kvm_vcpu_t *current_vcpu = NULL;
+
+static pthread_mutex_t kvm_stop_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kvm_stop_cond = PTHREAD_COND_INITIALIZER;
+static bool kvm_stopped = false; // set once, every vcpu leaves its run loop when it sees it
+
+static pthread_mutex_t kvm_pause_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t kvm_pause_cond = PTHREAD_COND_INITIALIZER;
+static bool kvm_pause_requested = false;
+static int kvm_paused_count = 0;
+
+static kvm_irqchip_mode_t irqchip_mode = KVM_IRQCHIP_USERSPACE;
+static bool has_immediate_exit = false;
+static bool has_sync_regs = false;
+
+#define KVM_KICK_SIGNAL SIGRTMIN
+
+static bool kvm_has_lapic()
+{
+    return irqchip_mode != KVM_IRQCHIP_USERSPACE;
+}
 
 #pragma region KVM
 
@@ -45,19 +76,148 @@ void kvm_create_vm()
     }
 }
 
+void kvm_verify_vcpu_count(int count)
+{
+    int max_vcpus = ioctl(kvm, KVM_CHECK_EXTENSION, KVM_CAP_MAX_VCPUS);
+    if (max_vcpus <= 0)
+    {
+        max_vcpus = ioctl(kvm, KVM_CHECK_EXTENSION, KVM_CAP_NR_VCPUS);
+    }
+    if (max_vcpus <= 0)
+    {
+        max_vcpus = 4; // documented default when neither capability is reported
+    }
+
+    if (count < 1 || count > KVM_MAX_VCPUS || count > max_vcpus)
+    {
+        errx(1, "Invalid vcpu count %d (max %d)", count, max_vcpus < KVM_MAX_VCPUS ? max_vcpus : KVM_MAX_VCPUS);
+    }
+}
+
 #pragma endregion
 
 #pragma region VM
 
-void kvm_create_vcpu()
+// The local apics have to live in the kernel for the APs to be woken by INIT/SIPI.
+// The PIC and IOAPIC stay in userspace so the PIC keeps injecting through KVM_INTERRUPT.
+void kvm_create_split_irqchip()
+{
+    struct kvm_enable_cap cap = {
+        .cap = KVM_CAP_SPLIT_IRQCHIP,
+        .args[0] = 24}; // number of IOAPIC pins reserved in the routing table
+    if (ioctl(vm, KVM_ENABLE_CAP, &cap) < 0)
+    {
+        err(1, "KVM_CAP_SPLIT_IRQCHIP");
+    }
+}
+
+// Same wiring as a PC: isa irqs 0-15 go to the PIC pair, and the IOAPIC gets them 1:1 except
+// for the timer which is overridden from irq 0 to pin 2 (the cascade pin on the PIC side)
+void kvm_set_gsi_routing()
+{
+#define KVM_IOAPIC_PINS 24
+#define KVM_PIC_PINS 16
+    struct kvm_irq_routing *routing = calloc(1, sizeof(*routing) + (KVM_IOAPIC_PINS + KVM_PIC_PINS) * sizeof(struct kvm_irq_routing_entry));
+    if (routing == NULL)
+    {
+        err(1, "Failed to allocate irq routing");
+    }
+
+    for (int i = 0; i < KVM_PIC_PINS; i++)
+    {
+        if (i == 2)
+        {
+            continue;
+        }
+        struct kvm_irq_routing_entry *entry = &routing->entries[routing->nr++];
+        entry->gsi = i;
+        entry->type = KVM_IRQ_ROUTING_IRQCHIP;
+        entry->u.irqchip.irqchip = i < 8 ? KVM_IRQCHIP_PIC_MASTER : KVM_IRQCHIP_PIC_SLAVE;
+        entry->u.irqchip.pin = i % 8;
+    }
+
+    for (int i = 0; i < KVM_IOAPIC_PINS; i++)
+    {
+        if (i == 2)
+        {
+            continue;
+        }
+        struct kvm_irq_routing_entry *entry = &routing->entries[routing->nr++];
+        entry->gsi = i;
+        entry->type = KVM_IRQ_ROUTING_IRQCHIP;
+        entry->u.irqchip.irqchip = KVM_IRQCHIP_IOAPIC;
+        entry->u.irqchip.pin = i == 0 ? 2 : i;
+    }
+
+    if (ioctl(vm, KVM_SET_GSI_ROUTING, routing) < 0)
+    {
+        err(1, "KVM_SET_GSI_ROUTING");
+    }
+    free(routing);
+}
+
+// PIC, IOAPIC and local apics all in the kernel. Devices only drive the irq lines.
+void kvm_create_irqchip()
+{
+    if (ioctl(vm, KVM_CREATE_IRQCHIP, 0) < 0)
+    {
+        err(1, "KVM_CREATE_IRQCHIP");
+    }
+    kvm_set_gsi_routing();
+}
+
+void kvm_create_vcpu(kvm_vcpu_t *vcpu, int id)
 {
-    vcpu = ioctl(vm, KVM_CREATE_VCPU, 0);
-    if (vcpu < 0)
+    vcpu->id = id;
+    vcpu->fd = ioctl(vm, KVM_CREATE_VCPU, id);
+    if (vcpu->fd < 0)
     {
         err(1, "KVM_CREATE_VCPU");
     }
 }
 
+void kvm_set_cpuid(kvm_vcpu_t *vcpu)
+{
+#define KVM_CPUID_MAX_ENTRIES 100
+    struct kvm_cpuid2 *cpuid = calloc(1, sizeof(*cpuid) + KVM_CPUID_MAX_ENTRIES * sizeof(struct kvm_cpuid_entry2));
+    if (cpuid == NULL)
+    {
+        err(1, "Failed to allocate cpuid");
+    }
+    cpuid->nent = KVM_CPUID_MAX_ENTRIES;
+    if (ioctl(kvm, KVM_GET_SUPPORTED_CPUID, cpuid) < 0)
+    {
+        err(1, "KVM_GET_SUPPORTED_CPUID");
+    }
+
+    for (int i = 0; i < cpuid->nent; i++)
+    {
+        struct kvm_cpuid_entry2 *entry = &cpuid->entries[i];
+        switch (entry->function)
+        {
+        case 1:
+            // initial apic id and the number of logical processors
+            entry->ebx = (entry->ebx & 0x0000FFFF) | (vcpu_count << 16) | (vcpu->id << 24);
+            break;
+        case 0xb:
+        case 0x1f:
+            entry->edx = vcpu->id; // x2apic id
+            break;
+        }
+    }
+
+    if (ioctl(vcpu->fd, KVM_SET_CPUID2, cpuid) < 0)
+    {
+        err(1, "KVM_SET_CPUID2");
+    }
+    free(cpuid);
+}
+
+int kvm_check_extension(int capability)
+{
+    return ioctl(vm, KVM_CHECK_EXTENSION, capability);
+}
+
 void kvm_set_userspace_memory_region(struct kvm_userspace_memory_region *memory_region)
 {
     if (ioctl(vm, KVM_SET_USER_MEMORY_REGION, memory_region) < 0)
@@ -66,11 +226,56 @@ void kvm_set_userspace_memory_region(struct kvm_userspace_memory_region *memory_
     }
 }
 
+// Writes to the range are queued in the shared coalesced ring instead of exiting.
+// Returns false if the kernel can't coalesce port io, the writes then keep exiting as usual.
+bool kvm_register_coalesced_pio(uint64_t port, uint32_t size)
+{
+    if (ioctl(kvm, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_PIO) <= 0)
+    {
+        return false;
+    }
+
+    struct kvm_coalesced_mmio_zone zone = {.addr = port, .size = size, .pio = 1};
+    if (ioctl(vm, KVM_REGISTER_COALESCED_MMIO, &zone) < 0)
+    {
+        err(1, "KVM_REGISTER_COALESCED_MMIO");
+    }
+    return true;
+}
+
+// The ring is per vm, it's just mapped through every vcpu fd
+struct kvm_coalesced_mmio_ring *kvm_get_coalesced_ring()
+{
+    int page_offset = ioctl(kvm, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
+    if (page_offset <= 0 || vcpu_count == 0)
+    {
+        return NULL;
+    }
+    return (struct kvm_coalesced_mmio_ring *)((uint8_t *)vcpus[KVM_BOOT_VCPU].run + page_offset * PAGE_SIZE);
+}
+
+// Returns an eventfd that pulses the gsi when written to. Needs the in-kernel irqchip.
+int kvm_create_irqfd(uint32_t gsi)
+{
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0)
+    {
+        err(1, "Failed to create irqfd");
+    }
+
+    struct kvm_irqfd irqfd = {.fd = fd, .gsi = gsi};
+    if (ioctl(vm, KVM_IRQFD, &irqfd) < 0)
+    {
+        err(1, "KVM_IRQFD");
+    }
+    return fd;
+}
+
 #pragma endregion
 
 #pragma region VCPU
 
-struct kvm_run *kvm_map_run()
+struct kvm_run *kvm_map_run(kvm_vcpu_t *vcpu)
 {
     int ret = ioctl(kvm, KVM_GET_VCPU_MMAP_SIZE, 0);
     if (ret < 0)
@@ -78,17 +283,116 @@ struct kvm_run *kvm_map_run()
         err(1, "KVM_GET_VCPU_MMAP_SIZE");
     }
 
-    struct kvm_run *run = mmap(NULL, ret, PROT_READ | PROT_WRITE, MAP_SHARED, vcpu, 0);
+    struct kvm_run *run = mmap(NULL, ret, PROT_READ | PROT_WRITE, MAP_SHARED, vcpu->fd, 0);
     if (run == MAP_FAILED)
     {
         err(1, "Failed to map run");
     }
+    vcpu->run_size = ret;
     return run;
 }
 
+kvm_vcpu_t *kvm_get_vcpu(int id)
+{
+    if (id < 0 || id >= vcpu_count)
+    {
+        return NULL;
+    }
+    return &vcpus[id];
+}
+
+// The vcpu owned by the calling thread. Device threads fall back to the boot vcpu.
+kvm_vcpu_t *kvm_current_vcpu()
+{
+    if (current_vcpu != NULL)
+    {
+        return current_vcpu;
+    }
+    return kvm_get_vcpu(KVM_BOOT_VCPU);
+}
+
+bool kvm_is_vcpu_thread()
+{
+    return current_vcpu != NULL;
+}
+
+int kvm_get_vm_fd()
+{
+    return vm;
+}
+
+int kvm_get_vcpu_count()
+{
+    return vcpu_count;
+}
+
+// With KVM_CAP_SYNC_REGS the kernel copies the gprs into kvm_run on every exit, otherwise they are fetched once per exit
+static struct kvm_regs *kvm_vcpu_regs(kvm_vcpu_t *vcpu)
+{
+    if (has_sync_regs)
+    {
+        return &vcpu->run->s.regs.regs;
+    }
+    if (!vcpu->regs_valid)
+    {
+        if (ioctl(vcpu->fd, KVM_GET_REGS, &vcpu->regs) < 0)
+        {
+            err(1, "KVM_GET_REGS");
+        }
+        vcpu->regs_valid = true;
+    }
+    return &vcpu->regs;
+}
+
+static struct kvm_sregs *kvm_vcpu_sregs(kvm_vcpu_t *vcpu)
+{
+    if (!vcpu->sregs_valid)
+    {
+        if (ioctl(vcpu->fd, KVM_GET_SREGS, &vcpu->sregs) < 0)
+        {
+            err(1, "KVM_GET_SREGS");
+        }
+        vcpu->sregs_valid = true;
+    }
+    return &vcpu->sregs;
+}
+
+// Writes back whatever was changed during the last exit, right before reentering the guest
+static void kvm_vcpu_flush_regs(kvm_vcpu_t *vcpu)
+{
+    if (vcpu->regs_dirty)
+    {
+        if (ioctl(vcpu->fd, KVM_SET_REGS, &vcpu->regs) < 0)
+        {
+            err(1, "KVM_SET_REGS");
+        }
+        vcpu->regs_dirty = false;
+    }
+    if (vcpu->sregs_dirty)
+    {
+        if (ioctl(vcpu->fd, KVM_SET_SREGS, &vcpu->sregs) < 0)
+        {
+            err(1, "KVM_SET_SREGS");
+        }
+        vcpu->sregs_dirty = false;
+    }
+}
+
+static void kvm_vcpu_invalidate_regs(kvm_vcpu_t *vcpu)
+{
+    vcpu->regs_valid = false;
+    vcpu->sregs_valid = false;
+}
+
+// The cache belongs to the vcpu thread. Anyone else (e.g. kvm_init) goes straight to the boot vcpu.
 void kvm_get_regs(struct kvm_regs *regs)
 {
-    if (ioctl(vcpu, KVM_GET_REGS, regs) < 0)
+    if (current_vcpu != NULL)
+    {
+        *regs = *kvm_vcpu_regs(current_vcpu);
+        return;
+    }
+    if (ioctl(kvm_current_vcpu()->fd, KVM_GET_REGS, regs) < 0)
     {
         err(1, "KVM_GET_REGS");
     }
@@ -96,15 +400,33 @@ void kvm_get_regs(struct kvm_regs *regs)
 
 void kvm_set_regs(struct kvm_regs *regs)
 {
-    if (ioctl(vcpu, KVM_SET_REGS, regs) < 0)
+    if (current_vcpu != NULL)
     {
-        err(1, "KVM_GET_REGS");
+        *kvm_vcpu_regs(current_vcpu) = *regs;
+        if (has_sync_regs)
+        {
+            current_vcpu->run->kvm_dirty_regs |= KVM_SYNC_X86_REGS;
+        }
+        else
+        {
+            current_vcpu->regs_dirty = true;
+        }
+        return;
+    }
+    if (ioctl(kvm_current_vcpu()->fd, KVM_SET_REGS, regs) < 0)
+    {
+        err(1, "KVM_SET_REGS");
     }
 }
 
 void kvm_get_sregs(struct kvm_sregs *sregs)
 {
-    if (ioctl(vcpu, KVM_GET_SREGS, sregs) == -1)
+    if (current_vcpu != NULL)
+    {
+        *sregs = *kvm_vcpu_sregs(current_vcpu);
+        return;
+    }
+    if (ioctl(kvm_current_vcpu()->fd, KVM_GET_SREGS, sregs) == -1)
     {
         err(1, "KVM_GET_SREGS");
     }
@@ -112,7 +434,13 @@ void kvm_get_sregs(struct kvm_sregs *sregs)
 
 void kvm_set_sregs(struct kvm_sregs *sregs)
 {
-    if (ioctl(vcpu, KVM_SET_SREGS, sregs) < 0)
+    if (current_vcpu != NULL)
+    {
+        *kvm_vcpu_sregs(current_vcpu) = *sregs;
+        current_vcpu->sregs_dirty = true;
+        return;
+    }
+    if (ioctl(kvm_current_vcpu()->fd, KVM_SET_SREGS, sregs) < 0)
     {
         err(1, "KVM_SET_SREGS");
     }
@@ -153,50 +481,251 @@ void print_sregs()
     printf("  cr8: 0x%x\n", sregs.cr8);
 }
 
-void kvm_run()
+/*
+A kick has to make the vcpu go through its run loop again even if it lands just before KVM_RUN. With immediate_exit
+the handler arms it and KVM_RUN returns EINTR right away. Without it the signal stays blocked in every thread and
+KVM_SET_SIGNAL_MASK only unblocks it inside KVM_RUN: one that arrived earlier is still pending and makes KVM_RUN
+return EINTR the same way, it is then taken off with sigtimedwait.
+*/
+static void kvm_kick_handler(int sig)
+{
+    if (current_vcpu != NULL && has_immediate_exit)
+    {
+        current_vcpu->run->immediate_exit = 1;
+    }
+}
+
+// Before the vcpu threads are created, so they inherit the blocked signal when it's needed
+void kvm_setup_kick()
+{
+    has_immediate_exit = ioctl(kvm, KVM_CHECK_EXTENSION, KVM_CAP_IMMEDIATE_EXIT) > 0;
+
+    struct sigaction action = {0};
+    action.sa_handler = kvm_kick_handler;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(KVM_KICK_SIGNAL, &action, NULL) < 0)
+    {
+        err(1, "Failed to install the vcpu kick handler");
+    }
+    if (!has_immediate_exit)
+    {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, KVM_KICK_SIGNAL);
+        pthread_sigmask(SIG_BLOCK, &set, NULL);
+    }
+}
+
+// On the vcpu's own thread: its signal mask with the kick unblocked, for the duration of KVM_RUN
+static void kvm_vcpu_setup_kick(kvm_vcpu_t *vcpu)
+{
+    if (has_immediate_exit)
+    {
+        return;
+    }
+    sigset_t set;
+    pthread_sigmask(SIG_BLOCK, NULL, &set);
+    sigdelset(&set, KVM_KICK_SIGNAL);
+    struct
+    {
+        struct kvm_signal_mask header;
+        uint8_t sigset[8]; // the kernel's sigset_t, not glibc's
+    } mask = {.header.len = sizeof(mask.sigset)};
+    memcpy(mask.sigset, &set, sizeof(mask.sigset));
+    if (ioctl(vcpu->fd, KVM_SET_SIGNAL_MASK, &mask) < 0)
+    {
+        err(1, "KVM_SET_SIGNAL_MASK");
+    }
+}
+
+// Takes the kicks that interrupted KVM_RUN off the pending set, otherwise every later KVM_RUN would stop at once
+static void kvm_vcpu_eat_kicks()
+{
+    if (has_immediate_exit)
+    {
+        return;
+    }
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, KVM_KICK_SIGNAL);
+    struct timespec zero = {0};
+    while (sigtimedwait(&set, NULL, &zero) == KVM_KICK_SIGNAL)
+    {
+    }
+}
+
+// Forces the vcpu out of KVM_RUN so it goes through its run loop again
+void kvm_kick_vcpu(kvm_vcpu_t *vcpu)
 {
-    // struct kvm_cpuid_entry cpuid_entry = {
-    //     .function = 1,
-    //     .eax = 0x1,
-    //     .ebx = 0xFFFFFFFF,
-    //     .ecx = 0xFFFFFFFF,
-    //     .edx = 0xFFFFFFFF};
-    // if (ioctl(vcpu, KVM_SET_CPUID, cpuid_entry) < 0)
-    // {
-    //     err(1, "KVM_SET_CPUID");
-    // }
+    if (vcpu == NULL || vcpu == current_vcpu || !__atomic_load_n(&vcpu->started, __ATOMIC_ACQUIRE) || __atomic_load_n(&vcpu->exited, __ATOMIC_ACQUIRE))
+    {
+        return; // it will look at its state before entering the guest anyway
+    }
+    pthread_kill(vcpu->thread, KVM_KICK_SIGNAL);
+}
+
+// The userspace PIC is only ever sampled by the BSP, right before entering the guest.
+// If the guest can't take the interrupt now we ask KVM to exit as soon as it can.
+static void kvm_inject_interrupts(kvm_vcpu_t *vcpu)
+{
+    struct kvm_run *run = vcpu->run;
+    if (!pic_has_interrupt())
+    {
+        run->request_interrupt_window = 0;
+        return;
+    }
+
+    if (run->ready_for_interrupt_injection)
+    {
+        int vector = pic_acknowledge_interrupt();
+        if (vector >= 0)
+        {
+            kvm_interrupt(vector);
+        }
+    }
+    run->request_interrupt_window = pic_has_interrupt();
+}
+
+// Holds the vcpu outside of KVM_RUN until kvm_resume
+static void kvm_vcpu_park(kvm_vcpu_t *vcpu)
+{
+    // an immediate exit still completes the in/mmio read of the last exit and applies kvm_dirty_regs,
+    // so whoever looks at the vcpu while it's parked sees the state after that instruction
+    vcpu->run->immediate_exit = 1;
+    if (ioctl(vcpu->fd, KVM_RUN, 0) < 0 && errno != EINTR && errno != EAGAIN)
+    {
+        err(1, "Failed to complete the last exit");
+    }
+    vcpu->run->immediate_exit = 0;
+    kvm_vcpu_invalidate_regs(vcpu);
+
+    pthread_mutex_lock(&kvm_pause_mutex);
+    kvm_paused_count++;
+    pthread_cond_broadcast(&kvm_pause_cond);
+    while (kvm_pause_requested && !__atomic_load_n(&kvm_stopped, __ATOMIC_ACQUIRE))
+    {
+        pthread_cond_wait(&kvm_pause_cond, &kvm_pause_mutex);
+    }
+    kvm_paused_count--;
+    pthread_mutex_unlock(&kvm_pause_mutex);
+}
+
+// Started and still in their run loop, a vcpu that left it never parks
+static int kvm_running_vcpus()
+{
+    int running = 0;
+    for (int i = 0; i < vcpu_count; i++)
+    {
+        if (__atomic_load_n(&vcpus[i].started, __ATOMIC_ACQUIRE) && !__atomic_load_n(&vcpus[i].exited, __ATOMIC_ACQUIRE))
+        {
+            running++;
+        }
+    }
+    return running;
+}
+
+// Returns once every running vcpu is parked. Must not be called from a vcpu thread.
+void kvm_pause()
+{
+    pthread_mutex_lock(&kvm_pause_mutex);
+    __atomic_store_n(&kvm_pause_requested, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&kvm_pause_mutex);
+
+    for (int i = 0; i < vcpu_count; i++)
+    {
+        kvm_kick_vcpu(&vcpus[i]);
+    }
+
+    // counted again on every wakeup, a vcpu leaving its loop meanwhile wakes us too
+    pthread_mutex_lock(&kvm_pause_mutex);
+    while (kvm_paused_count < kvm_running_vcpus())
+    {
+        pthread_cond_wait(&kvm_pause_cond, &kvm_pause_mutex);
+    }
+    pthread_mutex_unlock(&kvm_pause_mutex);
+}
+
+void kvm_resume()
+{
+    pthread_mutex_lock(&kvm_pause_mutex);
+    __atomic_store_n(&kvm_pause_requested, false, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&kvm_pause_cond);
+    pthread_mutex_unlock(&kvm_pause_mutex);
+}
+
+void kvm_vcpu_run(kvm_vcpu_t *vcpu)
+{
+    struct kvm_run *run = vcpu->run;
+    bool injects = vcpu->id == KVM_BOOT_VCPU && irqchip_mode != KVM_IRQCHIP_KERNEL;
+    kvm_vcpu_setup_kick(vcpu);
     // struct kvm_pit_state2
-    struct kvm_regs regs;
+    if (has_sync_regs)
+    {
+        // s.regs is only filled in by the first exit
+        if (ioctl(vcpu->fd, KVM_GET_REGS, &run->s.regs.regs) < 0)
+        {
+            err(1, "KVM_GET_REGS");
+        }
+        run->kvm_valid_regs = KVM_SYNC_X86_REGS;
+    }
     while (1)
     {
-        if (ioctl(vcpu, KVM_RUN, 0) < 0)
+        // cleared before looking at the PIC so a kick that arrives from now on isn't lost
+        run->immediate_exit = 0;
+        if (__atomic_load_n(&kvm_stopped, __ATOMIC_ACQUIRE))
+        {
+            return;
+        }
+        if (injects)
+        {
+            kvm_inject_interrupts(vcpu);
+        }
+        kvm_vcpu_flush_regs(vcpu);
+        if (__atomic_load_n(&kvm_pause_requested, __ATOMIC_ACQUIRE))
         {
+            kvm_vcpu_park(vcpu);
+            continue;
+        }
+
+        int ret = ioctl(vcpu->fd, KVM_RUN, 0);
+        kvm_vcpu_invalidate_regs(vcpu);
+        if (ret < 0)
+        {
+            // EINTR: kicked. EAGAIN: an AP woken up before its SIPI arrived
+            if (errno == EAGAIN || errno == EINTR)
+            {
+                kvm_vcpu_eat_kicks();
+                continue;
+            }
             err(1, "Failed to run");
         }
         // sleep(3);
 
+        // writes queued before this exit have to reach their devices first
+        io_manager_drain_coalesced();
+
+        stats_count_exit(run->exit_reason);
         switch (run->exit_reason)
         {
         case KVM_EXIT_HLT:
             puts("KVM_EXIT_HLT");
             // return 0;
             break;
+        case KVM_EXIT_IRQ_WINDOW_OPEN:
+            break; // injected at the top of the loop
+        case KVM_EXIT_INTR:
+            break;
         case KVM_EXIT_IO:
-            if (run->io.direction == KVM_EXIT_IO_OUT)
-            {
-                kvm_get_regs(&regs);
-                printf("0x%llx: ", regs.rip);
-                printf("KVM_EXIT_IO: direction = 0x%x, size = 0x%x, port = 0x%x, count = 0x%x, data = 0x%x\n", run->io.direction, run->io.size, run->io.port, run->io.count, ((uint8_t *)run)[run->io.data_offset]);
-            }
-            io_manager_handle(&run->io, (uint8_t *)run);
-            if (run->io.direction == KVM_EXIT_IO_IN)
-            {
-                kvm_get_regs(&regs);
-                printf("0x%llx: ", regs.rip);
-                printf("KVM_EXIT_IO: direction = 0x%x, size = 0x%x, port = 0x%x, count = 0x%x, data = 0x%x\n", run->io.direction, run->io.size, run->io.port, run->io.count, ((uint8_t *)run)[run->io.data_offset]);
-            }
+            stats_count_port(run->io.port);
+            io_manager_handle((exit_io_info_t *)&run->io, (uint8_t *)run);
             break;
         case KVM_EXIT_MMIO:
+            stats_count_mmio(run->mmio.phys_addr);
+            if (memory_handle_mmio(run->mmio.phys_addr, run->mmio.data, run->mmio.len, run->mmio.is_write) ||
+                mmio_manager_handle(run->mmio.phys_addr, run->mmio.data, run->mmio.len, run->mmio.is_write))
+            {
+                break;
+            }
             printf("KVM_EXIT_MMIO: is_write=%d len=%d phys_addr=0x%llx data=",
                    run->mmio.is_write, run->mmio.len, run->mmio.phys_addr);
             if (run->mmio.is_write == 1)
@@ -208,24 +737,7 @@ void kvm_run()
                 }
                 printf("\n");
             }
-            if (run->mmio.phys_addr == 0xfebff000) // vga bar
-            {
-                run->mmio.data[0] = 0x80;
-                run->mmio.data[1] = 0x0b;
-                break;
-            }
-            if (run->mmio.phys_addr != 0xfee00030 && run->mmio.phys_addr != 0xfebf1000 && run->mmio.phys_addr != 0xfebf8000)
-            {
-                return;
-            }
-            else
-            {
-                // run->mmio.data[0] = 0x10;
-                // run->mmio.data[1] = 0x10;
-                // run->mmio.data[2] = 0x10;
-                // run->mmio.data[3] = 0x10;
-            }
-            break;
+            return;
         case KVM_EXIT_FAIL_ENTRY:
             kvm_print_regs();
             print_sregs();
@@ -239,7 +751,7 @@ void kvm_run()
             {
                 printf("data[%d] = 0x%llx\n", i, run->internal.data[i]);
             }
-            return 1;
+            return;
         default:
             errx(1, "exit_reason = 0x%x", run->exit_reason);
         }
@@ -248,63 +760,97 @@ void kvm_run()
     }
 }
 
+void *kvm_vcpu_thread(void *arg)
+{
+    kvm_vcpu_t *vcpu = (kvm_vcpu_t *)arg;
+    current_vcpu = vcpu;
+
+    kvm_vcpu_run(vcpu);
+
+    pthread_mutex_lock(&kvm_pause_mutex);
+    __atomic_store_n(&vcpu->exited, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&kvm_pause_cond);
+    pthread_mutex_unlock(&kvm_pause_mutex);
+
+    // a vcpu leaving its run loop stops the whole machine
+    pthread_mutex_lock(&kvm_stop_mutex);
+    __atomic_store_n(&kvm_stopped, true, __ATOMIC_RELEASE);
+    pthread_cond_signal(&kvm_stop_cond);
+    pthread_mutex_unlock(&kvm_stop_mutex);
+    return NULL;
+}
+
+void kvm_run()
+{
+    for (int i = 0; i < vcpu_count; i++)
+    {
+        if (pthread_create(&vcpus[i].thread, NULL, kvm_vcpu_thread, &vcpus[i]) != 0)
+        {
+            errx(1, "Failed to create vcpu %d thread", i);
+        }
+        __atomic_store_n(&vcpus[i].started, true, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_lock(&kvm_stop_mutex);
+    while (!kvm_stopped)
+    {
+        pthread_cond_wait(&kvm_stop_cond, &kvm_stop_mutex);
+    }
+    pthread_mutex_unlock(&kvm_stop_mutex);
+
+    // the others are still using their kvm_run areas, kvm_deinit may only unmap them once they are all gone
+    pthread_mutex_lock(&kvm_pause_mutex);
+    pthread_cond_broadcast(&kvm_pause_cond); // parked ones
+    pthread_mutex_unlock(&kvm_pause_mutex);
+    for (int i = 0; i < vcpu_count; i++)
+    {
+        kvm_kick_vcpu(&vcpus[i]);
+    }
+    for (int i = 0; i < vcpu_count; i++)
+    {
+        pthread_join(vcpus[i].thread, NULL);
+    }
+}
+
 #pragma endregion
 
-void kvm_init(char *file_name)
+void kvm_init(char *file_name, int count, bool kernel_irqchip)
 {
     kvm_open();
     kvm_verify_version();
+    kvm_verify_vcpu_count(count);
 
     kvm_create_vm();
+    kvm_setup_kick();
+    int sync_regs = ioctl(kvm, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+    has_sync_regs = sync_regs > 0 && (sync_regs & KVM_SYNC_X86_REGS);
+    vcpu_count = count;
+    if (kernel_irqchip)
+    {
+        irqchip_mode = KVM_IRQCHIP_KERNEL;
+        kvm_create_irqchip();
+    }
+    else if (vcpu_count > 1)
+    {
+        irqchip_mode = KVM_IRQCHIP_SPLIT;
+        kvm_create_split_irqchip();
+    }
+
+    memory_map();
+    memory_map_bios(file_name);
 
-    uint8_t *buf;
-    size_t size;
-    read_file(file_name, &buf, &size);
-
-    // Leave 0xA0000-0xBFFFF for vga
-    uint8_t *guest_memory_high = mmap(0xC0000, 0x100000, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (guest_memory_high == MAP_FAILED)
-        err(1, "Failed to map guest memory");
-    memcpy(guest_memory_high + 0x100000 - 0xC0000 - size, buf, size);
-
-    struct kvm_userspace_memory_region memory_region_high = {
-        .slot = 0,
-        .guest_phys_addr = 0xC0000,
-        .memory_size = 0x100000,
-        .userspace_addr = (uint64_t)guest_memory_high,
-        .flags = 0};
-    kvm_set_userspace_memory_region(&memory_region_high);
-
-    uint8_t *guest_memory_low = mmap(0, 0xA0000, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (guest_memory_low == MAP_FAILED)
-        err(1, "Failed to map guest memory");
-    memset(guest_memory_low, 0, 0xA0000);
-
-    struct kvm_userspace_memory_region memory_region_low = {
-        .slot = 1,
-        .guest_phys_addr = 0,
-        .memory_size = 0xA0000,
-        .userspace_addr = (uint64_t)guest_memory_low,
-        .flags = 0};
-    kvm_set_userspace_memory_region(&memory_region_low);
-
-    uint8_t *bios_high = mmap(0xfff00000, 0x100000, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (bios_high == MAP_FAILED)
-        err(1, "Failed to map guest memory");
-    memcpy(bios_high + 0x100000 - size, buf, size);
-
-    struct kvm_userspace_memory_region bios_region = {
-        .slot = 2,
-        .guest_phys_addr = 0xfff00000,
-        .memory_size = 0x100000,
-        .userspace_addr = (uint64_t)bios_high,
-        .flags = 0};
-    kvm_set_userspace_memory_region(&bios_region);
-
-    free(buf);
-
-    kvm_create_vcpu();
-    run = kvm_map_run();
+    for (int i = 0; i < vcpu_count; i++)
+    {
+        kvm_create_vcpu(&vcpus[i], i);
+        vcpus[i].run = kvm_map_run(&vcpus[i]);
+        if (kvm_has_lapic())
+        {
+            // guests without a lapic keep the empty default cpuid, seabios then skips the apic entirely
+            kvm_set_cpuid(&vcpus[i]);
+        }
+    }
+
+    // the APs are held in wait-for-SIPI by the kernel lapic, only the BSP starts at the reset vector
 
     struct kvm_sregs sregs;
     kvm_get_sregs(&sregs);
@@ -330,45 +876,240 @@ void kvm_init(char *file_name)
     kvm_set_regs(&regs);
 }
 
+#pragma region STATE
+
+static struct kvm_msr_list *kvm_msr_list = NULL;
+
+// The msrs kvm knows how to save and restore, queried once
+static struct kvm_msr_list *kvm_get_msr_list()
+{
+    if (kvm_msr_list != NULL)
+    {
+        return kvm_msr_list;
+    }
+
+    struct kvm_msr_list probe = {.nmsrs = 0};
+    if (ioctl(kvm, KVM_GET_MSR_INDEX_LIST, &probe) < 0 && errno != E2BIG)
+    {
+        err(1, "KVM_GET_MSR_INDEX_LIST");
+    }
+    kvm_msr_list = malloc(sizeof(struct kvm_msr_list) + probe.nmsrs * sizeof(uint32_t));
+    if (kvm_msr_list == NULL)
+    {
+        err(1, "Failed to allocate the msr list");
+    }
+    kvm_msr_list->nmsrs = probe.nmsrs;
+    if (ioctl(kvm, KVM_GET_MSR_INDEX_LIST, kvm_msr_list) < 0)
+    {
+        err(1, "KVM_GET_MSR_INDEX_LIST");
+    }
+    return kvm_msr_list;
+}
+
+static void kvm_save_msrs(kvm_vcpu_t *vcpu, kvm_vcpu_state_t *state)
+{
+    struct kvm_msr_list *list = kvm_get_msr_list();
+    struct
+    {
+        struct kvm_msrs header;
+        struct kvm_msr_entry entries[KVM_MAX_SAVED_MSRS];
+    } msrs;
+
+    // KVM_GET_MSRS stops at the first msr this cpu doesn't have, skip it and go on from there
+    state->msr_count = 0;
+    uint32_t next = 0;
+    while (next < list->nmsrs && state->msr_count < KVM_MAX_SAVED_MSRS)
+    {
+        uint32_t count = 0;
+        for (; next + count < list->nmsrs && state->msr_count + count < KVM_MAX_SAVED_MSRS; count++)
+        {
+            msrs.entries[count] = (struct kvm_msr_entry){.index = list->indices[next + count]};
+        }
+        msrs.header.nmsrs = count;
+        int read = ioctl(vcpu->fd, KVM_GET_MSRS, &msrs);
+        if (read < 0)
+        {
+            err(1, "KVM_GET_MSRS");
+        }
+        memcpy(&state->msrs[state->msr_count], msrs.entries, read * sizeof(struct kvm_msr_entry));
+        state->msr_count += read;
+        next += read < count ? read + 1 : read;
+    }
+}
+
+// Only valid while the vcpu isn't running: paused, or not started yet
+void kvm_save_vcpu(kvm_vcpu_t *vcpu, kvm_vcpu_state_t *state)
+{
+    memset(state, 0, sizeof(*state));
+    if (ioctl(vcpu->fd, KVM_GET_REGS, &state->regs) < 0)
+        err(1, "KVM_GET_REGS");
+    if (ioctl(vcpu->fd, KVM_GET_SREGS, &state->sregs) < 0)
+        err(1, "KVM_GET_SREGS");
+    if (ioctl(vcpu->fd, KVM_GET_FPU, &state->fpu) < 0)
+        err(1, "KVM_GET_FPU");
+    state->has_xsave = ioctl(kvm, KVM_CHECK_EXTENSION, KVM_CAP_XSAVE) > 0;
+    if (state->has_xsave && ioctl(vcpu->fd, KVM_GET_XSAVE, &state->xsave) < 0)
+        err(1, "KVM_GET_XSAVE");
+    state->has_xcrs = ioctl(kvm, KVM_CHECK_EXTENSION, KVM_CAP_XCRS) > 0;
+    if (state->has_xcrs && ioctl(vcpu->fd, KVM_GET_XCRS, &state->xcrs) < 0)
+        err(1, "KVM_GET_XCRS");
+    state->has_lapic = kvm_has_lapic();
+    if (state->has_lapic && ioctl(vcpu->fd, KVM_GET_LAPIC, &state->lapic) < 0)
+        err(1, "KVM_GET_LAPIC");
+    if (ioctl(vcpu->fd, KVM_GET_MP_STATE, &state->mp_state) < 0)
+        err(1, "KVM_GET_MP_STATE");
+    if (ioctl(vcpu->fd, KVM_GET_VCPU_EVENTS, &state->events) < 0)
+        err(1, "KVM_GET_VCPU_EVENTS");
+    if (ioctl(vcpu->fd, KVM_GET_DEBUGREGS, &state->debugregs) < 0)
+        err(1, "KVM_GET_DEBUGREGS");
+    kvm_save_msrs(vcpu, state);
+}
+
+// Same order as the kernel expects it: the lapic has to be there before the events that reference it
+void kvm_load_vcpu(kvm_vcpu_t *vcpu, kvm_vcpu_state_t *state)
+{
+    if (ioctl(vcpu->fd, KVM_SET_SREGS, &state->sregs) < 0)
+        err(1, "KVM_SET_SREGS");
+    if (ioctl(vcpu->fd, KVM_SET_REGS, &state->regs) < 0)
+        err(1, "KVM_SET_REGS");
+    if (state->has_xsave)
+    {
+        if (ioctl(vcpu->fd, KVM_SET_XSAVE, &state->xsave) < 0)
+            err(1, "KVM_SET_XSAVE");
+    }
+    else if (ioctl(vcpu->fd, KVM_SET_FPU, &state->fpu) < 0)
+    {
+        err(1, "KVM_SET_FPU");
+    }
+    if (state->has_xcrs && ioctl(vcpu->fd, KVM_SET_XCRS, &state->xcrs) < 0)
+        err(1, "KVM_SET_XCRS");
+
+    struct
+    {
+        struct kvm_msrs header;
+        struct kvm_msr_entry entries[KVM_MAX_SAVED_MSRS];
+    } msrs;
+    msrs.header.nmsrs = state->msr_count;
+    memcpy(msrs.entries, state->msrs, state->msr_count * sizeof(struct kvm_msr_entry));
+    int written = ioctl(vcpu->fd, KVM_SET_MSRS, &msrs);
+    if (written < 0)
+        err(1, "KVM_SET_MSRS");
+    if (written != state->msr_count)
+        warnx("vcpu %d: only %d of %d msrs restored", vcpu->id, written, state->msr_count);
+
+    if (ioctl(vcpu->fd, KVM_SET_MP_STATE, &state->mp_state) < 0)
+        err(1, "KVM_SET_MP_STATE");
+    if (state->has_lapic != kvm_has_lapic())
+        errx(1, "The snapshot was taken with a different irqchip");
+    if (state->has_lapic && ioctl(vcpu->fd, KVM_SET_LAPIC, &state->lapic) < 0)
+        err(1, "KVM_SET_LAPIC");
+    if (ioctl(vcpu->fd, KVM_SET_VCPU_EVENTS, &state->events) < 0)
+        err(1, "KVM_SET_VCPU_EVENTS");
+    if (ioctl(vcpu->fd, KVM_SET_DEBUGREGS, &state->debugregs) < 0)
+        err(1, "KVM_SET_DEBUGREGS");
+
+    kvm_vcpu_invalidate_regs(vcpu);
+}
+
+void kvm_save_vm(kvm_vm_state_t *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->irqchip_mode = irqchip_mode;
+    if (irqchip_mode == KVM_IRQCHIP_KERNEL)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            state->chips[i].chip_id = i; // KVM_IRQCHIP_PIC_MASTER, KVM_IRQCHIP_PIC_SLAVE, KVM_IRQCHIP_IOAPIC
+            if (ioctl(vm, KVM_GET_IRQCHIP, &state->chips[i]) < 0)
+                err(1, "KVM_GET_IRQCHIP");
+        }
+    }
+    if (ioctl(vm, KVM_GET_CLOCK, &state->clock) < 0)
+        err(1, "KVM_GET_CLOCK");
+}
+
+void kvm_load_vm(kvm_vm_state_t *state)
+{
+    if (state->irqchip_mode != irqchip_mode)
+        errx(1, "The snapshot was taken with a different irqchip");
+    if (irqchip_mode == KVM_IRQCHIP_KERNEL)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            if (ioctl(vm, KVM_SET_IRQCHIP, &state->chips[i]) < 0)
+                err(1, "KVM_SET_IRQCHIP");
+        }
+    }
+    struct kvm_clock_data clock = {.clock = state->clock.clock};
+    if (ioctl(vm, KVM_SET_CLOCK, &clock) < 0)
+        err(1, "KVM_SET_CLOCK");
+}
+
+#pragma endregion
+
 void kvm_deinit()
 {
-    munmap(run, sizeof(struct kvm_run));
-    close(vcpu);
+    for (int i = 0; i < vcpu_count; i++)
+    {
+        munmap(vcpus[i].run, vcpus[i].run_size);
+        close(vcpus[i].fd);
+    }
     close(vm);
     close(kvm);
 }
 
 void kvm_pause_vcpu()
 {
+    int fd = kvm_current_vcpu()->fd;
     struct kvm_debugregs debugregs;
-    if (ioctl(vcpu, KVM_GET_DEBUGREGS, &debugregs) < 0)
+    if (ioctl(fd, KVM_GET_DEBUGREGS, &debugregs) < 0)
     {
         err(1, "KVM_GET_DEBUGREGS");
     }
     debugregs.db[0] = 0x0;
     debugregs.dr7 |= 0x1;
-    if (ioctl(vcpu, KVM_SET_DEBUGREGS, &debugregs) < 0)
+    if (ioctl(fd, KVM_SET_DEBUGREGS, &debugregs) < 0)
     {
         err(1, "KVM_SET_DEBUGREGS");
     }
 }
 
-void kvm_interrupt(uint32_t vector)
+// The PIC is wired to the BSP. Returns false when the vcpu still has an external interrupt pending.
+bool kvm_interrupt(uint32_t vector)
 {
     struct kvm_interrupt irq = {.irq = vector};
-    if (ioctl(vcpu, KVM_INTERRUPT, &irq) < 0)
+    if (ioctl(vcpus[KVM_BOOT_VCPU].fd, KVM_INTERRUPT, &irq) < 0)
     {
+        if (errno == EEXIST)
+        {
+            return false;
+        }
         err(1, "KVM_INTERRUPT");
     }
+    return true;
+}
+
+kvm_irqchip_mode_t kvm_get_irqchip_mode()
+{
+    return irqchip_mode;
+}
+
+// Only valid with the in-kernel irqchip. Can be called from any thread.
+void kvm_irq_line(uint32_t irq, int level)
+{
+    struct kvm_irq_level irq_level = {.irq = irq, .level = level};
+    if (ioctl(vm, KVM_IRQ_LINE, &irq_level) < 0)
+    {
+        err(1, "KVM_IRQ_LINE");
+    }
 }
 
 bool kvm_is_interrupts_enabled()
 {
-    if (vcpu != NULL)
+    if (vcpu_count > 0)
     {
-        struct kvm_regs regs;
-        kvm_get_regs(&regs);
-        return regs.rflags & 0x200;
+        // kvm_run mirrors IF on every exit, so there is no need to stop the vcpu for its rflags
+        return vcpus[KVM_BOOT_VCPU].run->if_flag;
     }
     return false;
 }
\ No newline at end of file
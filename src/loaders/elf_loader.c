@@ -2,81 +2,481 @@
 #include "kvm.h"
 #include <elf.h>
 #include <stdio.h>
-#include <sys/mman.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/stat.h>
+#include "memory.h"
+#include "common.h"
 
-uint32_t elf_load(int vm, uint8_t *code, size_t size)
+/*
+Direct boot of ELF kernels, the segments are read from the file straight into guest ram at their physical
+addresses. How the kernel is entered depends on what it asks for:
+- a Multiboot or Multiboot2 header: 32-bit protected mode with the boot information in ebx, as the specs say
+- ELF64 without one: long mode, the first 4G identity mapped with 2M pages
+- ELF32 without one: real mode at the entry point, like a boot sector (the kernel.elf test kernel)
+The loader's own data lives below 0x8000 (GDT, boot information, page tables), the kernel must not load there.
+*/
+
+#define ELF_GDT 0x500
+#define ELF_INFO 0x1000 // multiboot information, with the command line and the memory map
+#define ELF_INFO_SIZE 0x1000
+#define ELF_PML4 0x2000
+#define ELF_PDPT 0x3000
+#define ELF_PD 0x4000 // 4 pages, 2M pages up to 4G
+#define ELF_LOADER_END 0x8000
+
+#define ELF_CODE64 0x08
+#define ELF_CODE32 0x10
+#define ELF_DATA 0x18
+
+#define MULTIBOOT_MAGIC 0x1BADB002
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+#define MULTIBOOT_SEARCH 8192
+#define MULTIBOOT_INFO_MEMORY (1 << 0)
+#define MULTIBOOT_INFO_CMDLINE (1 << 2)
+#define MULTIBOOT_INFO_MODS (1 << 3)
+#define MULTIBOOT_INFO_MMAP (1 << 6)
+
+#define MULTIBOOT2_MAGIC 0xE85250D6
+#define MULTIBOOT2_BOOTLOADER_MAGIC 0x36D76289
+#define MULTIBOOT2_SEARCH 32768
+#define MULTIBOOT2_TAG_END 0
+#define MULTIBOOT2_TAG_CMDLINE 1
+#define MULTIBOOT2_TAG_MODULE 3
+#define MULTIBOOT2_TAG_MEMINFO 4
+#define MULTIBOOT2_TAG_MMAP 6
+
+typedef enum
+{
+    ELF_BOOT_REAL,
+    ELF_BOOT_LONG,
+    ELF_BOOT_MULTIBOOT,
+    ELF_BOOT_MULTIBOOT2,
+} elf_boot_t;
+
+typedef struct
 {
-    Elf32_Ehdr *ehdr = (Elf32_Ehdr *)code;
+    uint32_t flags;
+    uint32_t mem_lower; // KiB below 640K
+    uint32_t mem_upper; // KiB from 1M up to the first hole
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length;
+    uint32_t mmap_addr;
+    uint32_t unused[18]; // drives, config table, loader name, apm, vbe and framebuffer, never set
+} __attribute__((packed)) multiboot_info_t;
 
-    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0)
-        errx(1, "Not a valid ELF file");
+typedef struct
+{
+    uint32_t size; // of the rest of the entry
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+} __attribute__((packed)) multiboot_mmap_entry_t;
+
+typedef struct
+{
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t string;
+    uint32_t reserved;
+} multiboot_module_t;
+
+// The boot information is built up front to back in the info page
+typedef struct
+{
+    uint8_t *base;
+    uint32_t used;
+} elf_info_t;
+
+static void *elf_info_alloc(elf_info_t *info, uint32_t size, uint32_t align)
+{
+    info->used = (info->used + align - 1) & ~(align - 1);
+    if (info->used + size > ELF_INFO_SIZE)
+    {
+        errx(1, "The boot information doesn't fit in a page, the command line is too long");
+    }
+    void *data = info->base + info->used;
+    memset(data, 0, size);
+    info->used += size;
+    return data;
+}
 
-    if (ehdr->e_ident[EI_CLASS] != ELFCLASS32)
-        errx(1, "Only 32-bit ELF is supported");
+static uint32_t elf_info_gpa(elf_info_t *info, void *data)
+{
+    return ELF_INFO + ((uint8_t *)data - info->base);
+}
 
-    Elf32_Phdr *phdr = (Elf32_Phdr *)(code + ehdr->e_phoff);
-    uint32_t start_addr = 0xFFFFFFFF;
-    uint32_t end_addr = 0;
+static uint32_t elf_info_string(elf_info_t *info, const char *text)
+{
+    char *copy = elf_info_alloc(info, strlen(text) + 1, 1);
+    strcpy(copy, text);
+    return elf_info_gpa(info, copy);
+}
 
-    for (int i = 0; i < ehdr->e_phnum; i++)
+static void elf_read(int fd, const char *path, void *dest, size_t size, off_t offset)
+{
+    while (size > 0)
     {
-        if (phdr[i].p_type == PT_LOAD)
+        ssize_t bytes = pread(fd, dest, size, offset);
+        if (bytes <= 0)
         {
-            uint32_t mem_size = phdr[i].p_memsz;
-            uint32_t start_vaddr = phdr[i].p_vaddr;
-            uint32_t end_vaddr = start_addr + mem_size;
-
-            if (start_vaddr < start_addr)
-                start_addr = start_vaddr;
-            if (end_vaddr > end_addr)
-                end_addr = end_vaddr;
+            errx(1, "Failed to read %s", path);
         }
+        dest = (uint8_t *)dest + bytes;
+        size -= bytes;
+        offset += bytes;
     }
+}
 
-    uint32_t end_addr_aligned = page_align_up(end_addr);
-    uint32_t start_addr_aligned = page_align_down(start_addr);
-    uint32_t space_size = end_addr_aligned - start_addr_aligned;
-    uint8_t *space = malloc(space_size);
-    if (space == NULL)
-        err(1, "Failed to allocate memory for the guest space");
+static void *elf_guest(uint64_t gpa, uint64_t size, const char *what)
+{
+    void *hva = memory_gpa_to_hva(gpa, size);
+    if (hva == NULL)
+    {
+        errx(1, "The %s (0x%lx bytes at 0x%lx) doesn't fit in guest ram", what, size, gpa);
+    }
+    return hva;
+}
 
-    printf("start_addr = 0x%x, end_addr = 0x%x, space_size = 0x%x\n", start_addr_aligned, end_addr_aligned, space_size);
+#pragma region HEADERS
 
-    for (int i = 0; i < ehdr->e_phnum; i++)
+// Multiboot headers sit 4 (v1) or 8 (v2) byte aligned in the first 8K or 32K of the file
+static elf_boot_t elf_find_multiboot(int fd, const char *path, off_t file_size, bool is_64)
+{
+    uint32_t words[MULTIBOOT2_SEARCH / sizeof(uint32_t)];
+    size_t size = file_size < sizeof(words) ? file_size : sizeof(words);
+    elf_read(fd, path, words, size, 0);
+    for (size_t i = 0; i + 4 <= size / sizeof(uint32_t); i++)
     {
-        if (phdr[i].p_type == PT_LOAD)
+        if (words[i] == MULTIBOOT2_MAGIC && i % 2 == 0 && words[i] + words[i + 1] + words[i + 2] + words[i + 3] == 0)
         {
-            // printf("Segment %d: %d bytes at 0x%x\n", i, phdr[i].p_memsz, phdr[i].p_vaddr);
-            uint32_t mem_size = phdr[i].p_memsz;
-            uint32_t file_size = phdr[i].p_filesz;
-            uint32_t vaddr = phdr[i].p_vaddr;
+            return ELF_BOOT_MULTIBOOT2;
+        }
+        if (words[i] == MULTIBOOT_MAGIC && i * sizeof(uint32_t) < MULTIBOOT_SEARCH && words[i] + words[i + 1] + words[i + 2] == 0)
+        {
+            return ELF_BOOT_MULTIBOOT;
+        }
+    }
+    return is_64 ? ELF_BOOT_LONG : ELF_BOOT_REAL;
+}
 
-            memcpy(space + vaddr - start_addr_aligned, code + phdr[i].p_offset, file_size);
-            if (mem_size > file_size)
+#pragma endregion
+
+#pragma region SEGMENTS
+
+static void elf_load_segment(int fd, const char *path, uint64_t paddr, uint64_t file_size, uint64_t mem_size, uint64_t offset,
+                             elf_boot_t boot, uint64_t *end)
+{
+    if (mem_size == 0)
+    {
+        return;
+    }
+    uint64_t loader_end = boot == ELF_BOOT_LONG ? ELF_LOADER_END : ELF_INFO + ELF_INFO_SIZE;
+    if (paddr < loader_end && paddr + mem_size > ELF_GDT)
+    {
+        errx(1, "%s loads at 0x%lx, where the loader keeps its own data", path, paddr);
+    }
+    if (file_size > mem_size)
+    {
+        errx(1, "%s has a segment with more file than memory", path);
+    }
+
+    uint8_t *segment = elf_guest(paddr, mem_size, "ELF segment");
+    elf_read(fd, path, segment, file_size, offset);
+    memset(segment + file_size, 0, mem_size - file_size);
+    if (paddr + mem_size > *end)
+    {
+        *end = paddr + mem_size;
+    }
+}
+
+// PT_LOAD segments, the end of the highest one is returned
+static uint64_t elf_load_segments(int fd, const char *path, uint8_t *ident, elf_boot_t boot, uint64_t *entry)
+{
+    uint64_t end = 0;
+    if (ident[EI_CLASS] == ELFCLASS64)
+    {
+        Elf64_Ehdr ehdr;
+        elf_read(fd, path, &ehdr, sizeof(ehdr), 0);
+        for (int i = 0; i < ehdr.e_phnum; i++)
+        {
+            Elf64_Phdr phdr;
+            elf_read(fd, path, &phdr, sizeof(phdr), ehdr.e_phoff + i * ehdr.e_phentsize);
+            if (phdr.p_type == PT_LOAD)
             {
-                memset(space + vaddr - start_addr_aligned + file_size, 0, mem_size - file_size);
+                elf_load_segment(fd, path, phdr.p_paddr, phdr.p_filesz, phdr.p_memsz, phdr.p_offset, boot, &end);
             }
         }
-        printf("type: %x, mem_size: %x, file_size: %x, vaddr: %x\n", phdr[i].p_type, phdr[i].p_memsz, phdr[i].p_filesz, phdr[i].p_vaddr);
-    }
-
-    // Allocate and map the segment in guest memory
-    void *guest_mem = mmap(start_addr_aligned, space_size + 0x1000, PROT_READ | PROT_WRITE,
-                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    if (guest_mem == MAP_FAILED)
-        err(1, "Failed to mmap guest memory for ELF segment");
-    memcpy(guest_mem, space, space_size);
-
-    struct kvm_userspace_memory_region mem_region = {
-        .slot = 0,
-        // .guest_phys_addr = start_addr_aligned,
-        .guest_phys_addr = start_addr_aligned,
-        .memory_size = space_size + 0x1000,
-        .userspace_addr = (uint32_t)guest_mem,
-        .flags = 0,
+        *entry = ehdr.e_entry;
+    }
+    else
+    {
+        Elf32_Ehdr ehdr;
+        elf_read(fd, path, &ehdr, sizeof(ehdr), 0);
+        for (int i = 0; i < ehdr.e_phnum; i++)
+        {
+            Elf32_Phdr phdr;
+            elf_read(fd, path, &phdr, sizeof(phdr), ehdr.e_phoff + i * ehdr.e_phentsize);
+            if (phdr.p_type == PT_LOAD)
+            {
+                elf_load_segment(fd, path, phdr.p_paddr, phdr.p_filesz, phdr.p_memsz, phdr.p_offset, boot, &end);
+            }
+        }
+        *entry = ehdr.e_entry;
+    }
+    return end;
+}
+
+// The module (-I) goes to the first page after the kernel
+static void elf_load_module(const char *path, uint64_t kernel_end, uint32_t *start, uint32_t *end)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        err(1, "Failed to open %s", path);
+    }
+    uint64_t address = ((kernel_end > MEMORY_SHADOW_END ? kernel_end : MEMORY_SHADOW_END) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    elf_read(fd, path, elf_guest(address, st.st_size, "module"), st.st_size, 0);
+    close(fd);
+    *start = address;
+    *end = address + st.st_size;
+}
+
+#pragma endregion
+
+#pragma region BOOT INFORMATION
+
+static uint32_t elf_mem_upper()
+{
+    return (memory_get_below_4g() - MEMORY_SHADOW_END) >> 10;
+}
+
+static uint32_t elf_setup_multiboot(elf_info_t *info, const char *cmdline, const char *module_path, uint32_t module_start,
+                                    uint32_t module_end)
+{
+    multiboot_info_t *mbi = elf_info_alloc(info, sizeof(multiboot_info_t), 8);
+    mbi->flags = MULTIBOOT_INFO_MEMORY | MULTIBOOT_INFO_CMDLINE | MULTIBOOT_INFO_MMAP;
+    mbi->mem_lower = MEMORY_EBDA_START >> 10;
+    mbi->mem_upper = elf_mem_upper();
+    mbi->cmdline = elf_info_string(info, cmdline);
+
+    memory_map_entry_t map[MEMORY_MAP_ENTRIES];
+    int count = memory_get_map(map);
+    multiboot_mmap_entry_t *mmap = elf_info_alloc(info, count * sizeof(multiboot_mmap_entry_t), 4);
+    for (int i = 0; i < count; i++)
+    {
+        mmap[i] = (multiboot_mmap_entry_t){.size = sizeof(multiboot_mmap_entry_t) - sizeof(uint32_t), .addr = map[i].gpa, .len = map[i].size, .type = map[i].type};
+    }
+    mbi->mmap_addr = elf_info_gpa(info, mmap);
+    mbi->mmap_length = count * sizeof(multiboot_mmap_entry_t);
+
+    if (module_path != NULL)
+    {
+        multiboot_module_t *module = elf_info_alloc(info, sizeof(multiboot_module_t), 4);
+        module->mod_start = module_start;
+        module->mod_end = module_end;
+        module->string = elf_info_string(info, module_path);
+        mbi->flags |= MULTIBOOT_INFO_MODS;
+        mbi->mods_count = 1;
+        mbi->mods_addr = elf_info_gpa(info, module);
+    }
+    return elf_info_gpa(info, mbi);
+}
+
+// Multiboot2 tags are 8 byte aligned, each starts with its type and size
+static uint32_t *elf_add_tag(elf_info_t *info, uint32_t type, uint32_t size)
+{
+    uint32_t *tag = elf_info_alloc(info, size, 8);
+    tag[0] = type;
+    tag[1] = size;
+    return tag;
+}
+
+static uint32_t elf_setup_multiboot2(elf_info_t *info, const char *cmdline, const char *module_path, uint32_t module_start,
+                                     uint32_t module_end)
+{
+    uint32_t *header = elf_info_alloc(info, 2 * sizeof(uint32_t), 8);
+
+    uint32_t *tag = elf_add_tag(info, MULTIBOOT2_TAG_CMDLINE, 2 * sizeof(uint32_t) + strlen(cmdline) + 1);
+    strcpy((char *)&tag[2], cmdline);
+
+    if (module_path != NULL)
+    {
+        tag = elf_add_tag(info, MULTIBOOT2_TAG_MODULE, 4 * sizeof(uint32_t) + strlen(module_path) + 1);
+        tag[2] = module_start;
+        tag[3] = module_end;
+        strcpy((char *)&tag[4], module_path);
+    }
+
+    tag = elf_add_tag(info, MULTIBOOT2_TAG_MEMINFO, 4 * sizeof(uint32_t));
+    tag[2] = MEMORY_EBDA_START >> 10;
+    tag[3] = elf_mem_upper();
+
+    // entries of 24 bytes: base, length, type and a reserved word
+    memory_map_entry_t map[MEMORY_MAP_ENTRIES];
+    int count = memory_get_map(map);
+    tag = elf_add_tag(info, MULTIBOOT2_TAG_MMAP, 4 * sizeof(uint32_t) + count * 24);
+    tag[2] = 24;
+    tag[3] = 0;
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t *entry = &tag[4 + i * 6];
+        *(uint64_t *)&entry[0] = map[i].gpa;
+        *(uint64_t *)&entry[2] = map[i].size;
+        entry[4] = map[i].type;
+        entry[5] = 0;
+    }
+
+    elf_add_tag(info, MULTIBOOT2_TAG_END, 2 * sizeof(uint32_t));
+    header[0] = info->used - ((uint8_t *)header - info->base);
+    return elf_info_gpa(info, header);
+}
+
+#pragma endregion
+
+#pragma region CPU
+
+static void elf_set_segment(struct kvm_segment *segment, uint16_t selector, uint8_t type, bool long_mode)
+{
+    *segment = (struct kvm_segment){
+        .base = 0,
+        .limit = 0xffffffff,
+        .selector = selector,
+        .type = type,
+        .present = 1,
+        .s = 1,
+        .db = !long_mode,
+        .l = long_mode,
+        .g = 1,
     };
+}
+
+// 1:1 for the first 4G
+static void elf_setup_page_tables()
+{
+    uint64_t *pml4 = elf_guest(ELF_PML4, PAGE_SIZE, "PML4");
+    uint64_t *pdpt = elf_guest(ELF_PDPT, PAGE_SIZE, "PDPT");
+    uint64_t *pd = elf_guest(ELF_PD, 4 * PAGE_SIZE, "page directory");
+    memset(pml4, 0, PAGE_SIZE);
+    memset(pdpt, 0, PAGE_SIZE);
+    pml4[0] = ELF_PDPT | 0x3; // present, writable
+    for (int i = 0; i < 4; i++)
+    {
+        pdpt[i] = (ELF_PD + i * PAGE_SIZE) | 0x3;
+    }
+    for (uint64_t i = 0; i < 4 * 512; i++)
+    {
+        pd[i] = (i << 21) | 0x83; // present, writable, 2M
+    }
+}
+
+static void elf_setup_cpu(elf_boot_t boot, uint64_t entry, uint32_t info)
+{
+    uint64_t *gdt = elf_guest(ELF_GDT, 4 * sizeof(uint64_t), "GDT");
+    gdt[0] = 0;
+    gdt[ELF_CODE64 / 8] = 0x00af9b000000ffffULL;
+    gdt[ELF_CODE32 / 8] = 0x00cf9b000000ffffULL;
+    gdt[ELF_DATA / 8] = 0x00cf93000000ffffULL;
 
-    kvm_set_userspace_memory_region(&mem_region);
+    struct kvm_sregs sregs;
+    kvm_get_sregs(&sregs);
+    struct kvm_regs regs = {0};
+    regs.rflags = 0x2;
+    if (boot == ELF_BOOT_REAL)
+    {
+        // the reset state from kvm_init, only cs moves to the entry point
+        sregs.cs.selector = (entry >> 4) & 0xf000;
+        sregs.cs.base = sregs.cs.selector << 4;
+        regs.rip = entry - sregs.cs.base;
+    }
+    else
+    {
+        bool long_mode = boot == ELF_BOOT_LONG;
+        elf_set_segment(&sregs.cs, long_mode ? ELF_CODE64 : ELF_CODE32, 0xb, long_mode);
+        elf_set_segment(&sregs.ds, ELF_DATA, 0x3, false);
+        sregs.es = sregs.ds;
+        sregs.fs = sregs.ds;
+        sregs.gs = sregs.ds;
+        sregs.ss = sregs.ds;
+        sregs.gdt.base = ELF_GDT;
+        sregs.gdt.limit = 4 * sizeof(uint64_t) - 1;
+        sregs.cr0 = (sregs.cr0 | 1) & ~(1U << 31);
+        sregs.cr4 = 0;
+        sregs.efer = 0;
+        if (long_mode)
+        {
+            elf_setup_page_tables();
+            sregs.cr3 = ELF_PML4;
+            sregs.cr4 = 1 << 5;                // PAE
+            sregs.cr0 |= 1U << 31;             // PG
+            sregs.efer = (1 << 8) | (1 << 10); // LME, LMA
+        }
+        regs.rip = entry;
+        regs.rax = boot == ELF_BOOT_MULTIBOOT ? MULTIBOOT_BOOTLOADER_MAGIC : MULTIBOOT2_BOOTLOADER_MAGIC;
+        regs.rbx = info;
+    }
+    kvm_set_sregs(&sregs);
+    kvm_set_regs(&regs);
+}
+
+#pragma endregion
+
+// After kvm_init, in place of the BIOS reset state. false if path isn't an ELF file. module_path and cmdline may be NULL.
+bool elf_load(const char *path, const char *module_path, const char *cmdline)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        err(1, "Failed to open %s", path);
+    }
+    uint8_t ident[EI_NIDENT] = {0};
+    if (st.st_size < sizeof(Elf64_Ehdr) || pread(fd, ident, sizeof(ident), 0) != sizeof(ident) || memcmp(ident, ELFMAG, SELFMAG) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    if (ident[EI_CLASS] != ELFCLASS32 && ident[EI_CLASS] != ELFCLASS64)
+    {
+        errx(1, "%s is neither a 32 nor a 64-bit ELF file", path);
+    }
+
+    elf_boot_t boot = elf_find_multiboot(fd, path, st.st_size, ident[EI_CLASS] == ELFCLASS64);
+    uint64_t entry;
+    uint64_t end = elf_load_segments(fd, path, ident, boot, &entry);
+    close(fd);
+
+    uint32_t module_start = 0;
+    uint32_t module_end = 0;
+    if (module_path != NULL)
+    {
+        if (boot != ELF_BOOT_MULTIBOOT && boot != ELF_BOOT_MULTIBOOT2)
+        {
+            errx(1, "Only multiboot kernels take a module");
+        }
+        elf_load_module(module_path, end, &module_start, &module_end);
+    }
+
+    elf_info_t info = {.base = elf_guest(ELF_INFO, ELF_INFO_SIZE, "boot information")};
+    uint32_t info_gpa = 0;
+    if (boot == ELF_BOOT_MULTIBOOT)
+    {
+        info_gpa = elf_setup_multiboot(&info, cmdline != NULL ? cmdline : "", module_path, module_start, module_end);
+    }
+    else if (boot == ELF_BOOT_MULTIBOOT2)
+    {
+        info_gpa = elf_setup_multiboot2(&info, cmdline != NULL ? cmdline : "", module_path, module_start, module_end);
+    }
+    elf_setup_cpu(boot, entry, info_gpa);
 
-    return ehdr->e_entry;
-}
\ No newline at end of file
+    const char *modes[] = {"real mode", "long mode", "multiboot", "multiboot2"};
+    printf("Loaded %s up to 0x%lx, entering it at 0x%lx (%s)\n", path, end, entry, modes[boot]);
+    return true;
+}
@@ -4,12 +4,31 @@
 #include <string.h>
 #include <err.h>
 #include <stdlib.h>
+#include <time.h>
 #include "common.h"
-#include <sys/mman.h>
 #include "kvm.h"
-#include <string.h>
+#include "memory.h"
+#include "components/ata.h"
+#include "snapshot.h"
+
+/*
+Direct El Torito boot: the no-emulation boot image is loaded where the boot catalog says and entered in real mode,
+the way a BIOS would after POST. Instead of a BIOS the guest gets an IVT whose few useful vectors point at stubs of
+the form `out ISO_SERVICE_PORT + n, al; iret`. The port handler does the actual work on the saved registers:
+INT 13h reads the CD through ata_read_cdrom, INT 15h reports the memory map, INT 10h teletype goes to stdout.
+Anything fancier (video modes, a real keyboard) needs the BIOS.
+*/
+
+#define ISO_STUBS 0x500
+#define ISO_STACK 0x7c00
+#define ISO_BDA_BASE_MEMORY 0x413 // KiB below the EBDA
+#define ISO_BDA_EBDA_SEGMENT 0x40e
+#define ISO_BOOT_DRIVE 0xe0
+#define ISO_SERVICE_PORT 0xe0
+#define ISO_SECTOR 512 // what the catalog counts in
 
-#define VM_MEMORY_SIZE (16 * 1024 * 1024) // 16 MB
+#define ISO_FLAG_CARRY (1 << 0)
+#define ISO_FLAG_ZERO (1 << 6)
 
 struct eltorito_validation_entry
 {
@@ -35,15 +54,59 @@ struct eltorito_default_entry
     uint8_t reserved2[20];
 } __attribute__((packed));
 
-struct eltorito_section_header
+// What mkisofs -boot-info-table patches into the image at offset 8
+struct eltorito_boot_info
+{
+    uint32_t pvd_lba;
+    uint32_t file_lba;
+    uint32_t file_length;
+    uint32_t checksum;
+} __attribute__((packed));
+
+// INT 13h AH=42h
+struct iso_disk_address_packet
 {
-    uint8_t header_id; // 0x02 for section header
-    uint8_t platform_id;
-    uint16_t remaining_sections;
-    char id_string[28];
-};
+    uint8_t size;
+    uint8_t reserved;
+    uint16_t count;
+    uint16_t offset;
+    uint16_t segment;
+    uint64_t lba;
+} __attribute__((packed));
 
-#define VM_MEMORY_SIZE (16 * 1024 * 1024) // 16 MB
+// INT 13h AH=4Bh
+struct iso_specification_packet
+{
+    uint8_t size;
+    uint8_t media_type;
+    uint8_t drive;
+    uint8_t controller;
+    uint32_t image_lba;
+    uint16_t device;
+    uint16_t buffer_segment;
+    uint16_t load_segment;
+    uint16_t sector_count;
+    uint8_t cylinders;
+    uint8_t sectors;
+    uint8_t heads;
+} __attribute__((packed));
+
+typedef enum
+{
+    ISO_SERVICE_VIDEO,      // INT 10h
+    ISO_SERVICE_EQUIPMENT,  // INT 11h
+    ISO_SERVICE_MEMORY,     // INT 12h
+    ISO_SERVICE_DISK,       // INT 13h
+    ISO_SERVICE_SYSTEM,     // INT 15h
+    ISO_SERVICE_KEYBOARD,   // INT 16h
+    ISO_SERVICE_TIME,       // INT 1Ah
+    ISO_SERVICE_COUNT,
+} iso_service_t;
+
+static const uint8_t iso_service_vectors[ISO_SERVICE_COUNT] = {0x10, 0x11, 0x12, 0x13, 0x15, 0x16, 0x1a};
+static struct eltorito_default_entry boot_entry;
+static bool iso_services_active = false;  // saved, the guest may still be booting when it's snapshotted or migrated
+static bool iso_services_registered = false;
 
 void validate_pvd(struct iso_primary_descriptor *pvd)
 {
@@ -70,80 +133,392 @@ void validate_default_entry(struct eltorito_default_entry *default_entry)
     if (default_entry->bootable != 0x88)
         errx(1, "Invalid eltorito format: not bootable");
     if (default_entry->media_type != 0x00)
-        errx(1, "Invalid eltorito format: not a floppy");
+        errx(1, "Invalid eltorito format: only no emulation images boot without the BIOS");
 }
 
-void validate_bootloader(uint8_t *boot_image, size_t size)
+static void iso_read(void *data, uint64_t lba, uint32_t count)
 {
-    if (size < 512)
-        errx(1, "Invalid bootloader: too small");
+    if (!ata_read_cdrom(data, lba, count))
+    {
+        errx(1, "Failed to read sector %lu of the cdrom", lba);
+    }
+}
 
-    if (boot_image[0] != 0xE8 && boot_image[1] != 0x00)
-        errx(1, "Invalid bootloader: starts with invalid instruction");
+// A real mode segment:offset, NULL if it isn't ram. Goes with memory_dma_unmap.
+static void *iso_guest(uint16_t segment, uint16_t offset, uint64_t size)
+{
+    return memory_dma_map(((uint64_t)segment << 4) + offset, size);
+}
 
-    if (!memmem(boot_image, size, "no boot info", 12) &&
-        !memmem(boot_image, size, "cdrom read fails", 16))
-        errx(1, "Invalid bootloader: expected strings not found");
+// Where a segment register and a 16 bit offset register of the caller point
+static uint64_t iso_guest_address(struct kvm_segment *segment, uint64_t offset)
+{
+    return segment->base + (offset & 0xffff);
 }
 
-uint32_t iso_load(uint8_t* guest_memory, uint8_t *iso, size_t size)
+#pragma region SERVICES
+
+static void iso_set_flag(struct kvm_regs *regs, struct kvm_sregs *sregs, uint16_t flag, bool set)
 {
-    struct iso_primary_descriptor *pvd = (struct iso_primary_descriptor *)(iso + 0x10 * ISOFS_BLOCK_SIZE);
-    validate_pvd(pvd);
+    // the flags the stub's iret pops, right above the return address
+    uint64_t address = iso_guest_address(&sregs->ss, regs->rsp + 4);
+    uint8_t flags[2];
+    if (!memory_dma_read(address, flags, sizeof(flags)))
+    {
+        return;
+    }
+    uint16_t value = READ_UINT16(flags);
+    value = set ? value | flag : value & ~flag;
+    WRITE_UINT16(value, flags);
+    memory_dma_write(address, flags, sizeof(flags));
+}
 
-    struct iso_boot_record *br = (struct iso_boot_record *)(iso + 0x11 * ISOFS_BLOCK_SIZE);
-    uint32_t block_address = br->el_torito_catalog_block[0] | (br->el_torito_catalog_block[1] << 8) | (br->el_torito_catalog_block[2] << 16) | (br->el_torito_catalog_block[3] << 24);
+static void iso_set_ah(struct kvm_regs *regs, uint8_t ah)
+{
+    regs->rax = (regs->rax & ~0xff00ULL) | ((uint64_t)ah << 8);
+}
+
+static void iso_video(struct kvm_regs *regs)
+{
+    uint8_t ah = (regs->rax >> 8) & 0xff;
+    if (ah == 0x0e) // teletype
+    {
+        putchar(regs->rax & 0xff);
+    }
+    else if (ah == 0x03) // cursor position
+    {
+        regs->rcx = 0;
+        regs->rdx &= ~0xffffULL;
+    }
+    else if (ah == 0x0f) // video mode: 80x25 color text
+    {
+        regs->rax = (regs->rax & ~0xffffULL) | (80 << 8) | 0x03;
+        regs->rbx &= ~0xff00ULL;
+    }
+}
+
+static bool iso_disk_read(struct kvm_regs *regs, struct kvm_sregs *sregs)
+{
+    uint64_t address = iso_guest_address(&sregs->ds, regs->rsi);
+    struct iso_disk_address_packet packet;
+    if (!memory_dma_read(address, &packet, sizeof(packet)))
+    {
+        return false;
+    }
+    // unlike loading the image this happens while the guest runs, possibly in the middle of a migration
+    uint64_t size = (uint64_t)packet.count * ISOFS_BLOCK_SIZE;
+    void *buffer = iso_guest(packet.segment, packet.offset, size);
+    bool ok = buffer != NULL && ata_read_cdrom(buffer, packet.lba, packet.count);
+    if (buffer != NULL)
+    {
+        memory_dma_unmap(buffer, size, true);
+    }
+    if (!ok)
+    {
+        packet.count = 0; // nothing was transferred
+        memory_dma_write(address, &packet, sizeof(packet));
+    }
+    return ok;
+}
+
+static bool iso_disk_parameters(struct kvm_regs *regs, struct kvm_sregs *sregs)
+{
+    uint64_t address = iso_guest_address(&sregs->ds, regs->rsi);
+    uint8_t table[0x1a] = {0};
+    if (!memory_dma_read(address, table, 2) || READ_UINT16(table) < sizeof(table))
+    {
+        return false;
+    }
+    uint64_t sectors = ata_get_cdrom_sectors();
+    WRITE_UINT16(sizeof(table), table);
+    memcpy(table + 16, &sectors, sizeof(sectors));
+    WRITE_UINT16(ISOFS_BLOCK_SIZE, table + 24);
+    return memory_dma_write(address, table, sizeof(table));
+}
+
+static bool iso_disk_emulation_status(struct kvm_regs *regs, struct kvm_sregs *sregs)
+{
+    struct iso_specification_packet packet = {
+        .size = sizeof(packet),
+        .media_type = 0,
+        .drive = ISO_BOOT_DRIVE,
+        .image_lba = boot_entry.load_rba,
+        .load_segment = boot_entry.load_segment,
+        .sector_count = boot_entry.sector_count,
+    };
+    return memory_dma_write(iso_guest_address(&sregs->ds, regs->rsi), &packet, sizeof(packet));
+}
 
-    struct eltorito_validation_entry *validation_entry = (struct eltorito_validation_entry *)(iso + block_address * ISOFS_BLOCK_SIZE);
+static void iso_disk(struct kvm_regs *regs, struct kvm_sregs *sregs)
+{
+    uint8_t ah = (regs->rax >> 8) & 0xff;
+    bool ok = (regs->rdx & 0xff) == ISO_BOOT_DRIVE;
+    if (ok)
+    {
+        switch (ah)
+        {
+        case 0x00: // reset
+        case 0x01: // status of the last operation
+            break;
+        case 0x41: // extensions present
+            ok = (regs->rbx & 0xffff) == 0x55aa;
+            regs->rbx = (regs->rbx & ~0xffffULL) | 0xaa55;
+            regs->rcx = (regs->rcx & ~0xffffULL) | 0x1; // the packet calls
+            ah = 0x30;                                   // EDD 3.0
+            break;
+        case 0x42:
+            ok = iso_disk_read(regs, sregs);
+            break;
+        case 0x48:
+            ok = iso_disk_parameters(regs, sregs);
+            break;
+        case 0x4b: // El Torito status, terminating the emulation of a no emulation boot changes nothing
+            ok = iso_disk_emulation_status(regs, sregs);
+            break;
+        default:
+            ok = false;
+        }
+    }
+    if (ah != 0x41)
+    {
+        ah = ok ? 0 : 0x01;
+    }
+    iso_set_ah(regs, ah);
+    iso_set_flag(regs, sregs, ISO_FLAG_CARRY, !ok);
+}
+
+static void iso_system(struct kvm_regs *regs, struct kvm_sregs *sregs)
+{
+    uint16_t ax = regs->rax & 0xffff;
+    bool ok = true;
+    if (ax == 0xe820 && (regs->rdx & 0xffffffff) == 0x534d4150) // 'SMAP'
+    {
+        memory_map_entry_t map[MEMORY_MAP_ENTRIES];
+        int count = memory_get_map(map);
+        uint32_t index = regs->rbx & 0xffffffff;
+        uint8_t entry[20];
+        ok = index < count;
+        if (ok)
+        {
+            memcpy(entry, &map[index].gpa, 8);
+            memcpy(entry + 8, &map[index].size, 8);
+            memcpy(entry + 16, &map[index].type, 4);
+            ok = memory_dma_write(iso_guest_address(&sregs->es, regs->rdi), entry, sizeof(entry));
+        }
+        if (ok)
+        {
+            regs->rax = 0x534d4150;
+            regs->rcx = 20;
+            regs->rbx = index + 1 < count ? index + 1 : 0;
+        }
+    }
+    else if (ax == 0xe801)
+    {
+        // KiB between 1M and 16M, 64K blocks above 16M (below 4G)
+        uint64_t below_4g = memory_get_below_4g();
+        uint64_t low = below_4g > 16 << 20 ? 15 << 10 : (below_4g - MEMORY_SHADOW_END) >> 10;
+        uint64_t high = below_4g > 16 << 20 ? (below_4g - (16 << 20)) >> 16 : 0;
+        regs->rax = regs->rcx = low;
+        regs->rbx = regs->rdx = high;
+    }
+    else if ((ax >> 8) == 0x88)
+    {
+        uint64_t extended = (memory_get_below_4g() - MEMORY_SHADOW_END) >> 10;
+        regs->rax = (regs->rax & ~0xffffULL) | (extended > 0xfc00 ? 0xfc00 : extended);
+    }
+    else
+    {
+        ok = false;
+        iso_set_ah(regs, 0x86); // unsupported
+    }
+    iso_set_flag(regs, sregs, ISO_FLAG_CARRY, !ok);
+}
+
+// There is no keyboard behind these: no key is ever waiting and reading one returns enter
+static void iso_keyboard(struct kvm_regs *regs, struct kvm_sregs *sregs)
+{
+    uint8_t ah = (regs->rax >> 8) & 0xff;
+    if (ah == 0x00 || ah == 0x10)
+    {
+        regs->rax = (regs->rax & ~0xffffULL) | 0x1c0d;
+    }
+    else if (ah == 0x01 || ah == 0x11)
+    {
+        iso_set_flag(regs, sregs, ISO_FLAG_ZERO, true);
+    }
+    else if (ah == 0x02 || ah == 0x12)
+    {
+        regs->rax &= ~0xffULL;
+    }
+}
+
+static void iso_time(struct kvm_regs *regs, struct kvm_sregs *sregs)
+{
+    uint8_t ah = (regs->rax >> 8) & 0xff;
+    if (ah == 0x00)
+    {
+        // 18.2 ticks a second since midnight
+        time_t now = time(NULL);
+        struct tm local;
+        localtime_r(&now, &local);
+        uint32_t ticks = (local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec) * 1193180ULL / 65536;
+        regs->rcx = (regs->rcx & ~0xffffULL) | (ticks >> 16);
+        regs->rdx = (regs->rdx & ~0xffffULL) | (ticks & 0xffff);
+        regs->rax &= ~0xffULL;
+    }
+    iso_set_flag(regs, sregs, ISO_FLAG_CARRY, ah != 0x00);
+}
+
+void iso_handle_services(void *opaque, exit_io_info_t *io, uint8_t *base)
+{
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    kvm_get_regs(&regs);
+    kvm_get_sregs(&sregs);
+
+    switch (io->port - ISO_SERVICE_PORT)
+    {
+    case ISO_SERVICE_VIDEO:
+        iso_video(&regs);
+        break;
+    case ISO_SERVICE_EQUIPMENT:
+        regs.rax = (regs.rax & ~0xffffULL) | 0x0020; // 80x25 color
+        break;
+    case ISO_SERVICE_MEMORY:
+        regs.rax = (regs.rax & ~0xffffULL) | (MEMORY_EBDA_START >> 10);
+        break;
+    case ISO_SERVICE_DISK:
+        iso_disk(&regs, &sregs);
+        break;
+    case ISO_SERVICE_SYSTEM:
+        iso_system(&regs, &sregs);
+        break;
+    case ISO_SERVICE_KEYBOARD:
+        iso_keyboard(&regs, &sregs);
+        break;
+    case ISO_SERVICE_TIME:
+        iso_time(&regs, &sregs);
+        break;
+    }
+    kvm_set_regs(&regs);
+}
+
+#pragma endregion
+
+// Every vector irets, the services go through their port
+static void iso_setup_ivt()
+{
+    uint8_t *stubs = memory_gpa_to_hva(ISO_STUBS, 4 * (ISO_SERVICE_COUNT + 1));
+    uint32_t *ivt = memory_gpa_to_hva(0, 256 * sizeof(uint32_t));
+    stubs[0] = 0xcf; // iret
+    for (int i = 0; i < 256; i++)
+    {
+        ivt[i] = ISO_STUBS;
+    }
+    for (int i = 0; i < ISO_SERVICE_COUNT; i++)
+    {
+        uint8_t *stub = stubs + 4 * (i + 1);
+        stub[0] = 0xe6; // out imm8, al
+        stub[1] = ISO_SERVICE_PORT + i;
+        stub[2] = 0xcf; // iret
+        stub[3] = 0x90;
+        ivt[iso_service_vectors[i]] = ISO_STUBS + 4 * (i + 1);
+    }
+
+    uint8_t *bda = memory_gpa_to_hva(0x400, 0x100);
+    memset(bda, 0, 0x100);
+    WRITE_UINT16(MEMORY_EBDA_START >> 10, bda + ISO_BDA_BASE_MEMORY - 0x400);
+    WRITE_UINT16(MEMORY_EBDA_START >> 4, bda + ISO_BDA_EBDA_SEGMENT - 0x400);
+}
+
+// The catalog only promises sector_count 512 byte sectors, usually 4. If the image carries a boot info table it
+// says how long it really is, and all of it is loaded so the loader doesn't have to read the rest itself.
+static uint64_t iso_image_size(uint8_t *first_sector)
+{
+    uint64_t size = (boot_entry.sector_count ? boot_entry.sector_count : 1) * ISO_SECTOR;
+    struct eltorito_boot_info *info = (struct eltorito_boot_info *)(first_sector + 8);
+    if (info->pvd_lba == 16 && info->file_lba == boot_entry.load_rba && info->file_length > size)
+    {
+        size = info->file_length;
+    }
+    return size;
+}
+
+static void iso_register_services()
+{
+    if (!iso_services_registered)
+    {
+        io_manager_register(NULL, iso_handle_services, NULL, ISO_SERVICE_PORT, ISO_SERVICE_PORT + ISO_SERVICE_COUNT - 1);
+        iso_services_registered = true;
+    }
+}
+
+static void iso_post_load()
+{
+    if (iso_services_active)
+    {
+        iso_register_services();
+    }
+}
+
+// Before any restore or incoming migration, whether or not this run boots the cdrom itself
+void iso_init()
+{
+    snapshot_register("iso.boot_entry", 1, &boot_entry, sizeof(boot_entry), NULL);
+    snapshot_register("iso.services_active", 1, &iso_services_active, sizeof(iso_services_active), iso_post_load);
+}
+
+// After kvm_init and the device inits, in place of the BIOS reset state. Boots the cdrom given to ata_init_disks.
+void iso_load()
+{
+    uint8_t sector[ISOFS_BLOCK_SIZE];
+    iso_read(sector, 0x10, 1);
+    validate_pvd((struct iso_primary_descriptor *)sector);
+
+    iso_read(sector, 0x11, 1);
+    struct iso_boot_record *br = (struct iso_boot_record *)sector;
+    if (br->type[0] != 0 || strncmp(br->id, "CD001", 5) != 0 || strncmp(br->boot_system_identifier, "EL TORITO SPECIFICATION", 23) != 0)
+    {
+        errx(1, "The cdrom has no El Torito boot record");
+    }
+    uint32_t catalog_lba = READ_UINT32(br->el_torito_catalog_block);
+
+    iso_read(sector, catalog_lba, 1);
+    struct eltorito_validation_entry *validation_entry = (struct eltorito_validation_entry *)sector;
     validate_validation_entry(validation_entry);
+    boot_entry = *(struct eltorito_default_entry *)(validation_entry + 1);
+    validate_default_entry(&boot_entry);
 
-    struct eltorito_default_entry *default_entry = (struct eltorito_default_entry *)(validation_entry + 1);
-    validate_default_entry(default_entry);
-
-    size_t bootloader_size = default_entry->sector_count * ISOFS_BLOCK_SIZE;
-
-    uint8_t *bootloader_ptr = (iso + default_entry->load_rba * ISOFS_BLOCK_SIZE);
-    validate_bootloader(bootloader_ptr, bootloader_size);
-
-    uint32_t load_address = default_entry->load_segment ? default_entry->load_segment * 16 : 0x7C00;
-    uint32_t mem_start_addr = page_align_down(load_address);
-    uint32_t mem_end_addr = page_align_up(load_address + bootloader_size);
-    uint32_t mem_size = mem_end_addr - mem_start_addr;
-    uint32_t pad_start_size = load_address - mem_start_addr;
-    uint32_t pad_end_size = mem_size - pad_start_size - bootloader_size;
-
-    // void* guest_mem = mmap(mem_start_addr, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    // if(guest_mem == MAP_FAILED)
-    //     err(1, "Failed to mmap guest memory for ELF segment");
-    // memset(guest_mem, 0, pad_start_size);
-    // memcpy(guest_mem + pad_start_size, bootloader_ptr, bootloader_size);
-    // memset(guest_mem + pad_start_size + bootloader_size, 0, pad_end_size);
-
-    // struct kvm_userspace_memory_region mem_region = {
-    //     .slot = 0,
-    //     .guest_phys_addr = mem_start_addr,
-    //     .memory_size = mem_size,
-    //     .userspace_addr = guest_mem,
-    //     .flags = 0,
-    // };
-
-    // kvm_set_userspace_memory_region(vm, &mem_region);
-
-    // void* guest_mem = mmap(0x7000, 0x1000, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
-    // if(guest_mem == MAP_FAILED)
-        // err(1, "Failed to mmap guest memory for ELF segment");
-    // memset(guest_mem, 0, 0x1000);
-    memcpy(guest_memory + 0x7c00, iso, 512);
-
-    // struct kvm_userspace_memory_region mem_region = {
-    //     .slot = 0,
-    //     .guest_phys_addr = 0x7000,
-    //     .memory_size = 0x1000,
-    //     .userspace_addr = guest_mem,
-    //     .flags = 0,
-    // };
-
-    // kvm_set_userspace_memory_region(vm, &mem_region);
-
-    return 0x7c00;
-}
\ No newline at end of file
+    uint16_t load_segment = boot_entry.load_segment ? boot_entry.load_segment : 0x07c0;
+    boot_entry.load_segment = load_segment;
+    iso_read(sector, boot_entry.load_rba, 1);
+    uint64_t size = iso_image_size(sector);
+    uint64_t sectors = (size + ISOFS_BLOCK_SIZE - 1) / ISOFS_BLOCK_SIZE;
+    uint64_t load_address = (uint64_t)load_segment << 4;
+    if (load_address < ISO_STUBS + PAGE_SIZE || load_address + sectors * ISOFS_BLOCK_SIZE > MEMORY_EBDA_START)
+    {
+        errx(1, "The boot image (%lu bytes at 0x%lx) doesn't fit in conventional memory", size, load_address);
+    }
+
+    iso_setup_ivt();
+    // whole CD sectors, what's past the image is garbage the loader doesn't look at
+    iso_read(memory_gpa_to_hva(load_address, sectors * ISOFS_BLOCK_SIZE), boot_entry.load_rba, sectors);
+    iso_services_active = true;
+    iso_register_services();
+
+    struct kvm_sregs sregs;
+    kvm_get_sregs(&sregs);
+    sregs.cs.selector = load_segment;
+    sregs.cs.base = load_address;
+    sregs.ds.selector = sregs.es.selector = sregs.ss.selector = 0;
+    sregs.ds.base = sregs.es.base = sregs.ss.base = 0;
+    kvm_set_sregs(&sregs);
+
+    struct kvm_regs regs = {0};
+    regs.rip = 0;
+    regs.rsp = ISO_STACK;
+    regs.rdx = ISO_BOOT_DRIVE;
+    regs.rflags = 0x202;
+    kvm_set_regs(&regs);
+    printf("Loaded the El Torito image, %lu bytes at %04x:0000\n", size, load_segment);
+}
@@ -0,0 +1,217 @@
+#include "loaders/linux_loader.h"
+#include <asm/bootparam.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/stat.h>
+#include "kvm.h"
+#include "memory.h"
+#include "common.h"
+
+/*
+Direct boot of a bzImage through the 32-bit boot protocol (Documentation/arch/x86/boot.rst): the setup code and
+the BIOS are skipped, the loader fills in the zero page the setup code would have built and jumps straight
+to the protected mode kernel.
+Guest layout: GDT at 0x6000, boot_params (the zero page) at 0x7000, command line at 0x20000, kernel at 1M and
+the initrd as high as it may go below 4G.
+*/
+
+#define LINUX_GDT 0x6000
+#define LINUX_BOOT_PARAMS 0x7000
+#define LINUX_CMDLINE 0x20000
+#define LINUX_CMDLINE_MAX 0x10000
+#define LINUX_KERNEL 0x100000
+
+#define LINUX_HEADER_MAGIC 0x53726448 // "HdrS"
+#define LINUX_MIN_VERSION 0x0206      // cmdline_size, 2.6.22 and later
+#define LINUX_BOOT_CS 0x10
+#define LINUX_BOOT_DS 0x18
+
+static void linux_read(int fd, const char *path, void *dest, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t bytes = pread(fd, dest, size, offset);
+        if (bytes <= 0)
+        {
+            errx(1, "Failed to read %s", path);
+        }
+        dest = (uint8_t *)dest + bytes;
+        size -= bytes;
+        offset += bytes;
+    }
+}
+
+static void *linux_guest(uint64_t gpa, uint64_t size, const char *what)
+{
+    void *hva = memory_gpa_to_hva(gpa, size);
+    if (hva == NULL)
+    {
+        errx(1, "The %s (%lu bytes at 0x%lx) doesn't fit in guest ram", what, size, gpa);
+    }
+    return hva;
+}
+
+static void linux_setup_e820(struct boot_params *params)
+{
+    memory_map_entry_t map[MEMORY_MAP_ENTRIES];
+    int count = memory_get_map(map);
+    for (int i = 0; i < count; i++)
+    {
+        params->e820_table[i] = (struct boot_e820_entry){.addr = map[i].gpa, .size = map[i].size, .type = map[i].type};
+    }
+    params->e820_entries = count;
+}
+
+static void linux_load_initrd(struct boot_params *params, const char *path, uint64_t kernel_end)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        err(1, "Failed to open %s", path);
+    }
+
+    // as high as possible, the kernel unpacks it right behind itself
+    uint64_t limit = memory_get_below_4g();
+    if (params->hdr.initrd_addr_max != 0 && params->hdr.initrd_addr_max + 1ULL < limit)
+    {
+        limit = params->hdr.initrd_addr_max + 1ULL;
+    }
+    if (st.st_size > limit)
+    {
+        errx(1, "The initrd %s is bigger than the guest ram below 0x%lx", path, limit);
+    }
+    uint64_t address = (limit - st.st_size) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (address < kernel_end)
+    {
+        errx(1, "The initrd %s doesn't fit above the kernel, give the guest more ram", path);
+    }
+
+    linux_read(fd, path, linux_guest(address, st.st_size, "initrd"), st.st_size, 0);
+    close(fd);
+    params->hdr.ramdisk_image = address;
+    params->hdr.ramdisk_size = st.st_size;
+}
+
+// Flat 4G code and data segments, as the boot protocol wants them
+static void linux_set_segment(struct kvm_segment *segment, uint16_t selector, uint8_t type)
+{
+    *segment = (struct kvm_segment){
+        .base = 0,
+        .limit = 0xffffffff,
+        .selector = selector,
+        .type = type,
+        .present = 1,
+        .dpl = 0,
+        .db = 1,
+        .s = 1,
+        .l = 0,
+        .g = 1,
+    };
+}
+
+static void linux_setup_cpu()
+{
+    // the kernel loads its own GDT early on, this one only has to back the selectors until then
+    uint64_t *gdt = linux_guest(LINUX_GDT, 4 * sizeof(uint64_t), "GDT");
+    gdt[0] = 0;
+    gdt[1] = 0;
+    gdt[LINUX_BOOT_CS / 8] = 0x00cf9b000000ffffULL;
+    gdt[LINUX_BOOT_DS / 8] = 0x00cf93000000ffffULL;
+
+    struct kvm_sregs sregs;
+    kvm_get_sregs(&sregs);
+    linux_set_segment(&sregs.cs, LINUX_BOOT_CS, 0xb);
+    linux_set_segment(&sregs.ds, LINUX_BOOT_DS, 0x3);
+    sregs.es = sregs.ds;
+    sregs.fs = sregs.ds;
+    sregs.gs = sregs.ds;
+    sregs.ss = sregs.ds;
+    sregs.gdt.base = LINUX_GDT;
+    sregs.gdt.limit = 4 * sizeof(uint64_t) - 1;
+    sregs.cr0 = (sregs.cr0 | 1) & ~(1U << 31);
+    sregs.cr4 = 0;
+    sregs.efer = 0;
+    kvm_set_sregs(&sregs);
+
+    struct kvm_regs regs = {0};
+    regs.rip = LINUX_KERNEL;
+    regs.rsi = LINUX_BOOT_PARAMS;
+    regs.rflags = 0x2; // interrupts off
+    kvm_set_regs(&regs);
+}
+
+// After kvm_init, in place of the BIOS reset state. initrd_path and cmdline may be NULL.
+void linux_load(const char *kernel_path, const char *initrd_path, const char *cmdline)
+{
+    int fd = open(kernel_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        err(1, "Failed to open %s", kernel_path);
+    }
+
+    struct boot_params *params = linux_guest(LINUX_BOOT_PARAMS, sizeof(*params), "zero page");
+    memset(params, 0, sizeof(*params));
+
+    // the header runs from 0x1f1 up to the end of the jump at 0x200, which skips over it
+    uint8_t sector[0x400];
+    if (st.st_size < sizeof(sector))
+    {
+        errx(1, "%s is too small for a bzImage", kernel_path);
+    }
+    linux_read(fd, kernel_path, sector, sizeof(sector), 0);
+    size_t header_end = 0x202 + sector[0x201];
+    if (header_end > sizeof(sector) || header_end - 0x1f1 > sizeof(params->hdr))
+    {
+        header_end = 0x1f1 + sizeof(params->hdr);
+    }
+    memcpy(&params->hdr, sector + 0x1f1, header_end - 0x1f1);
+    if (params->hdr.header != LINUX_HEADER_MAGIC || params->hdr.version < LINUX_MIN_VERSION)
+    {
+        errx(1, "%s is not a bzImage of boot protocol 2.06 or later", kernel_path);
+    }
+    if (!(params->hdr.loadflags & LOADED_HIGH))
+    {
+        errx(1, "%s is a zImage, only bzImages load at 1M", kernel_path);
+    }
+
+    uint64_t setup_size = ((params->hdr.setup_sects ? params->hdr.setup_sects : 4) + 1) * 512;
+    if (setup_size >= st.st_size)
+    {
+        errx(1, "%s has no protected mode kernel", kernel_path);
+    }
+    uint64_t kernel_size = st.st_size - setup_size;
+    // the kernel decompresses itself in place and needs init_size bytes for that, 2.10 and later
+    uint64_t kernel_end = LINUX_KERNEL + (params->hdr.init_size > kernel_size ? params->hdr.init_size : kernel_size);
+    linux_guest(LINUX_KERNEL, kernel_end - LINUX_KERNEL, "kernel");
+    linux_read(fd, kernel_path, linux_guest(LINUX_KERNEL, kernel_size, "kernel"), kernel_size, setup_size);
+    close(fd);
+
+    params->hdr.type_of_loader = 0xff; // undefined boot loader
+    params->hdr.loadflags &= ~(KEEP_SEGMENTS | CAN_USE_HEAP);
+    params->hdr.code32_start = LINUX_KERNEL;
+
+    if (cmdline == NULL)
+    {
+        cmdline = "";
+    }
+    size_t cmdline_length = strlen(cmdline);
+    if (cmdline_length >= LINUX_CMDLINE_MAX || (params->hdr.cmdline_size != 0 && cmdline_length > params->hdr.cmdline_size))
+    {
+        errx(1, "The kernel command line is too long");
+    }
+    memcpy(linux_guest(LINUX_CMDLINE, cmdline_length + 1, "command line"), cmdline, cmdline_length + 1);
+    params->hdr.cmd_line_ptr = LINUX_CMDLINE;
+
+    if (initrd_path != NULL)
+    {
+        linux_load_initrd(params, initrd_path, kernel_end);
+    }
+    linux_setup_e820(params);
+    linux_setup_cpu();
+    printf("Loaded %s, %lu KiB of kernel at 0x%x\n", kernel_path, kernel_size >> 10, LINUX_KERNEL);
+}
@@ -1,41 +1,327 @@
+#define _GNU_SOURCE
 #include "log.h"
 #include "kvm.h"
-#include "components/seabios_log.h"
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
 
-FILE *log_file;
+/*
+Every thread that logs gets its own single producer/single consumer ring of fixed size records.
+log_print only copies the arguments in, a background thread drains all the rings into trace.bin.
+When a ring is full the event is dropped and counted instead of blocking the vcpu.
+*/
 
-void log_init()
+#define LOG_RING_SIZE 1024 // records, has to be a power of two
+#define LOG_WRITER_INTERVAL_NS 10000000
+
+typedef enum
 {
-    log_file = fopen("log.txt", "w");
-    if (!log_file)
-        err(1, "Failed to open log file");
+    LOG_RING_OWNED,
+    LOG_RING_ORPHANED, // its thread exited, freed once drained
+    LOG_RING_FREE,
+} log_ring_state_t;
+
+typedef struct log_ring
+{
+    log_record_t records[LOG_RING_SIZE];
+    uint64_t head; // only written by the owning thread
+    uint64_t tail; // only written by the writer
+    uint32_t dropped;
+    uint32_t tid;
+    log_ring_state_t state;
+    struct log_ring *next;
+} log_ring_t;
+
+static FILE *log_file;
+static log_ring_t *log_rings = NULL; // rings are never unlinked, free ones get reused by new threads
+static __thread log_ring_t *log_ring = NULL;
+static pthread_key_t log_ring_key;
+static pthread_t log_writer;
+static pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// ids of the strings already written to the file (open addressing, writer only)
+static uint64_t *log_strings = NULL;
+static size_t log_strings_capacity = 0;
+static size_t log_strings_count = 0;
+
+static void log_ring_release(void *arg)
+{
+    log_ring_t *ring = arg;
+    __atomic_store_n(&ring->state, LOG_RING_ORPHANED, __ATOMIC_RELEASE);
+}
+
+static log_ring_t *log_get_ring()
+{
+    if (log_ring != NULL)
+    {
+        return log_ring;
+    }
+
+    log_ring_t *ring = NULL;
+    for (log_ring_t *it = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); it != NULL; it = it->next)
+    {
+        log_ring_state_t expected = LOG_RING_FREE;
+        if (__atomic_compare_exchange_n(&it->state, &expected, LOG_RING_OWNED, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            ring = it;
+            break;
+        }
+    }
+
+    if (ring == NULL)
+    {
+        ring = calloc(1, sizeof(log_ring_t));
+        if (ring == NULL)
+        {
+            return NULL;
+        }
+        ring->state = LOG_RING_OWNED;
+        ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        {
+        }
+    }
+
+    ring->tid = gettid();
+    log_ring = ring;
+    pthread_setspecific(log_ring_key, ring);
+    return ring;
 }
 
-void log_print(const char *fmt, ...)
-{  
+void log_print(const char *module, const char *fmt, ...)
+{
+    log_ring_t *ring = log_get_ring();
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE)
+    {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    log_record_t *record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    record->timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->rip = 0;
+    if (kvm_is_vcpu_thread())
+    {
+        struct kvm_regs regs;
+        kvm_get_regs(&regs); // served from the register cache
+        record->rip = regs.rip;
+    }
+    record->fmt = (uintptr_t)fmt;
+    record->module = (uintptr_t)module;
+    record->tid = ring->tid;
+    record->nargs = 0;
+    record->string_args = 0;
+
     va_list args;
     va_start(args, fmt);
-
-    struct kvm_regs regs;
-    kvm_get_regs(&regs);
-    
-    FILE* seabios_log = seabios_log_get_file();
-    fprintf(log_file, "[0x%llx ", regs.rip);
-    fprintf(seabios_log, "[0x%llx ", regs.rip);
-    va_list args_copy;
-    va_copy(args_copy, args);
-    vfprintf(log_file, fmt, args);
-    vfprintf(seabios_log, fmt, args_copy);
-    fprintf(log_file, "\n");
-    fprintf(seabios_log, "\n");
+    for (const char *c = fmt; *c != '\0' && record->nargs < LOG_MAX_ARGS; c++)
+    {
+        if (*c != '%')
+        {
+            continue;
+        }
+        log_arg_t type = log_parse_conversion(c + 1, &c);
+        uint64_t *arg = &record->args[record->nargs];
+        switch (type)
+        {
+        case LOG_ARG_INT:
+            *arg = va_arg(args, unsigned int);
+            break;
+        case LOG_ARG_LONG:
+            *arg = va_arg(args, uint64_t);
+            break;
+        case LOG_ARG_DOUBLE:
+        {
+            double value = va_arg(args, double);
+            memcpy(arg, &value, sizeof(value));
+            break;
+        }
+        case LOG_ARG_POINTER:
+            *arg = (uintptr_t)va_arg(args, void *);
+            break;
+        case LOG_ARG_STRING:
+            *arg = (uintptr_t)va_arg(args, const char *);
+            record->string_args |= 1 << record->nargs;
+            break;
+        case LOG_ARG_NONE:
+            if (*c == '\0')
+            {
+                c--; // let the loop see the terminator
+            }
+            continue;
+        }
+        record->nargs++;
+    }
     va_end(args);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static bool log_string_known(uint64_t id)
+{
+    if (log_strings_capacity == 0)
+    {
+        return false;
+    }
+    for (size_t i = (id >> 3) & (log_strings_capacity - 1); log_strings[i] != 0; i = (i + 1) & (log_strings_capacity - 1))
+    {
+        if (log_strings[i] == id)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void log_string_insert(uint64_t id)
+{
+    if ((log_strings_count + 1) * 2 > log_strings_capacity)
+    {
+        size_t old_capacity = log_strings_capacity;
+        uint64_t *old_strings = log_strings;
+        log_strings_capacity = old_capacity ? old_capacity * 2 : 256;
+        log_strings = calloc(log_strings_capacity, sizeof(uint64_t));
+        if (log_strings == NULL)
+        {
+            err(1, "Failed to grow the trace string table");
+        }
+        log_strings_count = 0;
+        for (size_t i = 0; i < old_capacity; i++)
+        {
+            if (old_strings[i] != 0)
+            {
+                log_string_insert(old_strings[i]);
+            }
+        }
+        free(old_strings);
+    }
+
+    size_t i = (id >> 3) & (log_strings_capacity - 1);
+    while (log_strings[i] != 0)
+    {
+        i = (i + 1) & (log_strings_capacity - 1);
+    }
+    log_strings[i] = id;
+    log_strings_count++;
+}
+
+// Strings are identified by their address, the text only goes into the file the first time
+static void log_write_string(uint64_t id)
+{
+    if (id == 0 || log_string_known(id))
+    {
+        return;
+    }
+    log_string_insert(id);
+
+    uint32_t type = LOG_TRACE_STRING;
+    uint32_t length = strlen((const char *)id);
+    fwrite(&type, sizeof(type), 1, log_file);
+    fwrite(&id, sizeof(id), 1, log_file);
+    fwrite(&length, sizeof(length), 1, log_file);
+    fwrite((const char *)id, 1, length, log_file);
+}
+
+static void log_drain_ring(log_ring_t *ring)
+{
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (; tail != head; tail++)
+    {
+        log_record_t *record = &ring->records[tail & (LOG_RING_SIZE - 1)];
+        log_write_string(record->fmt);
+        log_write_string(record->module);
+        for (int i = 0; i < record->nargs; i++)
+        {
+            if (record->string_args & (1 << i))
+            {
+                log_write_string(record->args[i]);
+            }
+        }
+
+        uint32_t type = LOG_TRACE_EVENT;
+        fwrite(&type, sizeof(type), 1, log_file);
+        fwrite(record, sizeof(*record), 1, log_file);
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    uint32_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped != 0)
+    {
+        uint32_t entry[3] = {LOG_TRACE_DROPPED, ring->tid, dropped};
+        fwrite(entry, sizeof(entry), 1, log_file);
+    }
+}
+
+void log_flush()
+{
+    pthread_mutex_lock(&log_drain_mutex);
+    for (log_ring_t *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        // read the state first, an orphan can't produce anything after it
+        log_ring_state_t state = __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE);
+        if (state == LOG_RING_FREE)
+        {
+            continue;
+        }
+        log_drain_ring(ring);
+        if (state == LOG_RING_ORPHANED)
+        {
+            ring->head = ring->tail = 0;
+            __atomic_store_n(&ring->state, LOG_RING_FREE, __ATOMIC_RELEASE);
+        }
+    }
     fflush(log_file);
-    fflush(seabios_log);
+    pthread_mutex_unlock(&log_drain_mutex);
+}
+
+static void *log_writer_thread(void *arg)
+{
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = LOG_WRITER_INTERVAL_NS};
+    while (1)
+    {
+        nanosleep(&interval, NULL);
+        log_flush();
+    }
+    return NULL;
+}
+
+void log_init()
+{
+    log_file = fopen("trace.bin", "w");
+    if (!log_file)
+        err(1, "Failed to open log file");
+
+    log_trace_header_t header = {.magic = LOG_TRACE_MAGIC, .version = LOG_TRACE_VERSION, .record_size = sizeof(log_record_t)};
+    fwrite(&header, sizeof(header), 1, log_file);
+
+    if (pthread_key_create(&log_ring_key, log_ring_release) != 0)
+    {
+        errx(1, "Failed to create the log ring key");
+    }
+    if (pthread_create(&log_writer, NULL, log_writer_thread, NULL) != 0)
+    {
+        errx(1, "Failed to create the log writer thread");
+    }
+    atexit(log_flush); // whatever the writer hasn't picked up yet
 }
 
 void log_deinit()
 {
+    log_flush();
     fclose(log_file);
 }
@@ -1,10 +1,21 @@
 #include <err.h>
 #include <signal.h>
 #include <stddef.h>
+#include <string.h>
+#include <unistd.h>
 #include "kvm.h"
 #include "gui.h"
 #include "log.h"
 #include "io_manager.h"
+#include "mmio_manager.h"
+#include "stats.h"
+#include "memory.h"
+#include "snapshot.h"
+#include "migration.h"
+#include "block.h"
+#include "loaders/linux_loader.h"
+#include "loaders/elf_loader.h"
+#include "loaders/iso_loader.h"
 #include "components/cmos.h"
 #include "components/a20.h"
 #include "components/pci.h"
@@ -22,47 +33,247 @@ void handle_sigint(int sig)
     exit(0);
 }
 
-void null_handle(exit_io_info_t *io, uint8_t *base)
+void null_handle(void *opaque, exit_io_info_t *io, uint8_t *base)
 {
 }
 
+static void null_mmio_handle(void *opaque, uint64_t offset, uint8_t *data, uint32_t length, bool is_write)
+{
+    if (!is_write)
+    {
+        memset(data, 0, length);
+    }
+}
+
+// Every port range of the machine, set up in this order. Batched ranges take a rep ins/outs in one call.
+static const io_device_t io_devices[] = {
+    {cmos_init, cmos_handle, NULL, 0x70, 0x71},
+    {a20_init, a20_handle, NULL, 0x92, 0x92},
+    {pci_init, pci_handle, NULL, 0xcf8, 0xcff},
+    {seabios_log_init, seabios_log_handle, NULL, 0x402, 0x402, true},
+    {seabios_info_init, seabios_info_handle, NULL, 0x510, 0x511},
+    {com_init, com_handle, NULL, 0x3f8, 0x3f8, true},
+    {NULL, com_handle, NULL, 0x3f9, 0x3ff},
+    // ignore the other com ports
+    {NULL, null_handle, NULL, 0x2f8, 0x2ff},
+    {NULL, null_handle, NULL, 0x3e8, 0x3ef},
+    {NULL, null_handle, NULL, 0x2e8, 0x2ef},
+    {dma_init, dma_handle, &dma_master, 0xc0, 0xde},
+    {NULL, dma_handle, &dma_slave, 0x00, 0x0f},
+    {pic_init, pic_handle, &pic_master, 0x20, 0x21},
+    {pic_init, pic_handle, &pic_slave, 0xa0, 0xa1},
+    {pit_init, pit_handle, NULL, 0x40, 0x43},
+    {ps2_init, ps2_handle, NULL, 0x60, 0x60},
+    {NULL, ps2_handle, NULL, 0x64, 0x64},
+    {ata_init, ata_handle_io, &ata_primary, 0x1f0, 0x1f0, true},
+    {NULL, ata_handle_io, &ata_primary, 0x1f1, 0x1f7},
+    {ata_init, ata_handle_io, &ata_secondary, 0x170, 0x177},
+    {NULL, ata_handle_control, &ata_primary, 0x3f6, 0x3f7},
+    {NULL, ata_handle_control, &ata_secondary, 0x376, 0x377},
+};
+
+static void usage(char *name)
+{
+    errx(1, "Usage: %s [-c <vcpus>] [-k] [-s <file>] [-m <size>] [-b <backend>] [-t] [-M] [-n <node>] [-S <file>] [-r <file>] [-R <file>] [-T <file>] [-C <file>] [-O <file>] [-G <socket>] [-i <socket>] [-L <kernel>] [-I <initrd>] [-A <cmdline>] [-E] [-d <backend>] <bios> <kernel> <harddisk>\n"
+            "  -c <vcpus>    number of vcpus\n"
+            "  -k            use the in-kernel PIC/IOAPIC/lapic instead of the userspace PIC\n"
+            "  -s <file>     write exit statistics to file on exit and on SIGUSR1 (stderr on SIGUSR1 otherwise)\n"
+            "  -m <size>     guest ram, with an optional K/M/G suffix (default 128M)\n"
+            "  -b <backend>  anon, memfd (default), memfd:2M, memfd:1G or hugetlbfs:<dir>\n"
+            "  -t            madvise the ram for transparent hugepages\n"
+            "  -M            madvise the ram as mergeable for KSM (anon only)\n"
+            "  -n <node>     bind the ram to a NUMA node\n"
+            "  -S <file>     write a snapshot of the whole machine to file on SIGUSR2\n"
+            "  -r <file>     start from a snapshot instead of the reset state (same -c, -k and -m as when it was taken)\n"
+            "  -R <file>     like -r, but the ram is paged in from the file while the machine already runs\n"
+            "  -T <file>     like -S, but write a template that clones map directly (keep it on /dev/shm), the hard disk gets an overlay\n"
+            "  -C <file>     start as a copy-on-write clone of a template, the hard disk gets an overlay\n"
+            "  -O <file>     keep hard disk writes in this overlay file instead of the image (in memory for -T and -C)\n"
+            "  -G <socket>   on SIGUSR2, live migrate the guest to the vmm listening on socket and exit\n"
+            "  -i <socket>   wait on socket for a migrating guest and run it (same -c, -k and -m as the sender)\n"
+            "  -L <kernel>   boot a bzImage, multiboot or ELF kernel directly instead of running the BIOS\n"
+            "                (linux wants -k, there are no ACPI tables)\n"
+            "  -I <file>     initrd for a bzImage, the module for a multiboot kernel\n"
+            "  -A <cmdline>  kernel command line for -L\n"
+            "  -E            boot the cdrom's El Torito image directly, with a few BIOS services instead of the BIOS\n"
+            "  -d <backend>  disk io: pread (default), uring or uring:direct (io_uring, O_DIRECT where aligned)",
+         name);
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc != 4)
+    int vcpu_count = 1;
+    bool kernel_irqchip = false;
+    char *stats_path = NULL;
+    char *snapshot_path = NULL;
+    char *restore_path = NULL;
+    bool restore_lazy = false;
+    char *template_path = NULL;
+    char *clone_path = NULL;
+    char *overlay_path = NULL;
+    char *migrate_path = NULL;
+    char *incoming_path = NULL;
+    char *kernel_path = NULL;
+    char *initrd_path = NULL;
+    char *kernel_cmdline = NULL;
+    bool direct_cdrom = false;
+    memory_config_t memory_config;
+    memory_config_default(&memory_config);
+    int opt;
+    while ((opt = getopt(argc, argv, "c:ks:m:b:tMn:S:r:R:T:C:O:G:i:L:I:A:Ed:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            vcpu_count = atoi(optarg);
+            break;
+        case 'k':
+            kernel_irqchip = true;
+            break;
+        case 's':
+            stats_path = optarg;
+            break;
+        case 'm':
+            if (!memory_parse_size(optarg, &memory_config.size))
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 'b':
+            if (!memory_parse_backend(optarg, &memory_config))
+            {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            memory_config.transparent_hugepages = true;
+            break;
+        case 'M':
+            memory_config.mergeable = true;
+            break;
+        case 'n':
+            memory_config.numa_node = atoi(optarg);
+            break;
+        case 'S':
+            snapshot_path = optarg;
+            break;
+        case 'r':
+        case 'R':
+            restore_path = optarg;
+            restore_lazy = opt == 'R';
+            break;
+        case 'T':
+            template_path = optarg;
+            break;
+        case 'C':
+            clone_path = optarg;
+            break;
+        case 'O':
+            overlay_path = optarg;
+            break;
+        case 'G':
+            migrate_path = optarg;
+            break;
+        case 'i':
+            incoming_path = optarg;
+            break;
+        case 'L':
+            kernel_path = optarg;
+            break;
+        case 'I':
+            initrd_path = optarg;
+            break;
+        case 'A':
+            kernel_cmdline = optarg;
+            break;
+        case 'E':
+            direct_cdrom = true;
+            break;
+        case 'd':
+            if (!block_parse_backend(optarg))
+            {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 3 || (kernel_path == NULL && (initrd_path != NULL || kernel_cmdline != NULL)))
     {
-        errx(1, "Usage: %s <bios> <kernel> <harddisk>", argv[0]);
+        usage(argv[0]);
     }
+    char *bios_path = argv[optind];
+    char *cdrom_path = argv[optind + 1];
+    char *harddisk_path = argv[optind + 2];
 
     signal(SIGINT, handle_sigint);
+    // both block their signal, before anything spawns a thread
+    if (migrate_path != NULL)
+    {
+        snapshot_init(migrate_path, SNAPSHOT_ON_SIGNAL_MIGRATE);
+    }
+    else if (template_path != NULL)
+    {
+        snapshot_init(template_path, SNAPSHOT_ON_SIGNAL_TEMPLATE);
+    }
+    else
+    {
+        snapshot_init(snapshot_path, SNAPSHOT_ON_SIGNAL_SAVE);
+    }
+    stats_init(stats_path);
 
     // gui_init();
     log_init();
-    ata_init_disks(argv[2], argv[3]);
+    // clones overlay the image as the template saw it, so the template vm must not write to it either
+    ata_init_disks(cdrom_path, harddisk_path, clone_path != NULL || template_path != NULL || overlay_path != NULL, overlay_path);
+    if (clone_path != NULL)
+    {
+        snapshot_open_template(clone_path, &memory_config);
+        restore_path = clone_path;
+        restore_lazy = false;
+    }
+    memory_init(&memory_config);
 
-    io_manager_register(cmos_init, cmos_handle, 0x70, 0x71);
-    io_manager_register(NULL, a20_handle, 0x92, 0x92);
-    io_manager_register(pci_init, pci_handle, 0xcf8, 0xcff);
-    io_manager_register(seabios_log_init, seabios_log_handle, 0x402, 0x402);
-    io_manager_register(NULL, seabios_info_handle, 0x510, 0x511);
-    io_manager_register(com_init, com_handle, 0x3f8, 0x3ff);
-    // ignore the other com ports
-    io_manager_register(NULL, null_handle, 0x2f8, 0x2ff);
-    io_manager_register(NULL, null_handle, 0x3e8, 0x3ef);
-    io_manager_register(NULL, null_handle, 0x2e8, 0x2ef);
-    io_manager_register(NULL, dma_handle_master, 0xc0, 0xde);
-    io_manager_register(NULL, dma_handle_slave, 0x00, 0x0f);
-    io_manager_register(pic_init_master, pic_handle_master, 0x20, 0x21);
-    io_manager_register(pic_init_slave, pic_handle_slave, 0xa0, 0xa1);
-    io_manager_register(pit_init, pit_handle, 0x40, 0x43);
-    io_manager_register(ps2_init, ps2_handle, 0x60, 0x60);
-    io_manager_register(NULL, ps2_handle, 0x64, 0x64);
-    io_manager_register(ata_init_primary, ata_handle_io_primary, 0x1f0, 0x1f7);
-    io_manager_register(ata_init_secondary, ata_handle_io_secondary, 0x170, 0x177);
-    io_manager_register(NULL, ata_handle_control_primary, 0x3f6, 0x3f7);
-    io_manager_register(NULL, ata_handle_control_secondary, 0x376, 0x377);
+    // the vm has to exist before the devices so they can query it (e.g. the cmos cpu count)
+    kvm_init(bios_path, vcpu_count, kernel_irqchip);
+
+    io_manager_register_devices(io_devices, sizeof(io_devices) / sizeof(io_devices[0]));
+    // the secondary channel has no drives, its data port has no transfers to speed up
+    io_manager_register_width(ata_handle_data, &ata_primary, 0x1f0, 0x1f0, 2);
+    // output only ports, no need to exit for every byte
+    io_manager_register_coalesced(0x402, 0x402);
+    io_manager_register_coalesced(0x3f8, 0x3f8);
+    if (kvm_get_irqchip_mode() == KVM_IRQCHIP_USERSPACE)
+    {
+        // there is no lapic but seabios still reads its version register
+        mmio_manager_register(null_mmio_handle, NULL, 0xfee00000, 0x1000);
+    }
+    iso_init();
 
-    kvm_init(argv[1]);
+    if (incoming_path != NULL)
+    {
+        migration_receive(incoming_path);
+    }
+    else if (restore_path != NULL)
+    {
+        snapshot_restore(restore_path, restore_lazy);
+    }
+    else if (kernel_path != NULL)
+    {
+        if (!elf_load(kernel_path, initrd_path, kernel_cmdline))
+        {
+            linux_load(kernel_path, initrd_path, kernel_cmdline);
+        }
+    }
+    else if (direct_cdrom)
+    {
+        iso_load();
+    }
     kvm_run();
+    io_manager_deinit();
+    stats_deinit();
     kvm_deinit();
     ata_deinit_disks();
     // gui_deinit();
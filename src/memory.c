@@ -0,0 +1,827 @@
+#define _GNU_SOURCE
+#include "memory.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <sys/stat.h>
+#include <linux/mempolicy.h>
+#include <linux/memfd.h>
+#include "kvm.h"
+#include "common.h"
+
+/*
+Guest RAM is a single host mapping. Below 4G the guest physical address is the offset into it,
+whatever is past the PCI hole is mapped at 4G and continues right after the low part.
+*/
+
+static uint8_t *ram = NULL;
+static uint64_t ram_size = 0;
+static uint64_t ram_below_4g = 0;
+static int ram_fd = -1;
+static uint64_t ram_page_size = PAGE_SIZE;
+static memory_config_t memory_config;
+static memory_region_t regions[MEMORY_MAX_REGIONS];
+static int max_regions = MEMORY_MAX_REGIONS;
+static pthread_mutex_t regions_mutex = PTHREAD_MUTEX_INITIALIZER; // the dirty log walks the regions from another thread
+
+static bool dirty_logging = false;
+static uint64_t *dirty_bitmap = NULL; // pages written from userspace while logging, a bit per page of ram
+
+void memory_config_default(memory_config_t *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->size = MEMORY_DEFAULT_SIZE;
+    config->backend = MEMORY_BACKEND_MEMFD;
+    config->numa_node = -1;
+}
+
+// Accepts a byte count with an optional K/M/G suffix
+bool memory_parse_size(const char *text, uint64_t *size)
+{
+    char *end;
+    uint64_t value = strtoull(text, &end, 0);
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        value <<= 10;
+        // fallthrough
+    case 'M':
+    case 'm':
+        value <<= 10;
+        // fallthrough
+    case 'K':
+    case 'k':
+        value <<= 10;
+        end++;
+        break;
+    }
+    if (end == text || *end != '\0' || value == 0)
+    {
+        return false;
+    }
+    *size = value;
+    return true;
+}
+
+// anon, memfd, memfd:2M, memfd:1G or hugetlbfs:<dir>
+bool memory_parse_backend(const char *text, memory_config_t *config)
+{
+    if (strcmp(text, "anon") == 0)
+    {
+        config->backend = MEMORY_BACKEND_ANONYMOUS;
+    }
+    else if (strcmp(text, "memfd") == 0)
+    {
+        config->backend = MEMORY_BACKEND_MEMFD;
+    }
+    else if (strncmp(text, "memfd:", 6) == 0)
+    {
+        config->backend = MEMORY_BACKEND_MEMFD;
+        if (!memory_parse_size(text + 6, &config->hugepage_size) ||
+            (config->hugepage_size != (2ULL << 20) && config->hugepage_size != (1ULL << 30)))
+        {
+            return false;
+        }
+    }
+    else if (strncmp(text, "hugetlbfs:", 10) == 0 && text[10] != '\0')
+    {
+        config->backend = MEMORY_BACKEND_HUGETLBFS;
+        config->hugetlbfs_path = text + 10;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+static int memory_create_memfd(memory_config_t *config)
+{
+    unsigned int flags = MFD_CLOEXEC;
+    if (config->hugepage_size == (2ULL << 20))
+    {
+        flags |= MFD_HUGETLB | MFD_HUGE_2MB;
+    }
+    else if (config->hugepage_size == (1ULL << 30))
+    {
+        flags |= MFD_HUGETLB | MFD_HUGE_1GB;
+    }
+
+    int fd = memfd_create("guest-ram", flags);
+    if (fd < 0)
+    {
+        err(1, "Failed to create the guest ram memfd");
+    }
+    return fd;
+}
+
+static int memory_create_hugetlbfs(memory_config_t *config)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/guest-ram-XXXXXX", config->hugetlbfs_path);
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd < 0)
+    {
+        err(1, "Failed to create a file under %s", config->hugetlbfs_path);
+    }
+    unlink(path); // only the mapping keeps it alive
+    return fd;
+}
+
+static void memory_bind_node(int node)
+{
+    unsigned long nodemask[16] = {0}; // up to 1024 nodes
+    if (node >= sizeof(nodemask) * 8)
+    {
+        errx(1, "NUMA node %d is out of range", node);
+    }
+    nodemask[node / (sizeof(unsigned long) * 8)] = 1UL << (node % (sizeof(unsigned long) * 8));
+
+    // has to happen before anything touches the memory, pages that are already there are moved
+    if (syscall(SYS_mbind, ram, ram_size, MPOL_BIND, nodemask, sizeof(nodemask) * 8, MPOL_MF_STRICT | MPOL_MF_MOVE) < 0)
+    {
+        err(1, "Failed to bind guest ram to NUMA node %d", node);
+    }
+}
+
+void memory_init(memory_config_t *config)
+{
+    memory_config = *config;
+    ram_size = config->size;
+
+    uint64_t page_size = PAGE_SIZE;
+    if (config->backend == MEMORY_BACKEND_MEMFD && config->hugepage_size != 0)
+    {
+        page_size = config->hugepage_size;
+    }
+    else if (config->backend == MEMORY_BACKEND_HUGETLBFS)
+    {
+        struct statfs fs;
+        if (statfs(config->hugetlbfs_path, &fs) < 0)
+        {
+            err(1, "Failed to stat %s", config->hugetlbfs_path);
+        }
+        page_size = fs.f_bsize; // hugetlbfs reports its page size here
+    }
+    ram_size = (ram_size + page_size - 1) & ~(page_size - 1);
+    ram_page_size = page_size;
+    if (ram_size < 2 * MEMORY_VGA_END)
+    {
+        errx(1, "At least %d KiB of guest ram are needed", 2 * MEMORY_VGA_END / 1024);
+    }
+    ram_below_4g = ram_size < MEMORY_PCI_HOLE_START ? ram_size : MEMORY_PCI_HOLE_START;
+
+    switch (config->backend)
+    {
+    case MEMORY_BACKEND_ANONYMOUS:
+        ram = mmap(NULL, ram_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        break;
+    case MEMORY_BACKEND_MEMFD:
+    case MEMORY_BACKEND_HUGETLBFS:
+        ram_fd = config->backend == MEMORY_BACKEND_MEMFD ? memory_create_memfd(config) : memory_create_hugetlbfs(config);
+        if (ftruncate(ram_fd, ram_size) < 0)
+        {
+            err(1, "Failed to size guest ram");
+        }
+        ram = mmap(NULL, ram_size, PROT_READ | PROT_WRITE, MAP_SHARED, ram_fd, 0);
+        break;
+    case MEMORY_BACKEND_TEMPLATE:
+    {
+        // the clone's writes stay private, ram_fd is left at -1 since the file isn't what the guest sees
+        int fd = open(config->template_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            err(1, "Failed to open %s", config->template_path);
+        }
+        ram = mmap(NULL, ram_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, config->template_offset);
+        close(fd);
+        break;
+    }
+    }
+    if (ram == MAP_FAILED)
+    {
+        err(1, "Failed to map %lu MiB of guest ram", ram_size >> 20);
+    }
+
+    if (config->numa_node >= 0)
+    {
+        memory_bind_node(config->numa_node);
+    }
+    if (config->transparent_hugepages && madvise(ram, ram_size, MADV_HUGEPAGE) < 0)
+    {
+        warn("MADV_HUGEPAGE");
+    }
+    if (config->mergeable)
+    {
+        if (config->backend != MEMORY_BACKEND_ANONYMOUS)
+        {
+            warnx("KSM only merges anonymous memory, use -b anon");
+        }
+        else if (madvise(ram, ram_size, MADV_MERGEABLE) < 0)
+        {
+            warn("MADV_MERGEABLE");
+        }
+    }
+}
+
+// Writable regions on top of the guest ram, the ones the dirty log covers
+static bool memory_is_ram_region(memory_region_t *region)
+{
+    return (uint8_t *)region->hva >= ram && (uint8_t *)region->hva < ram + ram_size && !(region->flags & KVM_MEM_READONLY);
+}
+
+/*
+Dirty logging (for live migration): kvm tracks guest writes per slot, memory_mark_dirty covers whatever
+userspace writes into guest ram itself. Both end up as a bit per page of ram in memory_sync_dirty_log.
+*/
+
+static void memory_mark_dirty_hva(void *hva, uint64_t size)
+{
+    if (!__atomic_load_n(&dirty_logging, __ATOMIC_ACQUIRE) || size == 0)
+    {
+        return;
+    }
+    uint64_t first = ((uint8_t *)hva - ram) / PAGE_SIZE;
+    uint64_t last = ((uint8_t *)hva - ram + size - 1) / PAGE_SIZE;
+    for (uint64_t page = first; page <= last; page++)
+    {
+        __atomic_fetch_or(&dirty_bitmap[page / 64], 1ULL << (page % 64), __ATOMIC_RELAXED);
+    }
+}
+
+// For anything that writes guest ram behind kvm's back (device emulation, DMA)
+void memory_mark_dirty(uint64_t gpa, uint64_t size)
+{
+    void *hva = memory_gpa_to_hva(gpa, size);
+    if (hva != NULL)
+    {
+        memory_mark_dirty_hva(hva, size);
+    }
+}
+
+uint64_t memory_dirty_bitmap_words()
+{
+    return (ram_size / PAGE_SIZE + 63) / 64;
+}
+
+static void memory_set_region(int slot)
+{
+    memory_region_t *region = &regions[slot];
+    struct kvm_userspace_memory_region kvm_region = {
+        .slot = slot,
+        .guest_phys_addr = region->gpa,
+        .memory_size = region->size,
+        .userspace_addr = (uint64_t)region->hva,
+        .flags = region->flags};
+    kvm_set_userspace_memory_region(&kvm_region);
+}
+
+// Slot n of the vm is regions[n]
+int memory_add_region(uint64_t gpa, uint64_t size, void *hva, uint32_t flags)
+{
+    pthread_mutex_lock(&regions_mutex);
+    for (int slot = 0; slot < max_regions; slot++)
+    {
+        if (!regions[slot].used)
+        {
+            regions[slot] = (memory_region_t){.used = true, .gpa = gpa, .size = size, .hva = hva, .flags = flags};
+            if (dirty_logging && memory_is_ram_region(&regions[slot]))
+            {
+                regions[slot].flags |= KVM_MEM_LOG_DIRTY_PAGES;
+            }
+            memory_set_region(slot);
+            pthread_mutex_unlock(&regions_mutex);
+            return slot;
+        }
+    }
+    errx(1, "Out of memory slots");
+}
+
+static void memory_set_dirty_logging(bool enable)
+{
+    pthread_mutex_lock(&regions_mutex);
+    if (enable && dirty_bitmap == NULL)
+    {
+        dirty_bitmap = calloc(memory_dirty_bitmap_words(), sizeof(uint64_t));
+        if (dirty_bitmap == NULL)
+        {
+            err(1, "Failed to allocate the dirty bitmap");
+        }
+    }
+    else if (enable)
+    {
+        memset(dirty_bitmap, 0, memory_dirty_bitmap_words() * sizeof(uint64_t));
+    }
+    __atomic_store_n(&dirty_logging, enable, __ATOMIC_RELEASE);
+
+    // changing only the flags of a slot keeps it in place
+    for (int slot = 0; slot < max_regions; slot++)
+    {
+        if (regions[slot].used && memory_is_ram_region(&regions[slot]))
+        {
+            regions[slot].flags = enable ? regions[slot].flags | KVM_MEM_LOG_DIRTY_PAGES : regions[slot].flags & ~KVM_MEM_LOG_DIRTY_PAGES;
+            memory_set_region(slot);
+        }
+    }
+    pthread_mutex_unlock(&regions_mutex);
+}
+
+void memory_start_dirty_log()
+{
+    memory_set_dirty_logging(true);
+}
+
+void memory_stop_dirty_log()
+{
+    memory_set_dirty_logging(false);
+}
+
+// ORs every page written since the last call into bitmap (memory_dirty_bitmap_words long, a bit per page of ram)
+void memory_sync_dirty_log(uint64_t *bitmap)
+{
+    pthread_mutex_lock(&regions_mutex);
+    for (int slot = 0; slot < max_regions; slot++)
+    {
+        memory_region_t *region = &regions[slot];
+        if (!region->used || !(region->flags & KVM_MEM_LOG_DIRTY_PAGES))
+        {
+            continue;
+        }
+        uint64_t pages = region->size / PAGE_SIZE;
+        uint64_t *log = calloc((pages + 63) / 64, sizeof(uint64_t));
+        if (log == NULL)
+        {
+            err(1, "Failed to allocate a dirty log");
+        }
+        struct kvm_dirty_log dirty_log = {.slot = slot, .dirty_bitmap = log};
+        if (ioctl(kvm_get_vm_fd(), KVM_GET_DIRTY_LOG, &dirty_log) < 0)
+        {
+            err(1, "KVM_GET_DIRTY_LOG");
+        }
+
+        uint64_t first = ((uint8_t *)region->hva - ram) / PAGE_SIZE;
+        for (uint64_t word = 0; word < (pages + 63) / 64; word++)
+        {
+            for (uint64_t bits = log[word]; bits != 0; bits &= bits - 1)
+            {
+                uint64_t page = first + word * 64 + __builtin_ctzll(bits);
+                bitmap[page / 64] |= 1ULL << (page % 64);
+            }
+        }
+        free(log);
+    }
+    pthread_mutex_unlock(&regions_mutex);
+
+    for (uint64_t word = 0; word < memory_dirty_bitmap_words(); word++)
+    {
+        bitmap[word] |= __atomic_exchange_n(&dirty_bitmap[word], 0, __ATOMIC_ACQ_REL);
+    }
+}
+
+void memory_remove_region(int slot)
+{
+    pthread_mutex_lock(&regions_mutex);
+    // whatever kvm logged for the slot goes with it, so all of it counts as dirty
+    if (regions[slot].flags & KVM_MEM_LOG_DIRTY_PAGES)
+    {
+        memory_mark_dirty_hva(regions[slot].hva, regions[slot].size);
+    }
+    // a size of 0 deletes the slot
+    struct kvm_userspace_memory_region region = {.slot = slot};
+    kvm_set_userspace_memory_region(&region);
+    regions[slot].used = false;
+    pthread_mutex_unlock(&regions_mutex);
+}
+
+memory_region_t *memory_get_region(int slot)
+{
+    if (slot < 0 || slot >= max_regions || !regions[slot].used)
+    {
+        return NULL;
+    }
+    return &regions[slot];
+}
+
+// Maps a ROM image straight from the page cache, every vm using the same file shares the pages
+void *memory_map_rom(const char *path, uint64_t *size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        err(1, "Failed to open %s", path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        err(1, "Failed to stat %s", path);
+    }
+    if (st.st_size == 0 || st.st_size % PAGE_SIZE != 0)
+    {
+        errx(1, "%s has to be a non empty multiple of 4K", path);
+    }
+
+    void *rom = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (rom == MAP_FAILED)
+    {
+        err(1, "Failed to map %s", path);
+    }
+    close(fd);
+    *size = st.st_size;
+    return rom;
+}
+
+// Registers the ram with the vm. 640K-768K stays unmapped for vga and 768K-1M belongs to the PAM window.
+void memory_map()
+{
+    int capacity = kvm_check_extension(KVM_CAP_NR_MEMSLOTS);
+    max_regions = capacity > 0 && capacity < MEMORY_MAX_REGIONS ? capacity : MEMORY_MAX_REGIONS;
+    if (kvm_check_extension(KVM_CAP_READONLY_MEM) <= 0)
+    {
+        errx(1, "KVM_CAP_READONLY_MEM is required for ROM regions");
+    }
+
+    memory_add_region(0, MEMORY_VGA_START, ram, 0);
+    memory_add_region(MEMORY_SHADOW_END, ram_below_4g - MEMORY_SHADOW_END, ram + MEMORY_SHADOW_END, 0);
+    if (ram_size > ram_below_4g)
+    {
+        memory_add_region(MEMORY_4G, ram_size - ram_below_4g, ram + ram_below_4g, 0);
+    }
+}
+
+/*
+i440FX PAM: 0xF0000-0xFFFFF is controlled by the high nibble of PAM0, PAM1-PAM6 split 0xC0000-0xEFFFF into 16K segments,
+low nibble first. Per segment: 0 - everything goes to ROM, 1 - reads from ram, writes to ROM,
+2 - reads from ROM, writes to ram, 3 - plain ram.
+The ROM behind the window is the end of the BIOS image, like the isa-bios alias on real boards.
+*/
+
+#define PAM_SEGMENTS 13
+#define PAM_READ_RAM 1
+#define PAM_WRITE_RAM 2
+
+typedef struct
+{
+    uint64_t gpa;
+    uint64_t size;
+    void *hva;
+    uint32_t flags;
+} memory_pam_run_t;
+
+static uint8_t *bios = NULL;
+static uint64_t bios_size = 0;
+static uint8_t pam_modes[PAM_SEGMENTS] = {0};
+static memory_pam_run_t pam_runs[PAM_SEGMENTS];
+static int pam_slots[PAM_SEGMENTS];
+static int pam_run_count = 0;
+
+static uint64_t memory_pam_segment_start(int segment)
+{
+    return segment == 0 ? 0xF0000 : MEMORY_SHADOW_START + (segment - 1) * 0x4000;
+}
+
+static uint64_t memory_pam_segment_size(int segment)
+{
+    return segment == 0 ? 0x10000 : 0x4000;
+}
+
+static int memory_pam_segment(uint64_t gpa)
+{
+    if (gpa < MEMORY_SHADOW_START || gpa >= MEMORY_SHADOW_END)
+    {
+        return -1;
+    }
+    return gpa >= 0xF0000 ? 0 : (gpa - MEMORY_SHADOW_START) / 0x4000 + 1;
+}
+
+// The part of the BIOS that shows up under 1M, NULL for segments it doesn't reach
+static void *memory_pam_rom(uint64_t gpa, uint64_t size)
+{
+    uint64_t alias = bios_size < MEMORY_SHADOW_END - MEMORY_SHADOW_START ? bios_size : MEMORY_SHADOW_END - MEMORY_SHADOW_START;
+    if (bios == NULL || gpa < MEMORY_SHADOW_END - alias)
+    {
+        return NULL;
+    }
+    return bios + bios_size - (MEMORY_SHADOW_END - gpa);
+}
+
+static void memory_apply_pam()
+{
+    // segments in address order, merged wherever both the guest and the host side are contiguous
+    memory_pam_run_t runs[PAM_SEGMENTS];
+    int run_count = 0;
+    for (int i = 1; i <= PAM_SEGMENTS; i++)
+    {
+        int segment = i % PAM_SEGMENTS;
+        uint64_t gpa = memory_pam_segment_start(segment);
+        uint64_t size = memory_pam_segment_size(segment);
+        void *rom = memory_pam_rom(gpa, size);
+
+        memory_pam_run_t run = {.gpa = gpa, .size = size, .hva = ram + gpa, .flags = 0};
+        if (rom != NULL && !(pam_modes[segment] & PAM_READ_RAM))
+        {
+            run.hva = rom;
+            run.flags = KVM_MEM_READONLY;
+        }
+        else if (rom != NULL && !(pam_modes[segment] & PAM_WRITE_RAM))
+        {
+            run.flags = KVM_MEM_READONLY;
+        }
+
+        memory_pam_run_t *last = run_count > 0 ? &runs[run_count - 1] : NULL;
+        if (last != NULL && last->gpa + last->size == run.gpa && (uint8_t *)last->hva + last->size == run.hva && last->flags == run.flags)
+        {
+            last->size += run.size;
+        }
+        else
+        {
+            runs[run_count++] = run;
+        }
+    }
+
+    // keep the slots that didn't change, so a vcpu never sees those addresses disappear
+    bool kept[PAM_SEGMENTS] = {false};
+    int slots[PAM_SEGMENTS];
+    for (int i = 0; i < pam_run_count; i++)
+    {
+        bool found = false;
+        for (int j = 0; j < run_count; j++)
+        {
+            if (!kept[j] && memcmp(&pam_runs[i], &runs[j], sizeof(memory_pam_run_t)) == 0)
+            {
+                kept[j] = found = true;
+                slots[j] = pam_slots[i];
+                break;
+            }
+        }
+        if (!found)
+        {
+            memory_remove_region(pam_slots[i]);
+        }
+    }
+    for (int j = 0; j < run_count; j++)
+    {
+        if (!kept[j])
+        {
+            slots[j] = memory_add_region(runs[j].gpa, runs[j].size, runs[j].hva, runs[j].flags);
+        }
+    }
+
+    memcpy(pam_runs, runs, sizeof(runs));
+    memcpy(pam_slots, slots, sizeof(slots));
+    pam_run_count = run_count;
+}
+
+void memory_set_pam(uint8_t pam[MEMORY_PAM_REGISTERS])
+{
+    uint8_t modes[PAM_SEGMENTS];
+    modes[0] = (pam[0] >> 4) & 3;
+    for (int i = 1; i < MEMORY_PAM_REGISTERS; i++)
+    {
+        modes[2 * i - 1] = pam[i] & 3;
+        modes[2 * i] = (pam[i] >> 4) & 3;
+    }
+    if (memcmp(modes, pam_modes, sizeof(modes)) == 0)
+    {
+        return;
+    }
+    memcpy(pam_modes, modes, sizeof(modes));
+    memory_apply_pam();
+}
+
+// The BIOS sits right below 4G read only, and its end is what the PAM window shows until the BIOS shadows itself
+void memory_map_bios(const char *path)
+{
+    bios = memory_map_rom(path, &bios_size);
+    if (bios_size > MEMORY_4G - MEMORY_PCI_HOLE_START)
+    {
+        errx(1, "%s is too big for a BIOS", path);
+    }
+    memory_add_region(MEMORY_4G - bios_size, bios_size, bios, KVM_MEM_READONLY);
+    memory_apply_pam();
+}
+
+// Writes into read only regions end up here. Only PAM write-to-ram segments keep them, everything else is dropped like on a ROM.
+bool memory_handle_mmio(uint64_t gpa, uint8_t *data, uint32_t length, bool is_write)
+{
+    // a PAM write on another vcpu removes and adds slots meanwhile
+    pthread_mutex_lock(&regions_mutex);
+    for (int slot = 0; slot < max_regions; slot++)
+    {
+        memory_region_t *region = &regions[slot];
+        if (!region->used || !(region->flags & KVM_MEM_READONLY) || gpa < region->gpa || gpa + length > region->gpa + region->size)
+        {
+            continue;
+        }
+        if (is_write)
+        {
+            int segment = memory_pam_segment(gpa);
+            if (segment >= 0 && (pam_modes[segment] & PAM_WRITE_RAM))
+            {
+                memcpy(ram + gpa, data, length);
+                memory_mark_dirty(gpa, length);
+            }
+        }
+        else
+        {
+            memcpy(data, (uint8_t *)region->hva + (gpa - region->gpa), length); // kvm doesn't exit on these, just in case
+        }
+        pthread_mutex_unlock(&regions_mutex);
+        return true;
+    }
+    pthread_mutex_unlock(&regions_mutex);
+    return false;
+}
+
+void memory_deinit()
+{
+    if (ram != NULL)
+    {
+        munmap(ram, ram_size);
+        ram = NULL;
+    }
+    if (ram_fd >= 0)
+    {
+        close(ram_fd);
+        ram_fd = -1;
+    }
+}
+
+// Ram offsets aren't guest physical addresses past the PCI hole, see memory_gpa_to_hva
+uint8_t *memory_get_ram()
+{
+    return ram;
+}
+
+// Throws away the contents of all of ram, it reads as zero afterwards (as the template for a clone)
+void memory_discard()
+{
+    if (madvise(ram, ram_size, ram_fd >= 0 ? MADV_REMOVE : MADV_DONTNEED) < 0)
+    {
+        err(1, "Failed to discard guest ram");
+    }
+}
+
+bool memory_is_template()
+{
+    return memory_config.backend == MEMORY_BACKEND_TEMPLATE;
+}
+
+uint64_t memory_get_page_size()
+{
+    return ram_page_size;
+}
+
+// -1 for anonymous memory
+int memory_get_fd()
+{
+    return ram_fd;
+}
+
+uint64_t memory_get_size()
+{
+    return ram_size;
+}
+
+uint64_t memory_get_below_4g()
+{
+    return ram_below_4g;
+}
+
+uint64_t memory_get_above_4g()
+{
+    return ram_size - ram_below_4g;
+}
+
+// NULL unless all of [gpa, gpa + size) is ram
+void *memory_gpa_to_hva(uint64_t gpa, uint64_t size)
+{
+    if (gpa + size < gpa)
+    {
+        return NULL;
+    }
+    if (gpa + size <= ram_below_4g)
+    {
+        if (gpa < MEMORY_VGA_END && gpa + size > MEMORY_VGA_START)
+        {
+            return NULL;
+        }
+        return ram + gpa;
+    }
+    if (gpa >= MEMORY_4G && gpa + size <= MEMORY_4G + memory_get_above_4g())
+    {
+        return ram + ram_below_4g + (gpa - MEMORY_4G);
+    }
+    return NULL;
+}
+
+/*
+Device DMA: everything a device model reads or writes in guest ram goes through here instead of poking at
+memory_gpa_to_hva itself, so writes are always marked dirty for migration and snapshots. A mapping is the zero copy
+path (e.g. the disk backend reading straight into a PRD buffer), it's marked on unmap since a page marked before
+the write lands could be sent without it. The scatter gather copies are for devices that bounce a transfer through
+a buffer of their own. Translation is plain arithmetic on the single ram mapping, there are no
+slots to walk and so nothing worth caching in front of it.
+*/
+
+// NULL unless all of [gpa, gpa + size) is ram, hand it back with memory_dma_unmap once done
+void *memory_dma_map(uint64_t gpa, uint64_t size)
+{
+    return memory_gpa_to_hva(gpa, size);
+}
+
+void memory_dma_unmap(void *hva, uint64_t size, bool written)
+{
+    if (written)
+    {
+        memory_mark_dirty_hva(hva, size);
+    }
+}
+
+// Guest to device, false (and nothing copied) unless it is all ram
+bool memory_dma_read(uint64_t gpa, void *data, uint64_t size)
+{
+    void *hva = memory_dma_map(gpa, size);
+    if (hva == NULL)
+    {
+        return false;
+    }
+    memcpy(data, hva, size);
+    memory_dma_unmap(hva, size, false);
+    return true;
+}
+
+// Device to guest
+bool memory_dma_write(uint64_t gpa, const void *data, uint64_t size)
+{
+    void *hva = memory_dma_map(gpa, size);
+    if (hva == NULL)
+    {
+        return false;
+    }
+    memcpy(hva, data, size);
+    memory_dma_unmap(hva, size, true);
+    return true;
+}
+
+// Between a flat buffer and a scatter gather list, starting offset bytes into the list. Returns the bytes
+// copied, short if the list runs out or an entry isn't ram.
+static uint64_t memory_dma_sg(const memory_sg_t *sg, int count, uint64_t offset, void *data, uint64_t size, bool to_guest)
+{
+    uint64_t done = 0;
+    for (int i = 0; i < count && done < size; i++)
+    {
+        if (offset >= sg[i].size)
+        {
+            offset -= sg[i].size;
+            continue;
+        }
+        uint64_t length = sg[i].size - offset < size - done ? sg[i].size - offset : size - done;
+        bool ok = to_guest ? memory_dma_write(sg[i].gpa + offset, (uint8_t *)data + done, length) : memory_dma_read(sg[i].gpa + offset, (uint8_t *)data + done, length);
+        if (!ok)
+        {
+            break;
+        }
+        done += length;
+        offset = 0;
+    }
+    return done;
+}
+
+uint64_t memory_dma_sg_read(const memory_sg_t *sg, int count, uint64_t offset, void *data, uint64_t size)
+{
+    return memory_dma_sg(sg, count, offset, data, size, false);
+}
+
+uint64_t memory_dma_sg_write(const memory_sg_t *sg, int count, uint64_t offset, const void *data, uint64_t size)
+{
+    return memory_dma_sg(sg, count, offset, (void *)data, size, true);
+}
+
+static void memory_add_map_entry(memory_map_entry_t *entries, int *count, uint64_t gpa, uint64_t size, uint32_t type)
+{
+    if (size != 0)
+    {
+        entries[(*count)++] = (memory_map_entry_t){.gpa = gpa, .size = size, .type = type};
+    }
+}
+
+// The same map seabios would report: low ram, the BIOS areas reserved, and ram around the PCI hole
+int memory_get_map(memory_map_entry_t entries[MEMORY_MAP_ENTRIES])
+{
+    int count = 0;
+    memory_add_map_entry(entries, &count, 0, MEMORY_EBDA_START, MEMORY_MAP_RAM);
+    memory_add_map_entry(entries, &count, MEMORY_EBDA_START, MEMORY_VGA_START - MEMORY_EBDA_START, MEMORY_MAP_RESERVED);
+    memory_add_map_entry(entries, &count, MEMORY_BIOS_START, MEMORY_SHADOW_END - MEMORY_BIOS_START, MEMORY_MAP_RESERVED);
+    memory_add_map_entry(entries, &count, MEMORY_SHADOW_END, ram_below_4g - MEMORY_SHADOW_END, MEMORY_MAP_RAM);
+    memory_add_map_entry(entries, &count, MEMORY_4G, memory_get_above_4g(), MEMORY_MAP_RAM);
+    return count;
+}
@@ -0,0 +1,396 @@
+#define _GNU_SOURCE
+#include "migration.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include "kvm.h"
+#include "memory.h"
+#include "io_manager.h"
+#include "snapshot.h"
+#include "common.h"
+#include "components/ata.h"
+
+#define MIGRATION_MAX_ROUNDS 30
+#define MIGRATION_CONVERGED_PAGES 256        // pause once a round leaves fewer dirty pages than this (1 MiB)
+#define MIGRATION_MAX_RUN (256 * PAGE_SIZE) // biggest MIGRATION_PAGES message
+
+static uint64_t migration_now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static bool migration_send_all(int fd, const void *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t bytes = send(fd, data, size, MSG_NOSIGNAL);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return false;
+        }
+        data = (const uint8_t *)data + bytes;
+        size -= bytes;
+    }
+    return true;
+}
+
+static bool migration_recv_all(int fd, void *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t bytes = recv(fd, data, size, MSG_WAITALL);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return false;
+        }
+        data = (uint8_t *)data + bytes;
+        size -= bytes;
+    }
+    return true;
+}
+
+static bool migration_send_message(int fd, uint32_t type, uint64_t offset, uint64_t length, const void *data)
+{
+    migration_message_t message = {.type = type, .offset = offset, .length = length};
+    return migration_send_all(fd, &message, sizeof(message)) && (data == NULL || migration_send_all(fd, data, length));
+}
+
+#pragma region SEND
+
+typedef struct
+{
+    int fd;
+    uint64_t bytes; // ram bytes that went over the socket
+    uint64_t start; // the run being collected
+    uint64_t length;
+    bool zero;
+} migration_sender_t;
+
+static bool migration_flush_run(migration_sender_t *sender)
+{
+    if (sender->length == 0)
+    {
+        return true;
+    }
+    bool ok;
+    if (sender->zero)
+    {
+        ok = migration_send_message(sender->fd, MIGRATION_ZERO, sender->start, sender->length, NULL);
+    }
+    else
+    {
+        ok = migration_send_message(sender->fd, MIGRATION_PAGES, sender->start, sender->length, memory_get_ram() + sender->start);
+        sender->bytes += sender->length;
+    }
+    sender->length = 0;
+    return ok;
+}
+
+static bool migration_is_zero(const uint8_t *page)
+{
+    const uint64_t *words = (const uint64_t *)page;
+    for (int i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+    {
+        if (words[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Sends and clears every page set in bitmap. Zero pages are only sent as a range, and not at all with skip_zero.
+static bool migration_send_pages(migration_sender_t *sender, uint64_t *bitmap, bool skip_zero)
+{
+    uint8_t *ram = memory_get_ram();
+    for (uint64_t word = 0; word < memory_dirty_bitmap_words(); word++)
+    {
+        for (uint64_t bits = bitmap[word]; bits != 0; bits &= bits - 1)
+        {
+            uint64_t offset = (word * 64 + __builtin_ctzll(bits)) * PAGE_SIZE;
+            bool zero = migration_is_zero(ram + offset);
+            if (zero && skip_zero)
+            {
+                continue;
+            }
+            bool extends = sender->length != 0 && sender->start + sender->length == offset && sender->zero == zero;
+            if (!extends || sender->length == MIGRATION_MAX_RUN)
+            {
+                if (!migration_flush_run(sender))
+                {
+                    return false;
+                }
+                sender->start = offset;
+            }
+            sender->length += PAGE_SIZE;
+        }
+        bitmap[word] = 0;
+    }
+    return migration_flush_run(sender);
+}
+
+// The first round: all of ram except the holes of a memfd, which nobody has written yet
+static void migration_mark_data(uint64_t *bitmap)
+{
+    uint64_t ram_size = memory_get_size();
+    int ram_fd = memory_get_fd();
+    off_t data = 0;
+    while (data < ram_size)
+    {
+        off_t hole = ram_size;
+        if (ram_fd >= 0)
+        {
+            data = lseek(ram_fd, data, SEEK_DATA);
+            if (data < 0)
+            {
+                break;
+            }
+            hole = lseek(ram_fd, data, SEEK_HOLE);
+            if (hole < 0 || hole > ram_size)
+            {
+                hole = ram_size;
+            }
+        }
+        for (uint64_t page = data / PAGE_SIZE; page < (hole + PAGE_SIZE - 1) / PAGE_SIZE; page++)
+        {
+            bitmap[page / 64] |= 1ULL << (page % 64);
+        }
+        data = hole;
+    }
+}
+
+static uint64_t migration_count(uint64_t *bitmap)
+{
+    uint64_t count = 0;
+    for (uint64_t word = 0; word < memory_dirty_bitmap_words(); word++)
+    {
+        count += __builtin_popcountll(bitmap[word]);
+    }
+    return count;
+}
+
+static bool migration_send_state(int fd)
+{
+    int state_fd = memfd_create("migration", MFD_CLOEXEC);
+    if (state_fd < 0)
+    {
+        warn("Failed to create the migration state");
+        return false;
+    }
+    snapshot_save_state(state_fd);
+    off_t size = lseek(state_fd, 0, SEEK_END);
+    bool ok = migration_send_message(fd, MIGRATION_STATE, 0, size, NULL);
+    off_t offset = 0;
+    while (ok && offset < size)
+    {
+        ssize_t bytes = sendfile(fd, state_fd, &offset, size - offset);
+        ok = bytes > 0 || (bytes < 0 && errno == EINTR);
+    }
+    close(state_fd);
+    return ok;
+}
+
+// true once the guest runs at the other end, the caller has to stop this vmm then. On false the guest keeps running here.
+bool migration_send(const char *socket_path)
+{
+    uint64_t start = migration_now_ms();
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        warn("Failed to connect to %s", socket_path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    migration_header_t header = {.magic = MIGRATION_MAGIC, .version = MIGRATION_VERSION, .ram_size = memory_get_size()};
+    migration_sender_t sender = {.fd = fd};
+    uint64_t *bitmap = calloc(memory_dirty_bitmap_words(), sizeof(uint64_t));
+    if (bitmap == NULL)
+    {
+        err(1, "Failed to allocate the dirty bitmap");
+    }
+
+    // logging starts before the first round reads anything, so every later write shows up
+    memory_start_dirty_log();
+    migration_mark_data(bitmap);
+    bool ok = migration_send_all(fd, &header, sizeof(header));
+    int round = 0;
+    uint64_t dirty = 0;
+    while (ok)
+    {
+        ok = migration_send_pages(&sender, bitmap, round == 0);
+        memory_sync_dirty_log(bitmap);
+        dirty = migration_count(bitmap);
+        round++;
+        if (dirty < MIGRATION_CONVERGED_PAGES || round >= MIGRATION_MAX_ROUNDS)
+        {
+            break;
+        }
+    }
+
+    // stop and copy
+    uint64_t pause_start = migration_now_ms();
+    kvm_pause();
+    ata_pause_workers(); // no command or dma may still be running during the last pass
+    io_manager_drain_coalesced();
+    io_manager_lock();
+    if (ok)
+    {
+        memory_sync_dirty_log(bitmap);
+        dirty = migration_count(bitmap);
+        ok = migration_send_pages(&sender, bitmap, false) && migration_send_state(fd) &&
+             migration_send_message(fd, MIGRATION_END, 0, 0, NULL);
+    }
+    uint8_t ack = 0;
+    ok = ok && migration_recv_all(fd, &ack, sizeof(ack)) && ack == 1;
+    memory_stop_dirty_log();
+    free(bitmap);
+    close(fd);
+
+    if (!ok)
+    {
+        io_manager_unlock();
+        ata_resume_workers();
+        kvm_resume();
+        warnx("Migration to %s failed, the guest keeps running here", socket_path);
+        return false;
+    }
+    printf("Migrated %lu KiB of ram in %d rounds and %lu ms, the guest was paused for %lu ms (%lu pages in the last round)\n",
+           sender.bytes >> 10, round + 1, migration_now_ms() - start, migration_now_ms() - pause_start, dirty);
+    return true;
+}
+
+#pragma endregion
+
+#pragma region RECEIVE
+
+static void migration_receive_state(int fd, uint64_t length)
+{
+    int state_fd = memfd_create("migration", MFD_CLOEXEC);
+    if (state_fd < 0)
+    {
+        err(1, "Failed to create the migration state");
+    }
+    uint8_t buffer[0x10000];
+    while (length > 0)
+    {
+        size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+        if (!migration_recv_all(fd, buffer, chunk) || write(state_fd, buffer, chunk) != chunk)
+        {
+            errx(1, "Lost the migration state");
+        }
+        length -= chunk;
+    }
+    snapshot_restore_state(state_fd);
+    close(state_fd);
+}
+
+// Like snapshot_restore: after the device inits, before kvm_run. Blocks until a guest has come in.
+void migration_receive(const char *socket_path)
+{
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+    unlink(socket_path);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 1) < 0)
+    {
+        err(1, "Failed to listen on %s", socket_path);
+    }
+    printf("Waiting for a migration on %s\n", socket_path);
+    int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+        err(1, "Failed to accept a migration");
+    }
+    close(listener);
+    unlink(socket_path);
+
+    uint64_t start = migration_now_ms();
+    migration_header_t header;
+    if (!migration_recv_all(fd, &header, sizeof(header)) || memcmp(header.magic, MIGRATION_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != MIGRATION_VERSION)
+    {
+        errx(1, "Not a version %d migration stream", MIGRATION_VERSION);
+    }
+    if (header.ram_size != memory_get_size())
+    {
+        errx(1, "The incoming guest has %lu MiB of ram", header.ram_size >> 20);
+    }
+
+    // the sender leaves out zero pages in its first round
+    memory_discard();
+    uint8_t *ram = memory_get_ram();
+    uint64_t bytes = 0;
+    while (1)
+    {
+        migration_message_t message;
+        if (!migration_recv_all(fd, &message, sizeof(message)))
+        {
+            errx(1, "The migration stream ended early");
+        }
+        if ((message.type == MIGRATION_PAGES || message.type == MIGRATION_ZERO) &&
+            (message.offset + message.length > header.ram_size || message.offset + message.length < message.offset))
+        {
+            errx(1, "Migration pages outside of ram");
+        }
+
+        if (message.type == MIGRATION_PAGES)
+        {
+            if (!migration_recv_all(fd, ram + message.offset, message.length))
+            {
+                errx(1, "The migration stream ended early");
+            }
+            bytes += message.length;
+        }
+        else if (message.type == MIGRATION_ZERO)
+        {
+            memset(ram + message.offset, 0, message.length);
+        }
+        else if (message.type == MIGRATION_STATE)
+        {
+            migration_receive_state(fd, message.length);
+        }
+        else if (message.type == MIGRATION_END)
+        {
+            break;
+        }
+        else
+        {
+            errx(1, "Unknown migration message %u", message.type);
+        }
+    }
+
+    uint8_t ack = 1;
+    if (!migration_send_all(fd, &ack, sizeof(ack)))
+    {
+        errx(1, "The sender went away before the guest started here");
+    }
+    close(fd);
+    printf("Received %lu KiB of ram in %lu ms\n", bytes >> 10, migration_now_ms() - start);
+}
+
+#pragma endregion
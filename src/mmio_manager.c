@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <err.h>
+#include "mmio_manager.h"
+#include "io_manager.h"
+#include "log.h"
+#include "stats.h"
+
+LOG_DEFINE("mmio_manager");
+
+/*
+Guest physical ranges of devices, the MMIO counterpart of io_manager.
+Mapped regions are kept sorted by address in lookup so an exit is a binary search, and most exits hit the same
+region as the last one, which is checked first. Everything runs under the io_manager lock since the devices behind
+these ranges are the same non thread safe models, and BARs only move from inside a port handler anyway.
+*/
+
+typedef struct
+{
+    mmio_handle_t handle;
+    void *opaque;
+    uint64_t gpa; // MMIO_UNMAPPED while e.g. memory decoding of its PCI device is off
+    uint64_t size;
+} mmio_region_t;
+
+static mmio_region_t regions[MMIO_MAX_REGIONS];
+static int region_count = 0;
+
+static mmio_region_t *lookup[MMIO_MAX_REGIONS];
+static int lookup_count = 0;
+static mmio_region_t *last_hit = NULL;
+
+// Only on register and move, so a plain insertion sort is plenty
+static void mmio_manager_rebuild_lookup()
+{
+    lookup_count = 0;
+    for (int i = 0; i < region_count; i++)
+    {
+        mmio_region_t *region = &regions[i];
+        if (region->gpa == MMIO_UNMAPPED)
+        {
+            continue;
+        }
+        int position = lookup_count++;
+        while (position > 0 && lookup[position - 1]->gpa > region->gpa)
+        {
+            lookup[position] = lookup[position - 1];
+            position--;
+        }
+        lookup[position] = region;
+    }
+    for (int i = 1; i < lookup_count; i++)
+    {
+        if (lookup[i - 1]->gpa + lookup[i - 1]->size > lookup[i]->gpa)
+        {
+            // the guest is free to program overlapping BARs, accesses then go to the one starting closest below
+            LOG_MSG("mmio region at 0x%lx overlaps the one at 0x%lx", lookup[i]->gpa, lookup[i - 1]->gpa);
+        }
+    }
+    last_hit = NULL;
+}
+
+// Returns an id for mmio_manager_move. gpa may be MMIO_UNMAPPED for a region that is mapped later.
+int mmio_manager_register(mmio_handle_t handle, void *opaque, uint64_t gpa, uint64_t size)
+{
+    if (region_count == MMIO_MAX_REGIONS)
+    {
+        errx(1, "Too many mmio regions");
+    }
+    if (size == 0 || (gpa != MMIO_UNMAPPED && gpa + size < gpa))
+    {
+        errx(1, "Invalid mmio region 0x%lx+0x%lx", gpa, size);
+    }
+    int id = region_count++;
+    regions[id] = (mmio_region_t){.handle = handle, .opaque = opaque, .gpa = gpa, .size = size};
+    mmio_manager_rebuild_lookup();
+    return id;
+}
+
+// Remaps a region, e.g. when the guest reprograms a BAR. MMIO_UNMAPPED removes it until the next move.
+void mmio_manager_move(int id, uint64_t gpa)
+{
+    if (id < 0 || id >= region_count)
+    {
+        errx(1, "Invalid mmio region id %d", id);
+    }
+    if (regions[id].gpa == gpa)
+    {
+        return;
+    }
+    regions[id].gpa = gpa;
+    mmio_manager_rebuild_lookup();
+}
+
+static mmio_region_t *mmio_manager_find(uint64_t gpa)
+{
+    if (last_hit != NULL && gpa - last_hit->gpa < last_hit->size)
+    {
+        return last_hit;
+    }
+    // the last region that starts at or below gpa
+    int low = 0;
+    int high = lookup_count - 1;
+    mmio_region_t *candidate = NULL;
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        if (lookup[middle]->gpa <= gpa)
+        {
+            candidate = lookup[middle];
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    if (candidate == NULL || gpa - candidate->gpa >= candidate->size)
+    {
+        return NULL;
+    }
+    last_hit = candidate;
+    return candidate;
+}
+
+// false if no device claims gpa
+bool mmio_manager_handle(uint64_t gpa, uint8_t *data, uint32_t length, bool is_write)
+{
+    io_manager_lock();
+    mmio_region_t *region = mmio_manager_find(gpa);
+    if (region == NULL)
+    {
+        io_manager_unlock();
+        return false;
+    }
+    uint64_t start = stats_now();
+    region->handle(region->opaque, gpa - region->gpa, data, length, is_write);
+    stats_record_handler((void *)region->handle, start);
+    io_manager_unlock();
+    return true;
+}
@@ -0,0 +1,1234 @@
+#define _GNU_SOURCE
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#include <zlib.h>
+#include "kvm.h"
+#include "memory.h"
+#include "io_manager.h"
+#include "common.h"
+#include "migration.h"
+#include "components/ata.h"
+
+#define SNAPSHOT_MAX_DEVICES 64
+#define SNAPSHOT_MAX_WORKERS 16
+#define SNAPSHOT_WINDOW_PER_WORKER 4 // compressed chunks allowed to wait for the writer, per worker
+
+typedef struct
+{
+    char name[SNAPSHOT_NAME_SIZE];
+    uint32_t version;
+    void *state;
+    size_t size;
+    snapshot_post_load_t post_load;
+} snapshot_device_t;
+
+typedef struct
+{
+    uint32_t vcpu_count;
+    uint32_t irqchip_mode;
+    uint64_t ram_size;
+} snapshot_machine_t;
+
+static snapshot_device_t devices[SNAPSHOT_MAX_DEVICES];
+static int device_count = 0;
+static char *snapshot_path = NULL;
+static snapshot_signal_action_t snapshot_action = SNAPSHOT_ON_SIGNAL_SAVE;
+static pthread_t snapshot_thread;
+
+static void snapshot_lazy_wait();
+
+// Devices hand over plain structs, restoring copies the bytes back and then calls post_load to fix up
+// whatever can't be copied (threads, fds, memory mappings)
+void snapshot_register(const char *name, uint32_t version, void *state, size_t size, snapshot_post_load_t post_load)
+{
+    if (device_count == SNAPSHOT_MAX_DEVICES)
+    {
+        errx(1, "Too many snapshot devices");
+    }
+    snapshot_device_t *device = &devices[device_count++];
+    snprintf(device->name, sizeof(device->name), "device.%s", name);
+    device->version = version;
+    device->state = state;
+    device->size = size;
+    device->post_load = post_load;
+}
+
+static int snapshot_workers()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+    {
+        return 1;
+    }
+    return cpus < SNAPSHOT_MAX_WORKERS ? cpus : SNAPSHOT_MAX_WORKERS;
+}
+
+static uint64_t snapshot_now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+#pragma region SAVE
+
+typedef struct
+{
+    int fd;
+    uint64_t offset;
+    uint32_t section_count;
+} snapshot_writer_t;
+
+static void snapshot_pwrite(int fd, const void *data, size_t size, uint64_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            err(1, "Failed to write the snapshot");
+        }
+        data = (const uint8_t *)data + written;
+        size -= written;
+        offset += written;
+    }
+}
+
+static void snapshot_write_section(snapshot_writer_t *writer, const char *name, uint32_t version, const void *data, size_t size)
+{
+    snapshot_section_t section = {.version = version, .size = size};
+    strncpy(section.name, name, sizeof(section.name) - 1);
+    snapshot_pwrite(writer->fd, &section, sizeof(section), writer->offset);
+    snapshot_pwrite(writer->fd, data, size, writer->offset + sizeof(section));
+    writer->offset += sizeof(section) + size;
+    writer->section_count++;
+}
+
+typedef struct
+{
+    uint8_t *data; // compressed chunk, owned by the writer once done is set
+    uint32_t length;
+    bool done;
+} snapshot_chunk_t;
+
+typedef struct
+{
+    uint8_t *ram;
+    uint64_t ram_size;
+    int ram_fd;
+    uint32_t chunk_count;
+    uint8_t *zero_bitmap;
+    snapshot_chunk_t *chunks;
+    uint32_t next;    // next chunk a worker picks up
+    uint32_t written; // chunks the writer is done with
+    uint32_t window;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} snapshot_ram_job_t;
+
+static bool snapshot_page_is_zero(const uint8_t *page)
+{
+    const uint64_t *words = (const uint64_t *)page;
+    for (int i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+    {
+        if (words[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Holes of a memfd are zero without having to read (and allocate) them. Anonymous ram has no holes.
+static uint64_t snapshot_next_data(int fd, uint64_t limit, uint64_t offset)
+{
+    if (fd < 0)
+    {
+        return offset;
+    }
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    return data < 0 || data > limit ? limit : data;
+}
+
+static uint64_t snapshot_next_hole(int fd, uint64_t limit, uint64_t offset)
+{
+    if (fd < 0 || offset >= limit)
+    {
+        return limit;
+    }
+    off_t hole = lseek(fd, offset, SEEK_HOLE);
+    return hole < 0 || hole > limit ? limit : hole;
+}
+
+static void snapshot_compress_chunk(snapshot_ram_job_t *job, uint32_t index, uint8_t *staging)
+{
+    uint64_t start = (uint64_t)index * SNAPSHOT_CHUNK_SIZE;
+    uint64_t end = start + SNAPSHOT_CHUNK_SIZE < job->ram_size ? start + SNAPSHOT_CHUNK_SIZE : job->ram_size;
+    size_t staged = 0;
+
+    uint64_t data = snapshot_next_data(job->ram_fd, end, start);
+    uint64_t hole = snapshot_next_hole(job->ram_fd, end, data);
+    for (uint64_t offset = start; offset < end; offset += PAGE_SIZE)
+    {
+        if (offset >= hole)
+        {
+            data = snapshot_next_data(job->ram_fd, end, offset);
+            hole = snapshot_next_hole(job->ram_fd, end, data);
+        }
+        uint64_t page = offset / PAGE_SIZE;
+        if (offset < data || snapshot_page_is_zero(job->ram + offset))
+        {
+            job->zero_bitmap[page / 8] |= 1 << (page % 8); // chunks cover whole bytes of the bitmap
+            continue;
+        }
+        memcpy(staging + staged, job->ram + offset, PAGE_SIZE);
+        staged += PAGE_SIZE;
+    }
+
+    uint8_t *compressed = NULL;
+    uLongf length = 0;
+    if (staged != 0)
+    {
+        length = compressBound(staged);
+        compressed = malloc(length);
+        if (compressed == NULL || compress2(compressed, &length, staging, staged, Z_BEST_SPEED) != Z_OK)
+        {
+            errx(1, "Failed to compress ram chunk %u", index);
+        }
+    }
+
+    pthread_mutex_lock(&job->mutex);
+    job->chunks[index].data = compressed;
+    job->chunks[index].length = length;
+    job->chunks[index].done = true;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->mutex);
+}
+
+static void *snapshot_compress_worker(void *arg)
+{
+    snapshot_ram_job_t *job = arg;
+    uint8_t *staging = malloc(SNAPSHOT_CHUNK_SIZE);
+    if (staging == NULL)
+    {
+        err(1, "Failed to allocate a compression buffer");
+    }
+
+    while (1)
+    {
+        pthread_mutex_lock(&job->mutex);
+        // don't run too far ahead of the writer, every finished chunk sits in memory until it's written
+        while (job->next < job->chunk_count && job->next >= job->written + job->window)
+        {
+            pthread_cond_wait(&job->cond, &job->mutex);
+        }
+        if (job->next >= job->chunk_count)
+        {
+            pthread_mutex_unlock(&job->mutex);
+            break;
+        }
+        uint32_t index = job->next++;
+        pthread_mutex_unlock(&job->mutex);
+
+        snapshot_compress_chunk(job, index, staging);
+    }
+
+    free(staging);
+    return NULL;
+}
+
+static void snapshot_write_ram(snapshot_writer_t *writer)
+{
+    snapshot_ram_job_t job = {
+        .ram = memory_get_ram(),
+        .ram_size = memory_get_size(),
+        .ram_fd = memory_get_fd(),
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+    job.chunk_count = (job.ram_size + SNAPSHOT_CHUNK_SIZE - 1) / SNAPSHOT_CHUNK_SIZE;
+    size_t bitmap_size = (job.ram_size / PAGE_SIZE + 7) / 8;
+    size_t index_size = job.chunk_count * sizeof(snapshot_chunk_index_t);
+    job.zero_bitmap = calloc(1, bitmap_size);
+    job.chunks = calloc(job.chunk_count, sizeof(snapshot_chunk_t));
+    snapshot_chunk_index_t *index = calloc(job.chunk_count, sizeof(snapshot_chunk_index_t));
+    if (job.zero_bitmap == NULL || job.chunks == NULL || index == NULL)
+    {
+        err(1, "Failed to allocate the ram index");
+    }
+
+    int worker_count = snapshot_workers();
+    job.window = worker_count * SNAPSHOT_WINDOW_PER_WORKER;
+    pthread_t workers[SNAPSHOT_MAX_WORKERS];
+    for (int i = 0; i < worker_count; i++)
+    {
+        if (pthread_create(&workers[i], NULL, snapshot_compress_worker, &job) != 0)
+        {
+            errx(1, "Failed to create a compression worker");
+        }
+    }
+
+    // the chunks go to disk in order as they finish, the header, bitmap and index are filled in at the end
+    uint64_t section_start = writer->offset;
+    uint64_t data_start = sizeof(snapshot_section_t) + sizeof(snapshot_ram_header_t) + bitmap_size + index_size;
+    uint64_t data_offset = data_start;
+    for (uint32_t i = 0; i < job.chunk_count; i++)
+    {
+        pthread_mutex_lock(&job.mutex);
+        while (!job.chunks[i].done)
+        {
+            pthread_cond_wait(&job.cond, &job.mutex);
+        }
+        pthread_mutex_unlock(&job.mutex);
+
+        index[i].offset = data_offset - sizeof(snapshot_section_t);
+        index[i].length = job.chunks[i].length;
+        snapshot_pwrite(writer->fd, job.chunks[i].data, job.chunks[i].length, section_start + data_offset);
+        data_offset += job.chunks[i].length;
+        free(job.chunks[i].data);
+
+        pthread_mutex_lock(&job.mutex);
+        job.written++;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.mutex);
+    }
+    for (int i = 0; i < worker_count; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+
+    snapshot_section_t section = {.name = "ram", .version = SNAPSHOT_RAM_VERSION, .size = data_offset - sizeof(snapshot_section_t)};
+    snapshot_ram_header_t header = {.ram_size = job.ram_size, .chunk_size = SNAPSHOT_CHUNK_SIZE, .chunk_count = job.chunk_count};
+    uint64_t offset = section_start;
+    snapshot_pwrite(writer->fd, &section, sizeof(section), offset);
+    offset += sizeof(section);
+    snapshot_pwrite(writer->fd, &header, sizeof(header), offset);
+    offset += sizeof(header);
+    snapshot_pwrite(writer->fd, job.zero_bitmap, bitmap_size, offset);
+    offset += bitmap_size;
+    snapshot_pwrite(writer->fd, index, index_size, offset);
+
+    writer->offset = section_start + data_offset;
+    writer->section_count++;
+    free(index);
+    free(job.chunks);
+    free(job.zero_bitmap);
+}
+
+// Template ram is stored as is at a page aligned offset so clones can map it. Zero pages stay holes.
+static void snapshot_write_raw_ram(snapshot_writer_t *writer)
+{
+    uint8_t *ram = memory_get_ram();
+    uint64_t ram_size = memory_get_size();
+    int ram_fd = memory_get_fd();
+    uint64_t section_start = writer->offset;
+    snapshot_raw_header_t header = {
+        .ram_size = ram_size,
+        .data_offset = (section_start + sizeof(snapshot_section_t) + sizeof(header) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1),
+    };
+
+    uint64_t offset = 0;
+    while ((offset = snapshot_next_data(ram_fd, ram_size, offset)) < ram_size)
+    {
+        uint64_t hole = snapshot_next_hole(ram_fd, ram_size, offset);
+        uint64_t end = offset;
+        while (end < hole && !snapshot_page_is_zero(ram + end))
+        {
+            end += PAGE_SIZE;
+        }
+        snapshot_pwrite(writer->fd, ram + offset, end - offset, header.data_offset + offset);
+        offset = end < hole ? end + PAGE_SIZE : end;
+    }
+    if (ftruncate(writer->fd, header.data_offset + ram_size) < 0)
+    {
+        err(1, "Failed to size the template");
+    }
+
+    snapshot_section_t section = {.name = "ram.raw", .version = SNAPSHOT_RAM_VERSION, .size = header.data_offset + ram_size - section_start - sizeof(snapshot_section_t)};
+    snapshot_pwrite(writer->fd, &section, sizeof(section), section_start);
+    snapshot_pwrite(writer->fd, &header, sizeof(header), section_start + sizeof(section));
+    writer->offset = header.data_offset + ram_size;
+    writer->section_count++;
+}
+
+// Everything but the ram. The machine has to be paused.
+static void snapshot_write_state(snapshot_writer_t *writer)
+{
+    snapshot_machine_t machine = {.vcpu_count = kvm_get_vcpu_count(), .irqchip_mode = kvm_get_irqchip_mode(), .ram_size = memory_get_size()};
+    snapshot_write_section(writer, "machine", 1, &machine, sizeof(machine));
+
+    kvm_vm_state_t vm_state;
+    kvm_save_vm(&vm_state);
+    snapshot_write_section(writer, "vm", 1, &vm_state, sizeof(vm_state));
+
+    kvm_vcpu_state_t *vcpu_state = malloc(sizeof(kvm_vcpu_state_t));
+    if (vcpu_state == NULL)
+    {
+        err(1, "Failed to allocate the vcpu state");
+    }
+    for (int i = 0; i < kvm_get_vcpu_count(); i++)
+    {
+        char name[SNAPSHOT_NAME_SIZE];
+        snprintf(name, sizeof(name), "vcpu.%d", i);
+        kvm_save_vcpu(kvm_get_vcpu(i), vcpu_state);
+        snapshot_write_section(writer, name, 1, vcpu_state, sizeof(*vcpu_state));
+    }
+    free(vcpu_state);
+
+    for (int i = 0; i < device_count; i++)
+    {
+        snapshot_write_section(writer, devices[i].name, devices[i].version, devices[i].state, devices[i].size);
+    }
+}
+
+// Without a ram section, for live migration, which sends the ram on its own. The machine has to be paused.
+void snapshot_save_state(int fd)
+{
+    snapshot_writer_t writer = {.fd = fd, .offset = sizeof(snapshot_header_t)};
+    snapshot_write_state(&writer);
+    snapshot_header_t header = {.magic = SNAPSHOT_MAGIC, .version = SNAPSHOT_VERSION, .section_count = writer.section_count};
+    snapshot_pwrite(fd, &header, sizeof(header), 0);
+}
+
+// Pauses the machine, writes it out and lets it continue
+static void snapshot_write(const char *path, bool template)
+{
+    snapshot_lazy_wait();
+    uint64_t start = snapshot_now_ms();
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        warn("Failed to create %s", temp_path);
+        return;
+    }
+
+    kvm_pause();
+    ata_pause_workers();
+    io_manager_drain_coalesced();
+    io_manager_lock();
+
+    snapshot_writer_t writer = {.fd = fd, .offset = sizeof(snapshot_header_t)};
+    snapshot_write_state(&writer);
+
+    if (template)
+    {
+        snapshot_write_raw_ram(&writer);
+    }
+    else
+    {
+        snapshot_write_ram(&writer);
+    }
+
+    io_manager_unlock();
+    ata_resume_workers();
+    kvm_resume();
+
+    snapshot_header_t header = {.magic = SNAPSHOT_MAGIC, .version = SNAPSHOT_VERSION, .section_count = writer.section_count};
+    snapshot_pwrite(fd, &header, sizeof(header), 0);
+    if (fsync(fd) < 0)
+    {
+        warn("Failed to sync %s", temp_path);
+    }
+    // clones map the template, it must never change under them
+    if (template && fchmod(fd, 0444) < 0)
+    {
+        warn("Failed to make %s read only", temp_path);
+    }
+    close(fd);
+    if (rename(temp_path, path) < 0)
+    {
+        warn("Failed to move the snapshot to %s", path);
+        return;
+    }
+    printf("%s of %lu MiB written to %s in %lu ms\n", template ? "Template" : "Snapshot", memory_get_size() >> 20, path, snapshot_now_ms() - start);
+}
+
+void snapshot_save(const char *path)
+{
+    snapshot_write(path, false);
+}
+
+void snapshot_save_template(const char *path)
+{
+    snapshot_write(path, true);
+}
+
+#pragma endregion
+
+#pragma region RESTORE
+
+static void snapshot_pread(int fd, void *data, size_t size, uint64_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t bytes = pread(fd, data, size, offset);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            errx(1, "Truncated snapshot");
+        }
+        data = (uint8_t *)data + bytes;
+        size -= bytes;
+        offset += bytes;
+    }
+}
+
+typedef struct
+{
+    int fd;
+    uint64_t data_start; // file offset of the section data
+    snapshot_ram_header_t header;
+    uint8_t *zero_bitmap;
+    snapshot_chunk_index_t *index;
+} snapshot_ram_file_t;
+
+static void snapshot_open_ram(snapshot_ram_file_t *file, int fd, uint64_t data_start)
+{
+    file->fd = fd;
+    file->data_start = data_start;
+    snapshot_pread(fd, &file->header, sizeof(file->header), data_start);
+    if (file->header.ram_size != memory_get_size() || file->header.chunk_size % PAGE_SIZE != 0 || file->header.chunk_size / PAGE_SIZE % 8 != 0)
+    {
+        errx(1, "The snapshot ram doesn't match this machine");
+    }
+
+    size_t bitmap_size = (file->header.ram_size / PAGE_SIZE + 7) / 8;
+    size_t index_size = file->header.chunk_count * sizeof(snapshot_chunk_index_t);
+    file->zero_bitmap = malloc(bitmap_size);
+    file->index = malloc(index_size);
+    if (file->zero_bitmap == NULL || file->index == NULL)
+    {
+        err(1, "Failed to allocate the ram index");
+    }
+    snapshot_pread(fd, file->zero_bitmap, bitmap_size, data_start + sizeof(file->header));
+    snapshot_pread(fd, file->index, index_size, data_start + sizeof(file->header) + bitmap_size);
+}
+
+static void snapshot_close_ram(snapshot_ram_file_t *file)
+{
+    free(file->index);
+    free(file->zero_bitmap);
+}
+
+// bytes of ram the chunk covers, only the last one can be short
+static uint64_t snapshot_chunk_length(snapshot_ram_file_t *file, uint32_t index)
+{
+    uint64_t start = (uint64_t)index * file->header.chunk_size;
+    return start + file->header.chunk_size < file->header.ram_size ? file->header.chunk_size : file->header.ram_size - start;
+}
+
+// Decompresses a chunk and scatters its pages to dest, where the chunk starts. Zero pages are only written with fill_zero.
+static void snapshot_decode_chunk(snapshot_ram_file_t *file, uint32_t index, uint8_t *compressed, uint8_t *staging, uint8_t *dest, bool fill_zero)
+{
+    snapshot_chunk_index_t *chunk = &file->index[index];
+    uint64_t length = snapshot_chunk_length(file, index);
+    if (chunk->length == 0)
+    {
+        if (fill_zero)
+        {
+            memset(dest, 0, length);
+        }
+        return;
+    }
+
+    snapshot_pread(file->fd, compressed, chunk->length, file->data_start + chunk->offset);
+    uLongf staged = file->header.chunk_size;
+    if (uncompress(staging, &staged, compressed, chunk->length) != Z_OK)
+    {
+        errx(1, "Corrupted ram chunk %u", index);
+    }
+
+    uint64_t first_page = (uint64_t)index * file->header.chunk_size / PAGE_SIZE;
+    uint8_t *source = staging;
+    for (uint64_t offset = 0; offset < length; offset += PAGE_SIZE)
+    {
+        uint64_t page = first_page + offset / PAGE_SIZE;
+        if (!(file->zero_bitmap[page / 8] & (1 << (page % 8))))
+        {
+            memcpy(dest + offset, source, PAGE_SIZE);
+            source += PAGE_SIZE;
+        }
+        else if (fill_zero)
+        {
+            memset(dest + offset, 0, PAGE_SIZE);
+        }
+    }
+}
+
+static void snapshot_alloc_buffers(snapshot_ram_file_t *file, uint8_t **compressed, uint8_t **staging)
+{
+    *compressed = malloc(compressBound(file->header.chunk_size));
+    *staging = malloc(file->header.chunk_size);
+    if (*compressed == NULL || *staging == NULL)
+    {
+        err(1, "Failed to allocate a decompression buffer");
+    }
+}
+
+typedef struct
+{
+    snapshot_ram_file_t *file;
+    uint8_t *ram;
+    uint32_t next;
+    pthread_mutex_t mutex;
+} snapshot_restore_job_t;
+
+static void *snapshot_decompress_worker(void *arg)
+{
+    snapshot_restore_job_t *job = arg;
+    uint8_t *compressed, *staging;
+    snapshot_alloc_buffers(job->file, &compressed, &staging);
+
+    while (1)
+    {
+        pthread_mutex_lock(&job->mutex);
+        uint32_t index = job->next++;
+        pthread_mutex_unlock(&job->mutex);
+        if (index >= job->file->header.chunk_count)
+        {
+            break;
+        }
+        // fresh ram is already zero
+        snapshot_decode_chunk(job->file, index, compressed, staging, job->ram + (uint64_t)index * job->file->header.chunk_size, false);
+    }
+
+    free(staging);
+    free(compressed);
+    return NULL;
+}
+
+static void snapshot_load_ram(int fd, uint64_t data_start)
+{
+    snapshot_ram_file_t file;
+    snapshot_open_ram(&file, fd, data_start);
+    snapshot_restore_job_t job = {.file = &file, .ram = memory_get_ram(), .mutex = PTHREAD_MUTEX_INITIALIZER};
+
+    int worker_count = snapshot_workers();
+    pthread_t workers[SNAPSHOT_MAX_WORKERS];
+    for (int i = 0; i < worker_count; i++)
+    {
+        if (pthread_create(&workers[i], NULL, snapshot_decompress_worker, &job) != 0)
+        {
+            errx(1, "Failed to create a decompression worker");
+        }
+    }
+    for (int i = 0; i < worker_count; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+
+    snapshot_close_ram(&file);
+}
+
+#pragma region LAZY
+
+/*
+Lazy restore: the ram is registered with userfaultfd and the vcpus start right away. The first touch of a page
+(by the guest, kvm or a device) blocks until the fault thread has put its whole chunk in place with one
+UFFDIO_COPY. Meanwhile the prefetcher walks the chunks, first in the order the guest needed them in previous
+runs (<snapshot>.order), then the rest front to back. Whoever flips a chunk from missing to loading owns it.
+*/
+
+typedef enum
+{
+    SNAPSHOT_CHUNK_MISSING,
+    SNAPSHOT_CHUNK_LOADING,
+    SNAPSHOT_CHUNK_LOADED,
+} snapshot_chunk_state_t;
+
+typedef struct
+{
+    snapshot_ram_file_t file;
+    uint8_t *ram;
+    int uffd;
+    uint8_t *states; // snapshot_chunk_state_t
+    uint32_t loaded;
+    uint32_t *order; // from previous runs
+    uint32_t order_count;
+    uint32_t *faulted; // chunks the guest had to wait for, in order
+    uint32_t faulted_count;
+    char order_path[4096];
+    uint64_t start_ms;
+    pthread_t fault_thread;
+    pthread_t prefetch_thread;
+} snapshot_lazy_t;
+
+static snapshot_lazy_t lazy;
+static bool lazy_active = false;
+static pthread_mutex_t lazy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lazy_cond = PTHREAD_COND_INITIALIZER;
+
+static void snapshot_lazy_copy(uint64_t offset, uint8_t *source, uint64_t length)
+{
+    while (length > 0)
+    {
+        struct uffdio_copy copy = {.dst = (uintptr_t)(lazy.ram + offset), .src = (uintptr_t)source, .len = length};
+        if (ioctl(lazy.uffd, UFFDIO_COPY, &copy) == 0)
+        {
+            return;
+        }
+        if (errno != EAGAIN)
+        {
+            err(1, "UFFDIO_COPY");
+        }
+        // the address space changed under us, carry on after what made it
+        if (copy.copy > 0)
+        {
+            offset += copy.copy;
+            source += copy.copy;
+            length -= copy.copy;
+        }
+    }
+}
+
+// false if another thread already has the chunk
+static bool snapshot_lazy_load_chunk(uint32_t index, uint8_t *compressed, uint8_t *staging, uint8_t *chunk)
+{
+    uint8_t expected = SNAPSHOT_CHUNK_MISSING;
+    if (!__atomic_compare_exchange_n(&lazy.states[index], &expected, SNAPSHOT_CHUNK_LOADING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+
+    uint64_t offset = (uint64_t)index * lazy.file.header.chunk_size;
+    uint64_t length = snapshot_chunk_length(&lazy.file, index);
+    snapshot_decode_chunk(&lazy.file, index, compressed, staging, chunk, true);
+    snapshot_lazy_copy(offset, chunk, length);
+
+    __atomic_store_n(&lazy.states[index], SNAPSHOT_CHUNK_LOADED, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&lazy.loaded, 1, __ATOMIC_ACQ_REL);
+    return true;
+}
+
+static void snapshot_lazy_read_order()
+{
+    lazy.order = malloc(lazy.file.header.chunk_count * sizeof(uint32_t));
+    if (lazy.order == NULL)
+    {
+        err(1, "Failed to allocate the prefetch order");
+    }
+    lazy.order_count = 0;
+
+    int fd = open(lazy.order_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return;
+    }
+    ssize_t bytes = read(fd, lazy.order, lazy.file.header.chunk_count * sizeof(uint32_t));
+    close(fd);
+    if (bytes > 0)
+    {
+        lazy.order_count = bytes / sizeof(uint32_t);
+    }
+}
+
+// The previous order stays in front, whatever the guest still had to wait for this time goes after it
+static void snapshot_lazy_write_order()
+{
+    uint32_t chunk_count = lazy.file.header.chunk_count;
+    bool *listed = calloc(chunk_count, sizeof(bool));
+    uint32_t *order = malloc(chunk_count * sizeof(uint32_t));
+    if (listed == NULL || order == NULL)
+    {
+        err(1, "Failed to allocate the prefetch order");
+    }
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < lazy.order_count; i++)
+    {
+        if (lazy.order[i] < chunk_count && !listed[lazy.order[i]])
+        {
+            listed[lazy.order[i]] = true;
+            order[count++] = lazy.order[i];
+        }
+    }
+    for (uint32_t i = 0; i < lazy.faulted_count; i++)
+    {
+        if (!listed[lazy.faulted[i]])
+        {
+            listed[lazy.faulted[i]] = true;
+            order[count++] = lazy.faulted[i];
+        }
+    }
+
+    int fd = open(lazy.order_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        warn("Failed to write %s", lazy.order_path);
+    }
+    else
+    {
+        snapshot_pwrite(fd, order, count * sizeof(uint32_t), 0);
+        close(fd);
+    }
+    free(order);
+    free(listed);
+}
+
+static void *snapshot_prefetch_thread(void *arg)
+{
+    uint8_t *compressed, *staging;
+    snapshot_alloc_buffers(&lazy.file, &compressed, &staging);
+    uint8_t *chunk = malloc(lazy.file.header.chunk_size);
+    if (chunk == NULL)
+    {
+        err(1, "Failed to allocate a chunk buffer");
+    }
+
+    for (uint32_t i = 0; i < lazy.order_count; i++)
+    {
+        if (lazy.order[i] < lazy.file.header.chunk_count)
+        {
+            snapshot_lazy_load_chunk(lazy.order[i], compressed, staging, chunk);
+        }
+    }
+    for (uint32_t i = 0; i < lazy.file.header.chunk_count; i++)
+    {
+        snapshot_lazy_load_chunk(i, compressed, staging, chunk);
+    }
+
+    free(chunk);
+    free(staging);
+    free(compressed);
+    return NULL;
+}
+
+static void snapshot_lazy_finish()
+{
+    pthread_join(lazy.prefetch_thread, NULL);
+    struct uffdio_range range = {.start = (uintptr_t)lazy.ram, .len = lazy.file.header.ram_size};
+    if (ioctl(lazy.uffd, UFFDIO_UNREGISTER, &range) < 0)
+    {
+        warn("UFFDIO_UNREGISTER");
+    }
+    close(lazy.uffd);
+    snapshot_lazy_write_order();
+    printf("Lazy restore done in %lu ms, the guest waited for %u of %u chunks\n",
+           snapshot_now_ms() - lazy.start_ms, lazy.faulted_count, lazy.file.header.chunk_count);
+
+    close(lazy.file.fd);
+    snapshot_close_ram(&lazy.file);
+    free(lazy.faulted);
+    free(lazy.order);
+    free(lazy.states);
+
+    pthread_mutex_lock(&lazy_mutex);
+    lazy_active = false;
+    pthread_cond_broadcast(&lazy_cond);
+    pthread_mutex_unlock(&lazy_mutex);
+}
+
+static void *snapshot_fault_thread(void *arg)
+{
+    uint8_t *compressed, *staging;
+    snapshot_alloc_buffers(&lazy.file, &compressed, &staging);
+    uint8_t *chunk = malloc(lazy.file.header.chunk_size);
+    if (chunk == NULL)
+    {
+        err(1, "Failed to allocate a chunk buffer");
+    }
+
+    struct pollfd pollfd = {.fd = lazy.uffd, .events = POLLIN};
+    while (__atomic_load_n(&lazy.loaded, __ATOMIC_ACQUIRE) < lazy.file.header.chunk_count)
+    {
+        // the timeout only notices the prefetcher finishing the last chunks
+        if (poll(&pollfd, 1, 100) <= 0)
+        {
+            continue;
+        }
+        struct uffd_msg msg;
+        if (read(lazy.uffd, &msg, sizeof(msg)) != sizeof(msg))
+        {
+            if (errno == EAGAIN || errno == EINTR)
+            {
+                continue;
+            }
+            err(1, "Failed to read from userfaultfd");
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT)
+        {
+            continue;
+        }
+
+        uint64_t offset = msg.arg.pagefault.address - (uintptr_t)lazy.ram;
+        uint32_t index = offset / lazy.file.header.chunk_size;
+        if (snapshot_lazy_load_chunk(index, compressed, staging, chunk))
+        {
+            lazy.faulted[lazy.faulted_count++] = index;
+            continue;
+        }
+        // the prefetcher has it, its copy wakes the faulting thread unless it finished before the fault was queued
+        while (__atomic_load_n(&lazy.states[index], __ATOMIC_ACQUIRE) != SNAPSHOT_CHUNK_LOADED)
+        {
+            sched_yield();
+        }
+        struct uffdio_range range = {.start = (uintptr_t)lazy.ram + (offset & ~(uint64_t)(PAGE_SIZE - 1)), .len = PAGE_SIZE};
+        ioctl(lazy.uffd, UFFDIO_WAKE, &range);
+    }
+
+    free(chunk);
+    free(staging);
+    free(compressed);
+    snapshot_lazy_finish();
+    return NULL;
+}
+
+// false if userfaultfd can't be used, the ram is loaded eagerly then. Takes over fd either way.
+static bool snapshot_lazy_start(const char *path, int fd, uint64_t data_start)
+{
+    if (memory_get_page_size() != PAGE_SIZE)
+    {
+        warnx("Lazy restore needs regular pages, loading the ram eagerly");
+        close(fd);
+        return false;
+    }
+    int uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd < 0)
+    {
+        warn("userfaultfd, loading the ram eagerly");
+        close(fd);
+        return false;
+    }
+    struct uffdio_api api = {.api = UFFD_API};
+    if (ioctl(uffd, UFFDIO_API, &api) < 0)
+    {
+        warn("UFFDIO_API, loading the ram eagerly");
+        close(uffd);
+        close(fd);
+        return false;
+    }
+
+    memset(&lazy, 0, sizeof(lazy));
+    lazy.start_ms = snapshot_now_ms();
+    lazy.uffd = uffd;
+    lazy.ram = memory_get_ram();
+    snapshot_open_ram(&lazy.file, fd, data_start);
+    snprintf(lazy.order_path, sizeof(lazy.order_path), "%s.order", path);
+
+    lazy.states = calloc(lazy.file.header.chunk_count, sizeof(uint8_t));
+    lazy.faulted = malloc(lazy.file.header.chunk_count * sizeof(uint32_t));
+    if (lazy.states == NULL || lazy.faulted == NULL)
+    {
+        err(1, "Failed to allocate the chunk states");
+    }
+
+    // anything written since memory_init (the BIOS setting up shadow ram) would make UFFDIO_COPY fail with EEXIST
+    memory_discard();
+
+    // All zero chunks are done once the ram is discarded. Only the runs of chunks with data get registered,
+    // filling the others through userfaultfd would allocate every page of a memfd.
+    uint32_t chunk_count = lazy.file.header.chunk_count;
+    for (uint32_t i = 0; i < chunk_count;)
+    {
+        if (lazy.file.index[i].length == 0)
+        {
+            lazy.states[i++] = SNAPSHOT_CHUNK_LOADED;
+            lazy.loaded++;
+            continue;
+        }
+        uint32_t end = i;
+        while (end < chunk_count && lazy.file.index[end].length != 0)
+        {
+            end++;
+        }
+        uint64_t start = (uint64_t)i * lazy.file.header.chunk_size;
+        uint64_t length = (uint64_t)(end - 1) * lazy.file.header.chunk_size + snapshot_chunk_length(&lazy.file, end - 1) - start;
+        struct uffdio_register registration = {
+            .range = {.start = (uintptr_t)lazy.ram + start, .len = length},
+            .mode = UFFDIO_REGISTER_MODE_MISSING,
+        };
+        if (ioctl(uffd, UFFDIO_REGISTER, &registration) < 0)
+        {
+            err(1, "UFFDIO_REGISTER"); // part of the ram may already be registered, no going back to eager
+        }
+        i = end;
+    }
+    snapshot_lazy_read_order();
+
+    lazy_active = true;
+    if (pthread_create(&lazy.prefetch_thread, NULL, snapshot_prefetch_thread, NULL) != 0 ||
+        pthread_create(&lazy.fault_thread, NULL, snapshot_fault_thread, NULL) != 0)
+    {
+        errx(1, "Failed to create the lazy restore threads");
+    }
+    pthread_detach(lazy.fault_thread);
+    return true;
+}
+
+// A snapshot taken before all the ram is in would see holes where the chunks are missing
+static void snapshot_lazy_wait()
+{
+    pthread_mutex_lock(&lazy_mutex);
+    while (lazy_active)
+    {
+        pthread_cond_wait(&lazy_cond, &lazy_mutex);
+    }
+    pthread_mutex_unlock(&lazy_mutex);
+}
+
+#pragma endregion
+
+// A clone already has the template mapped as its ram, anyone else copies whatever isn't a hole
+static void snapshot_load_raw_ram(int fd, uint64_t data_start)
+{
+    snapshot_raw_header_t header;
+    snapshot_pread(fd, &header, sizeof(header), data_start);
+    if (header.ram_size != memory_get_size())
+    {
+        errx(1, "The snapshot ram doesn't match this machine");
+    }
+    if (memory_is_template())
+    {
+        memory_discard(); // drops whatever the clone wrote during init, it reads the template again
+        return;
+    }
+
+    uint8_t *ram = memory_get_ram();
+    uint64_t end = header.data_offset + header.ram_size;
+    uint64_t offset = header.data_offset;
+    while ((offset = snapshot_next_data(fd, end, offset)) < end)
+    {
+        uint64_t hole = snapshot_next_hole(fd, end, offset);
+        snapshot_pread(fd, ram + (offset - header.data_offset), hole - offset, offset);
+        offset = hole;
+    }
+}
+
+static void snapshot_load_section(int fd, snapshot_section_t *section, uint64_t data_start, void *state, size_t size)
+{
+    if (section->size != size)
+    {
+        errx(1, "Snapshot section %s has the wrong size", section->name);
+    }
+    snapshot_pread(fd, state, size, data_start);
+}
+
+static void snapshot_restore_fd(int fd, const char *path, bool lazy)
+{
+    snapshot_header_t header;
+    snapshot_pread(fd, &header, sizeof(header), 0);
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION)
+    {
+        errx(1, "%s isn't a version %d snapshot", path, SNAPSHOT_VERSION);
+    }
+
+    kvm_vcpu_state_t *vcpu_state = malloc(sizeof(kvm_vcpu_state_t));
+    if (vcpu_state == NULL)
+    {
+        err(1, "Failed to allocate the vcpu state");
+    }
+
+    uint64_t offset = sizeof(header);
+    for (uint32_t i = 0; i < header.section_count; i++)
+    {
+        snapshot_section_t section;
+        snapshot_pread(fd, &section, sizeof(section), offset);
+        section.name[SNAPSHOT_NAME_SIZE - 1] = '\0';
+        uint64_t data_start = offset + sizeof(section);
+        offset = data_start + section.size;
+
+        int vcpu_id;
+        if (strcmp(section.name, "machine") == 0)
+        {
+            snapshot_machine_t machine;
+            snapshot_load_section(fd, &section, data_start, &machine, sizeof(machine));
+            if (machine.vcpu_count != kvm_get_vcpu_count() || machine.irqchip_mode != kvm_get_irqchip_mode() || machine.ram_size != memory_get_size())
+            {
+                errx(1, "The snapshot needs %u vcpus, irqchip mode %u and %lu MiB of ram", machine.vcpu_count, machine.irqchip_mode, machine.ram_size >> 20);
+            }
+        }
+        else if (strcmp(section.name, "vm") == 0)
+        {
+            kvm_vm_state_t vm_state;
+            snapshot_load_section(fd, &section, data_start, &vm_state, sizeof(vm_state));
+            kvm_load_vm(&vm_state);
+        }
+        else if (sscanf(section.name, "vcpu.%d", &vcpu_id) == 1 && kvm_get_vcpu(vcpu_id) != NULL)
+        {
+            snapshot_load_section(fd, &section, data_start, vcpu_state, sizeof(*vcpu_state));
+            kvm_load_vcpu(kvm_get_vcpu(vcpu_id), vcpu_state);
+        }
+        else if (strcmp(section.name, "ram") == 0)
+        {
+            if (section.version != SNAPSHOT_RAM_VERSION)
+            {
+                errx(1, "Unsupported ram section version %u", section.version);
+            }
+            if (lazy && snapshot_lazy_start(path, dup(fd), data_start))
+            {
+                continue;
+            }
+            snapshot_load_ram(fd, data_start);
+        }
+        else if (strcmp(section.name, "ram.raw") == 0)
+        {
+            if (section.version != SNAPSHOT_RAM_VERSION)
+            {
+                errx(1, "Unsupported ram section version %u", section.version);
+            }
+            snapshot_load_raw_ram(fd, data_start);
+        }
+        else
+        {
+            bool found = false;
+            for (int j = 0; j < device_count && !found; j++)
+            {
+                if (strcmp(section.name, devices[j].name) == 0)
+                {
+                    if (section.version != devices[j].version)
+                    {
+                        errx(1, "%s is version %u in the snapshot but %u here", section.name, section.version, devices[j].version);
+                    }
+                    snapshot_load_section(fd, &section, data_start, devices[j].state, devices[j].size);
+                    found = true;
+                }
+            }
+            if (!found)
+            {
+                warnx("Skipping unknown snapshot section %s", section.name);
+            }
+        }
+    }
+    free(vcpu_state);
+
+    // every device is back before any of them starts reacting to its state
+    for (int i = 0; i < device_count; i++)
+    {
+        if (devices[i].post_load != NULL)
+        {
+            devices[i].post_load();
+        }
+    }
+}
+
+// Only right after kvm_init and the device inits, before kvm_run. The ram has to be untouched.
+// With lazy the ram is only read in while the machine already runs, see LAZY.
+void snapshot_restore(const char *path, bool lazy)
+{
+    uint64_t start = snapshot_now_ms();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        err(1, "Failed to open %s", path);
+    }
+    snapshot_restore_fd(fd, path, lazy);
+    close(fd);
+    printf("Restored %s in %lu ms\n", path, snapshot_now_ms() - start);
+}
+
+// What snapshot_save_state wrote, the ram is already in place
+void snapshot_restore_state(int fd)
+{
+    snapshot_restore_fd(fd, "the migration state", false);
+}
+
+// The memory config of a clone: the template's ram size, mapped straight from the file
+void snapshot_open_template(const char *path, memory_config_t *config)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        err(1, "Failed to open %s", path);
+    }
+    snapshot_header_t header;
+    snapshot_pread(fd, &header, sizeof(header), 0);
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION)
+    {
+        errx(1, "%s isn't a version %d snapshot", path, SNAPSHOT_VERSION);
+    }
+
+    uint64_t offset = sizeof(header);
+    for (uint32_t i = 0; i < header.section_count; i++)
+    {
+        snapshot_section_t section;
+        snapshot_pread(fd, &section, sizeof(section), offset);
+        if (strncmp(section.name, "ram.raw", sizeof(section.name)) == 0)
+        {
+            snapshot_raw_header_t raw;
+            snapshot_pread(fd, &raw, sizeof(raw), offset + sizeof(section));
+            config->backend = MEMORY_BACKEND_TEMPLATE;
+            config->size = raw.ram_size;
+            config->template_path = path;
+            config->template_offset = raw.data_offset;
+            close(fd);
+            return;
+        }
+        offset += sizeof(section) + section.size;
+    }
+    errx(1, "%s is a snapshot, not a template", path);
+}
+
+#pragma endregion
+
+static void *snapshot_signal_thread(void *arg)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    while (1)
+    {
+        int sig;
+        if (sigwait(&set, &sig) == 0)
+        {
+            if (snapshot_action == SNAPSHOT_ON_SIGNAL_MIGRATE)
+            {
+                snapshot_lazy_wait();
+                if (migration_send(snapshot_path))
+                {
+                    exit(0); // the guest lives on at the other end
+                }
+            }
+            else
+            {
+                snapshot_write(snapshot_path, snapshot_action == SNAPSHOT_ON_SIGNAL_TEMPLATE);
+            }
+        }
+    }
+    return NULL;
+}
+
+// SIGUSR2 writes a snapshot (or a template to clone from) to path or migrates the guest. Like stats_init, this has
+// to run before any other thread exists.
+void snapshot_init(char *path, snapshot_signal_action_t action)
+{
+    snapshot_path = path;
+    snapshot_action = action;
+    if (path == NULL)
+    {
+        return;
+    }
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (pthread_create(&snapshot_thread, NULL, snapshot_signal_thread, NULL) != 0)
+    {
+        errx(1, "Failed to create snapshot thread");
+    }
+}
@@ -0,0 +1,431 @@
+#define _GNU_SOURCE
+#include "stats.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <err.h>
+#include <sys/ioctl.h>
+#include <linux/kvm.h>
+#include "kvm.h"
+
+/*
+Counters are bumped with relaxed atomics from the vcpu threads and only summed up when dumping,
+so the hot path never takes a lock or touches stdout.
+*/
+
+#define STATS_MAX_EXIT_REASON 64
+#define STATS_MAX_PORT 0x10000
+#define STATS_MMIO_SLOTS 256
+#define STATS_HANDLER_SLOTS 64
+#define STATS_HISTOGRAM_BUCKETS 32 // bucket n holds latencies in [2^(n-1), 2^n) ns
+
+typedef struct
+{
+    uint64_t address; // 0 = free
+    uint64_t count;
+} stats_mmio_t;
+
+typedef struct
+{
+    void *handle; // a port or mmio handler, NULL = free
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t histogram[STATS_HISTOGRAM_BUCKETS];
+} stats_handler_t;
+
+static uint64_t exit_reasons[STATS_MAX_EXIT_REASON];
+static uint64_t ports[STATS_MAX_PORT];
+static stats_mmio_t mmios[STATS_MMIO_SLOTS];
+static uint64_t mmio_overflow;
+static stats_handler_t handlers[STATS_HANDLER_SLOTS];
+
+static char *stats_dump_path = NULL;
+static pthread_t stats_thread;
+
+static const char *exit_reason_names[STATS_MAX_EXIT_REASON] = {
+    [KVM_EXIT_UNKNOWN] = "UNKNOWN",
+    [KVM_EXIT_EXCEPTION] = "EXCEPTION",
+    [KVM_EXIT_IO] = "IO",
+    [KVM_EXIT_HYPERCALL] = "HYPERCALL",
+    [KVM_EXIT_DEBUG] = "DEBUG",
+    [KVM_EXIT_HLT] = "HLT",
+    [KVM_EXIT_MMIO] = "MMIO",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "IRQ_WINDOW_OPEN",
+    [KVM_EXIT_SHUTDOWN] = "SHUTDOWN",
+    [KVM_EXIT_FAIL_ENTRY] = "FAIL_ENTRY",
+    [KVM_EXIT_INTR] = "INTR",
+    [KVM_EXIT_SET_TPR] = "SET_TPR",
+    [KVM_EXIT_TPR_ACCESS] = "TPR_ACCESS",
+    [KVM_EXIT_NMI] = "NMI",
+    [KVM_EXIT_INTERNAL_ERROR] = "INTERNAL_ERROR",
+    [KVM_EXIT_SYSTEM_EVENT] = "SYSTEM_EVENT",
+    [KVM_EXIT_IOAPIC_EOI] = "IOAPIC_EOI",
+    [KVM_EXIT_X86_RDMSR] = "X86_RDMSR",
+    [KVM_EXIT_X86_WRMSR] = "X86_WRMSR",
+    [KVM_EXIT_DIRTY_RING_FULL] = "DIRTY_RING_FULL",
+    [KVM_EXIT_X86_BUS_LOCK] = "X86_BUS_LOCK",
+};
+
+void stats_count_exit(uint32_t exit_reason)
+{
+    if (exit_reason < STATS_MAX_EXIT_REASON)
+    {
+        __atomic_fetch_add(&exit_reasons[exit_reason], 1, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_count_port(uint16_t port)
+{
+    __atomic_fetch_add(&ports[port], 1, __ATOMIC_RELAXED);
+}
+
+void stats_count_mmio(uint64_t address)
+{
+    uint32_t slot = (address >> 2) % STATS_MMIO_SLOTS;
+    for (int i = 0; i < STATS_MMIO_SLOTS; i++)
+    {
+        stats_mmio_t *mmio = &mmios[(slot + i) % STATS_MMIO_SLOTS];
+        uint64_t current = __atomic_load_n(&mmio->address, __ATOMIC_ACQUIRE);
+        if (current == 0)
+        {
+            uint64_t expected = 0;
+            if (__atomic_compare_exchange_n(&mmio->address, &expected, address, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                current = address;
+            }
+            else
+            {
+                current = expected; // someone else claimed the slot first
+            }
+        }
+        if (current == address)
+        {
+            __atomic_fetch_add(&mmio->count, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    __atomic_fetch_add(&mmio_overflow, 1, __ATOMIC_RELAXED);
+}
+
+static stats_handler_t *stats_get_handler(void *handle)
+{
+    uint32_t slot = ((uintptr_t)handle >> 4) % STATS_HANDLER_SLOTS;
+    for (int i = 0; i < STATS_HANDLER_SLOTS; i++)
+    {
+        stats_handler_t *handler = &handlers[(slot + i) % STATS_HANDLER_SLOTS];
+        void *current = __atomic_load_n(&handler->handle, __ATOMIC_ACQUIRE);
+        if (current == NULL)
+        {
+            void *expected = NULL;
+            if (__atomic_compare_exchange_n(&handler->handle, &expected, handle, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                current = handle;
+            }
+            else
+            {
+                current = expected;
+            }
+        }
+        if (current == handle)
+        {
+            return handler;
+        }
+    }
+    return NULL;
+}
+
+void stats_record_handler(void *handle, uint64_t start_ns)
+{
+    uint64_t elapsed = stats_now() - start_ns;
+    stats_handler_t *handler = stats_get_handler(handle);
+    if (handler == NULL)
+    {
+        return;
+    }
+
+    int bucket = elapsed == 0 ? 0 : 64 - __builtin_clzll(elapsed);
+    if (bucket >= STATS_HISTOGRAM_BUCKETS)
+    {
+        bucket = STATS_HISTOGRAM_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&handler->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&handler->total_ns, elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&handler->histogram[bucket], 1, __ATOMIC_RELAXED);
+}
+
+static int stats_compare_desc(const void *a, const void *b)
+{
+    uint64_t left = ((const uint64_t *)a)[1];
+    uint64_t right = ((const uint64_t *)b)[1];
+    return (left < right) - (left > right);
+}
+
+static void stats_dump_ports(FILE *file)
+{
+    // (port, count) pairs sorted by count
+    uint64_t (*sorted)[2] = malloc(sizeof(uint64_t[2]) * STATS_MAX_PORT);
+    if (sorted == NULL)
+    {
+        return;
+    }
+    int used = 0;
+    for (int i = 0; i < STATS_MAX_PORT; i++)
+    {
+        uint64_t count = __atomic_load_n(&ports[i], __ATOMIC_RELAXED);
+        if (count != 0)
+        {
+            sorted[used][0] = i;
+            sorted[used][1] = count;
+            used++;
+        }
+    }
+    qsort(sorted, used, sizeof(sorted[0]), stats_compare_desc);
+
+    fprintf(file, "port exits:\n");
+    for (int i = 0; i < used; i++)
+    {
+        fprintf(file, "  0x%04lx %12lu\n", sorted[i][0], sorted[i][1]);
+    }
+    free(sorted);
+}
+
+static void stats_dump_mmio(FILE *file)
+{
+    uint64_t sorted[STATS_MMIO_SLOTS][2];
+    int used = 0;
+    for (int i = 0; i < STATS_MMIO_SLOTS; i++)
+    {
+        uint64_t address = __atomic_load_n(&mmios[i].address, __ATOMIC_ACQUIRE);
+        if (address != 0)
+        {
+            sorted[used][0] = address;
+            sorted[used][1] = __atomic_load_n(&mmios[i].count, __ATOMIC_RELAXED);
+            used++;
+        }
+    }
+    qsort(sorted, used, sizeof(sorted[0]), stats_compare_desc);
+
+    fprintf(file, "mmio exits:\n");
+    for (int i = 0; i < used; i++)
+    {
+        fprintf(file, "  0x%08lx %12lu\n", sorted[i][0], sorted[i][1]);
+    }
+    if (mmio_overflow != 0)
+    {
+        fprintf(file, "  other      %12lu\n", mmio_overflow);
+    }
+}
+
+static void stats_dump_handlers(FILE *file)
+{
+    fprintf(file, "handlers:\n");
+    for (int i = 0; i < STATS_HANDLER_SLOTS; i++)
+    {
+        stats_handler_t *handler = &handlers[i];
+        void *handle = __atomic_load_n(&handler->handle, __ATOMIC_ACQUIRE);
+        uint64_t count = __atomic_load_n(&handler->count, __ATOMIC_RELAXED);
+        if (handle == NULL || count == 0)
+        {
+            continue;
+        }
+
+        Dl_info info;
+        uint64_t total_ns = __atomic_load_n(&handler->total_ns, __ATOMIC_RELAXED);
+        if (dladdr(handle, &info) && info.dli_sname != NULL)
+        {
+            fprintf(file, "  %-32s", info.dli_sname);
+        }
+        else
+        {
+            fprintf(file, "  %-32p", handle);
+        }
+        fprintf(file, " count %10lu, total %10lu us, avg %8lu ns\n", count, total_ns / 1000, total_ns / count);
+
+        for (int bucket = 0; bucket < STATS_HISTOGRAM_BUCKETS; bucket++)
+        {
+            uint64_t hits = __atomic_load_n(&handler->histogram[bucket], __ATOMIC_RELAXED);
+            if (hits != 0)
+            {
+                fprintf(file, "    < %12lu ns %10lu\n", 1UL << bucket, hits);
+            }
+        }
+    }
+}
+
+// Prints every statistic the kernel exposes for the vm or vcpu fd
+static void stats_dump_kvm(FILE *file, const char *title, int fd)
+{
+    int stats_fd = ioctl(fd, KVM_GET_STATS_FD, NULL);
+    if (stats_fd < 0)
+    {
+        return; // older kernels
+    }
+
+    struct kvm_stats_header header;
+    if (pread(stats_fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        close(stats_fd);
+        return;
+    }
+
+    size_t desc_size = sizeof(struct kvm_stats_desc) + header.name_size;
+    uint8_t *descs = malloc(desc_size * header.num_desc);
+    if (descs == NULL || pread(stats_fd, descs, desc_size * header.num_desc, header.desc_offset) != desc_size * header.num_desc)
+    {
+        free(descs);
+        close(stats_fd);
+        return;
+    }
+
+    fprintf(file, "kvm %s:\n", title);
+    for (int i = 0; i < header.num_desc; i++)
+    {
+        struct kvm_stats_desc *desc = (struct kvm_stats_desc *)(descs + i * desc_size);
+        uint64_t values[desc->size];
+        if (pread(stats_fd, values, sizeof(values), header.data_offset + desc->offset) != sizeof(values))
+        {
+            continue;
+        }
+
+        uint32_t type = desc->flags & KVM_STATS_TYPE_MASK;
+        bool empty = true;
+        for (int j = 0; j < desc->size; j++)
+        {
+            empty &= values[j] == 0;
+        }
+        if (empty)
+        {
+            continue;
+        }
+
+        if (type == KVM_STATS_TYPE_LINEAR_HIST || type == KVM_STATS_TYPE_LOG_HIST)
+        {
+            fprintf(file, "  %-40s", desc->name);
+            for (int j = 0; j < desc->size; j++)
+            {
+                if (values[j] != 0)
+                {
+                    fprintf(file, " [%d]=%lu", j, values[j]);
+                }
+            }
+            fprintf(file, "\n");
+        }
+        else
+        {
+            fprintf(file, "  %-40s %12lu\n", desc->name, values[0]);
+        }
+    }
+
+    free(descs);
+    close(stats_fd);
+}
+
+void stats_dump(FILE *file)
+{
+    fprintf(file, "exits by reason:\n");
+    for (int i = 0; i < STATS_MAX_EXIT_REASON; i++)
+    {
+        uint64_t count = __atomic_load_n(&exit_reasons[i], __ATOMIC_RELAXED);
+        if (count != 0)
+        {
+            if (exit_reason_names[i] != NULL)
+            {
+                fprintf(file, "  %-16s %12lu\n", exit_reason_names[i], count);
+            }
+            else
+            {
+                fprintf(file, "  %-16d %12lu\n", i, count);
+            }
+        }
+    }
+
+    stats_dump_ports(file);
+    stats_dump_mmio(file);
+    stats_dump_handlers(file);
+
+    if (kvm_get_vm_fd() > 0)
+    {
+        stats_dump_kvm(file, "vm", kvm_get_vm_fd());
+        for (int i = 0; i < kvm_get_vcpu_count(); i++)
+        {
+            char title[32];
+            snprintf(title, sizeof(title), "vcpu %d", i);
+            stats_dump_kvm(file, title, kvm_get_vcpu(i)->fd);
+        }
+    }
+    fflush(file);
+}
+
+static void stats_dump_to_path()
+{
+    if (stats_dump_path == NULL)
+    {
+        stats_dump(stderr);
+        return;
+    }
+
+    FILE *file = fopen(stats_dump_path, "w");
+    if (file == NULL)
+    {
+        warn("Failed to open stats file");
+        return;
+    }
+    stats_dump(file);
+    fclose(file);
+}
+
+static void *stats_signal_thread(void *arg)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while (1)
+    {
+        int sig;
+        if (sigwait(&set, &sig) == 0)
+        {
+            stats_dump_to_path();
+        }
+    }
+    return NULL;
+}
+
+static bool stats_dumped = false;
+
+// Dumps once, while the kvm stats fds are still open
+void stats_deinit()
+{
+    if (stats_dump_path != NULL && !stats_dumped)
+    {
+        stats_dumped = true;
+        stats_dump_to_path();
+    }
+}
+
+// Only does something for exits that don't go through the end of main (SIGINT, migrating away),
+// those never reach kvm_deinit so the kvm stats are still there
+static void stats_dump_at_exit()
+{
+    stats_deinit();
+}
+
+// Must run before any other thread is created so they all inherit SIGUSR1 being blocked
+void stats_init(char *dump_path)
+{
+    stats_dump_path = dump_path;
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (pthread_create(&stats_thread, NULL, stats_signal_thread, NULL) != 0)
+    {
+        errx(1, "Failed to create stats thread");
+    }
+    atexit(stats_dump_at_exit);
+}
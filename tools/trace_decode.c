@@ -0,0 +1,287 @@
+// Turns the trace.bin written by the vmm into text, or into Chrome trace json with -j (chrome://tracing, Perfetto)
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include "log.h"
+
+typedef struct
+{
+    uint64_t id;
+    char *text;
+} trace_string_t;
+
+static trace_string_t *strings = NULL;
+static size_t strings_count = 0;
+static size_t strings_capacity = 0;
+
+static void strings_add(uint64_t id, char *text)
+{
+    if (strings_count == strings_capacity)
+    {
+        strings_capacity = strings_capacity ? strings_capacity * 2 : 256;
+        strings = realloc(strings, strings_capacity * sizeof(trace_string_t));
+        if (strings == NULL)
+        {
+            err(1, "realloc");
+        }
+    }
+    strings[strings_count++] = (trace_string_t){.id = id, .text = text};
+}
+
+static const char *strings_get(uint64_t id)
+{
+    // the newest definition wins, an address can be reused after a string was freed
+    for (size_t i = strings_count; i > 0; i--)
+    {
+        if (strings[i - 1].id == id)
+        {
+            return strings[i - 1].text;
+        }
+    }
+    return "?";
+}
+
+static void append(char **out, size_t *left, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int written = vsnprintf(*out, *left, fmt, args);
+    va_end(args);
+    if (written < 0)
+    {
+        return;
+    }
+    if (written >= *left)
+    {
+        written = *left - 1;
+    }
+    *out += written;
+    *left -= written;
+}
+
+// printf again, but with the arguments out of the record
+static void format_record(log_record_t *record, char *out, size_t size)
+{
+    const char *fmt = strings_get(record->fmt);
+    char *start = out;
+    int arg = 0;
+    size_t left = size;
+    out[0] = '\0';
+    for (const char *c = fmt; *c != '\0'; c++)
+    {
+        if (*c != '%')
+        {
+            append(&out, &left, "%c", *c);
+            continue;
+        }
+
+        const char *end;
+        log_arg_t type = log_parse_conversion(c + 1, &end);
+        if (type == LOG_ARG_NONE)
+        {
+            if (*end == '%')
+            {
+                append(&out, &left, "%%");
+            }
+            c = *end == '\0' ? end - 1 : end;
+            continue;
+        }
+        if (arg >= record->nargs)
+        {
+            append(&out, &left, "<missing>");
+            c = end;
+            continue;
+        }
+
+        char spec[32];
+        int spec_length = end - c + 1;
+        if (spec_length >= sizeof(spec))
+        {
+            spec_length = sizeof(spec) - 1;
+        }
+        memcpy(spec, c, spec_length);
+        spec[spec_length] = '\0';
+
+        uint64_t value = record->args[arg++];
+        switch (type)
+        {
+        case LOG_ARG_STRING:
+            append(&out, &left, spec, strings_get(value));
+            break;
+        case LOG_ARG_POINTER:
+            append(&out, &left, spec, (void *)value);
+            break;
+        case LOG_ARG_DOUBLE:
+        {
+            double number;
+            memcpy(&number, &value, sizeof(number));
+            append(&out, &left, spec, number);
+            break;
+        }
+        case LOG_ARG_LONG:
+            append(&out, &left, spec, (unsigned long long)value);
+            break;
+        default:
+            append(&out, &left, spec, (unsigned int)value);
+            break;
+        }
+        c = end;
+    }
+
+    // a lot of the messages still carry the newline from their printf days
+    size_t length = strlen(start);
+    while (length > 0 && (start[length - 1] == '\n' || start[length - 1] == ' '))
+    {
+        start[--length] = '\0';
+    }
+}
+
+static void print_json_string(const char *text)
+{
+    putchar('"');
+    for (const char *c = text; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            printf("\\%c", *c);
+        }
+        else if ((unsigned char)*c < 0x20)
+        {
+            printf("\\u%04x", *c);
+        }
+        else
+        {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+static void read_exact(void *buffer, size_t size, FILE *file)
+{
+    if (fread(buffer, 1, size, file) != size)
+    {
+        errx(1, "Truncated trace");
+    }
+}
+
+static void usage(char *name)
+{
+    errx(1, "Usage: %s [-j] <trace.bin>\n"
+            "  -j  output Chrome trace event json instead of text",
+         name);
+}
+
+int main(int argc, char *argv[])
+{
+    bool json = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "j")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            json = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1)
+    {
+        usage(argv[0]);
+    }
+
+    FILE *file = fopen(argv[optind], "rb");
+    if (file == NULL)
+    {
+        err(1, "Failed to open %s", argv[optind]);
+    }
+
+    log_trace_header_t header;
+    read_exact(&header, sizeof(header), file);
+    if (memcmp(header.magic, LOG_TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != LOG_TRACE_VERSION || header.record_size != sizeof(log_record_t))
+    {
+        errx(1, "Not a version %d trace", LOG_TRACE_VERSION);
+    }
+
+    if (json)
+    {
+        printf("{\"traceEvents\":[\n");
+    }
+    bool first = true;
+    uint64_t start = 0;
+    uint32_t type;
+    char message[1024];
+    while (fread(&type, sizeof(type), 1, file) == 1)
+    {
+        switch (type)
+        {
+        case LOG_TRACE_STRING:
+        {
+            uint64_t id;
+            uint32_t length;
+            read_exact(&id, sizeof(id), file);
+            read_exact(&length, sizeof(length), file);
+            char *text = malloc(length + 1);
+            if (text == NULL)
+            {
+                err(1, "malloc");
+            }
+            read_exact(text, length, file);
+            text[length] = '\0';
+            strings_add(id, text);
+            break;
+        }
+        case LOG_TRACE_EVENT:
+        {
+            log_record_t record;
+            read_exact(&record, sizeof(record), file);
+            if (start == 0)
+            {
+                start = record.timestamp;
+            }
+            format_record(&record, message, sizeof(message));
+            uint64_t elapsed = record.timestamp - start;
+            if (json)
+            {
+                printf("%s{\"name\":", first ? "" : ",\n");
+                print_json_string(message);
+                printf(",\"cat\":");
+                print_json_string(strings_get(record.module));
+                printf(",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lu.%03lu,\"pid\":1,\"tid\":%u,\"args\":{\"rip\":\"0x%lx\"}}",
+                       elapsed / 1000, elapsed % 1000, record.tid, record.rip);
+                first = false;
+            }
+            else
+            {
+                printf("%lu.%09lu %u [0x%lx - %s] %s\n", elapsed / 1000000000, elapsed % 1000000000, record.tid, record.rip, strings_get(record.module), message);
+            }
+            break;
+        }
+        case LOG_TRACE_DROPPED:
+        {
+            uint32_t dropped[2];
+            read_exact(dropped, sizeof(dropped), file);
+            if (!json)
+            {
+                printf("--- thread %u dropped %u events\n", dropped[0], dropped[1]);
+            }
+            break;
+        }
+        default:
+            errx(1, "Unknown trace entry %u", type);
+        }
+    }
+    if (json)
+    {
+        printf("\n]}\n");
+    }
+
+    fclose(file);
+    return 0;
+}